@@ -1,12 +1,61 @@
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <map>
+#include <iterator>
 #include <cassert>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
 
+#include "bgrep.h"
+
+#ifdef BGREP_LIBRARY
+// The command line helpers stay in, unused without main().
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+
+// Compressed inputs (-z); each library is optional.
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+class Throttle;
+
 class Reader
 {
 public:
@@ -16,8 +65,186 @@ public:
     { }
     virtual int read(char *buffer, size_t buffer_size) = 0;
     virtual uint64_t tell() const = 0;
+    // Like read, but *data is set to where the bytes can be found, which
+    // is either buffer or memory owned by the reader that stays valid
+    // until released.
+    virtual int view(char *buffer, size_t buffer_size, const char **data);
+    // The caller no longer references any byte before offset.
+    virtual void release(uint64_t /* offset */)
+    { }
+    // Restricts reading to source bytes [start, end). Only seekable
+    // readers support it.
+    virtual bool setRange(uint64_t /* start */, uint64_t /* end */)
+    { return false; }
+    // Leaves out the sorted, disjoint source ranges skipped, which read
+    // as zeros. Only seekable readers support it.
+    virtual bool setSkipped(const std::vector<std::pair<uint64_t, uint64_t> > & /* skipped */)
+    { return false; }
+    // Paces reads through throttle, which other readers may share. Only
+    // readers that issue their own reads support it.
+    virtual bool setThrottle(Throttle * /* throttle */)
+    { return false; }
+
+    // Largest view: the slot size limit.
+    static const size_t kMaxView = 256 * 1024 * 1024;
+    // kMaxView zero bytes, handed out as the view of holes. The pages are
+    // never written, so they all map the kernel's zero page.
+    static const char *zeros();
+};
+
+int Reader::view(char *buffer, size_t buffer_size, const char **data)
+{
+    *data = buffer;
+    return read(buffer, buffer_size);
+}
+
+const char *Reader::zeros()
+{
+    static const char *zeros = (const char *)::mmap(NULL, kMaxView, PROT_READ,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                                    -1, 0);
+    return zeros;
+}
+
+// Finds the holes of a sparse regular file with SEEK_HOLE and SEEK_DATA,
+// and the ranges left out with --blocks, which read as zeros too.
+// Answers are cached, so walking a file in order costs two lseeks per
+// hole.
+class HoleMap
+{
+public:
+    typedef std::vector<std::pair<uint64_t, uint64_t> > Extents;
+
+    // Left out ranges shorter than this are read and zeroed instead, so
+    // that reads stay large and sequential.
+    static const uint64_t kMinSkip = 1024 * 1024;
+
+    HoleMap();
+    // Only regular files have holes; for anything else there are none.
+    void open(int fd);
+    // Sorted, disjoint [start, end) source ranges that are not read.
+    void setSkipped(const Extents &skipped);
+    // The first hole ending past offset, as [*start, *end); false if
+    // there is none.
+    bool next(uint64_t offset, uint64_t *start, uint64_t *end);
+    // Whether data read at offset overlaps a left out range, and zeroes
+    // those bytes.
+    bool overlaps(uint64_t offset, size_t length) const;
+    void zeroSkipped(uint64_t offset, char *data, size_t length) const;
+
+private:
+    // The first of extents ending past offset, or extents.end().
+    static Extents::const_iterator firstPast(const Extents &extents, uint64_t offset);
+    bool nextFileHole(uint64_t offset, uint64_t *start, uint64_t *end);
+
+    int _fd;
+    uint64_t _size;
+    uint64_t _from;     // the cached hole is the first one past _from
+    uint64_t _start;
+    uint64_t _end;
+    Extents _skipped;
+    Extents _long_skipped; // those of _skipped at least kMinSkip long
 };
 
+HoleMap::HoleMap()
+        : _fd(-1),
+          _size(0),
+          _from(1),
+          _start(0),
+          _end(0)
+{ }
+
+void HoleMap::open(int fd)
+{
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    // Files with all their blocks allocated have nothing to skip.
+    if ((uint64_t)st.st_blocks * 512 >= (uint64_t)st.st_size)
+        return;
+    _fd = fd;
+    _size = st.st_size;
+}
+
+void HoleMap::setSkipped(const Extents &skipped)
+{
+    _skipped = skipped;
+    _long_skipped.clear();
+    for (size_t i = 0; i < skipped.size(); ++i)
+    {
+        if (skipped[i].second - skipped[i].first >= kMinSkip)
+            _long_skipped.push_back(skipped[i]);
+    }
+}
+
+static bool extentEndsBefore(const std::pair<uint64_t, uint64_t> &extent, uint64_t offset)
+{
+    return extent.second <= offset;
+}
+
+HoleMap::Extents::const_iterator HoleMap::firstPast(const Extents &extents, uint64_t offset)
+{
+    return std::lower_bound(extents.begin(), extents.end(), offset, extentEndsBefore);
+}
+
+bool HoleMap::next(uint64_t offset, uint64_t *start, uint64_t *end)
+{
+    bool found = nextFileHole(offset, start, end);
+    Extents::const_iterator skip = firstPast(_long_skipped, offset);
+    if (skip != _long_skipped.end() && (!found || skip->first < *start))
+    {
+        *start = std::max(skip->first, offset);
+        *end = skip->second;
+        found = true;
+    }
+    return found;
+}
+
+bool HoleMap::nextFileHole(uint64_t offset, uint64_t *start, uint64_t *end)
+{
+    if (_fd < 0 || offset >= _size)
+        return false;
+    if (offset < _from || offset >= _end)
+    {
+        _from = offset;
+        off_t hole = ::lseek(_fd, offset, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole >= _size)
+        {
+            // No holes, or none the file system reports.
+            _start = _end = _size;
+            ::lseek(_fd, offset, SEEK_SET);
+            return false;
+        }
+        off_t data = ::lseek(_fd, hole, SEEK_DATA);
+        _start = hole;
+        // ENXIO: the file ends in the hole.
+        _end = data < 0 ? _size : data;
+        ::lseek(_fd, offset, SEEK_SET);
+    }
+    if (_start >= _size)
+        return false;
+    *start = std::max(_start, offset);
+    *end = _end;
+    return true;
+}
+
+bool HoleMap::overlaps(uint64_t offset, size_t length) const
+{
+    Extents::const_iterator skip = firstPast(_skipped, offset);
+    return skip != _skipped.end() && skip->first < offset + length;
+}
+
+void HoleMap::zeroSkipped(uint64_t offset, char *data, size_t length) const
+{
+    for (Extents::const_iterator skip = firstPast(_skipped, offset);
+         skip != _skipped.end() && skip->first < offset + length; ++skip)
+    {
+        uint64_t start = std::max(skip->first, offset);
+        uint64_t end = std::min(skip->second, offset + length);
+        memset(data + (start - offset), 0, end - start);
+    }
+}
+
 class StreamReader : public Reader
 {
 public:
@@ -28,11 +255,13 @@ public:
     
 private:
     std::istream *_stream;
+    uint64_t _pos;        // tellg() fails once a short read sets failbit
 };
 
 StreamReader::StreamReader(std::istream *stream)
         : Reader(),
-          _stream(stream)
+          _stream(stream),
+          _pos(0)
 { }
 
 StreamReader::~StreamReader()
@@ -42,338 +271,9862 @@ int StreamReader::read(char *buffer, size_t buffer_size)
 {
     assert(_stream != NULL);
     if (_stream->eof())
-        return -1;
+        return 0;
     _stream->read(buffer, buffer_size);
+    if (_stream->bad())
+        return -1;
+    _pos += _stream->gcount();
     return _stream->gcount();
 }
 
 uint64_t StreamReader::tell() const
 {
-    return _stream->tellg();
+    return _pos;
 }
 
-class FileReader : public Reader
+// Unreadable sectors found with --rescue, per input, shared by every
+// reader of a run. With a map file, ranges are appended to it as they are
+// found and those it lists are not read again, so a scan resumed from a
+// checkpoint does not wait on them a second time.
+class BadBlocks
 {
 public:
-    FileReader();
-    virtual ~FileReader();
-    bool open(const std::string &path);
-    virtual int read(char *buffer, size_t buffer_size);
-    virtual uint64_t tell() const;
+    BadBlocks();
+    ~BadBlocks();
+    // Loads the ranges in path, if it exists, and appends new ones to it.
+    bool open(const char *path);
+    void add(const std::string &input, uint64_t start, uint64_t end);
+    // The first bad range of input ending past offset, as [*start, *end);
+    // false if there is none.
+    bool next(const std::string &input, uint64_t offset, uint64_t *start, uint64_t *end) const;
+    // Ranges and bytes recorded over all inputs.
+    size_t count() const;
+    uint64_t bytes() const;
 
 private:
-    int _fd;
-    uint64_t _pos;
+    typedef std::map<uint64_t, uint64_t> Ranges; // start -> end, disjoint
+
+    static void insert(Ranges *ranges, uint64_t start, uint64_t end);
+
+    mutable pthread_mutex_t _lock;
+    FILE *_file;
+    std::map<std::string, Ranges> _inputs;
 };
 
-FileReader::FileReader() : _fd(-1), _pos(0)
-{ }
+BadBlocks::BadBlocks()
+        : _file(NULL)
+{
+    pthread_mutex_init(&_lock, NULL);
+}
 
-FileReader::~FileReader()
+BadBlocks::~BadBlocks()
 {
-    if (_fd != -1)
-    {
-        ::close(_fd);
-        _fd = -1;
-    }
+    if (_file != NULL)
+        fclose(_file);
+    pthread_mutex_destroy(&_lock);
 }
 
-bool FileReader::open(const std::string &path)
+bool BadBlocks::open(const char *path)
 {
-    int fd = ::open(path.c_str(), O_RDONLY);
-    if (fd < 0)
+    // One range per line: hex start and length, then the input.
+    FILE *file = fopen(path, "a+");
+    if (file == NULL)
         return false;
-    _fd = fd;
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        unsigned long long start = 0;
+        unsigned long long length = 0;
+        int name = 0;
+        if (line[0] == '#' || sscanf(line, "%llx %llx %n", &start, &length, &name) != 2
+            || name == 0)
+            continue;
+        std::string input(line + name);
+        if (!input.empty() && input[input.size() - 1] == '\n')
+            input.resize(input.size() - 1);
+        if (length > 0)
+            insert(&_inputs[input], start, start + length);
+    }
+    if (ftell(file) == 0)
+        fprintf(file, "# bgrep bad blocks: start length input\n");
+    fflush(file);
+    _file = file;
     return true;
 }
 
-int FileReader::read(char *buffer, size_t buffer_size)
+void BadBlocks::insert(Ranges *ranges, uint64_t start, uint64_t end)
 {
-    int nread = ::read(_fd, buffer, buffer_size);
-    _pos += nread;
-    return nread;
+    // Merge with the ranges it touches.
+    Ranges::iterator it = ranges->upper_bound(start);
+    if (it != ranges->begin())
+    {
+        Ranges::iterator prev = it;
+        --prev;
+        if (prev->second >= start)
+        {
+            start = prev->first;
+            it = prev;
+        }
+    }
+    while (it != ranges->end() && it->first <= end)
+    {
+        end = std::max(end, it->second);
+        ranges->erase(it++);
+    }
+    (*ranges)[start] = end;
 }
 
-uint64_t FileReader::tell() const
+void BadBlocks::add(const std::string &input, uint64_t start, uint64_t end)
 {
-    return _pos;
+    pthread_mutex_lock(&_lock);
+    insert(&_inputs[input], start, end);
+    if (_file != NULL)
+    {
+        // Flushed at once: the run is likely to end badly.
+        fprintf(_file, "0x%llx 0x%llx %s\n", (unsigned long long)start,
+                (unsigned long long)(end - start), input.c_str());
+        fflush(_file);
+    }
+    pthread_mutex_unlock(&_lock);
 }
 
-class Collector
+bool BadBlocks::next(const std::string &input, uint64_t offset,
+                     uint64_t *start, uint64_t *end) const
 {
-public:
-    Collector()
-    { }
-    virtual ~Collector()
-    { }
+    bool found = false;
+    pthread_mutex_lock(&_lock);
+    std::map<std::string, Ranges>::const_iterator ranges = _inputs.find(input);
+    if (ranges != _inputs.end())
+    {
+        Ranges::const_iterator it = ranges->second.upper_bound(offset);
+        if (it != ranges->second.begin())
+        {
+            Ranges::const_iterator prev = it;
+            --prev;
+            if (prev->second > offset)
+                it = prev;
+        }
+        if (it != ranges->second.end())
+        {
+            *start = std::max(it->first, offset);
+            *end = it->second;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+    return found;
+}
 
-    virtual void collect(const char *buffer, size_t buffer_size) = 0;
-};
+size_t BadBlocks::count() const
+{
+    size_t count = 0;
+    pthread_mutex_lock(&_lock);
+    for (std::map<std::string, Ranges>::const_iterator it = _inputs.begin();
+         it != _inputs.end(); ++it)
+        count += it->second.size();
+    pthread_mutex_unlock(&_lock);
+    return count;
+}
 
-class StreamCollector : public Collector
+uint64_t BadBlocks::bytes() const
+{
+    uint64_t bytes = 0;
+    pthread_mutex_lock(&_lock);
+    for (std::map<std::string, Ranges>::const_iterator it = _inputs.begin();
+         it != _inputs.end(); ++it)
+    {
+        for (Ranges::const_iterator range = it->second.begin(); range != it->second.end(); ++range)
+            bytes += range->second - range->first;
+    }
+    pthread_mutex_unlock(&_lock);
+    return bytes;
+}
+
+// Paces the reads of a run, for scans on hosts that serve traffic: token
+// buckets for bytes and for reads, shared by every reader. A read waits
+// out the debt of those before it, then takes its tokens, going into
+// debt for large reads, and reports its latency once done. With a
+// latency target the byte rate follows the device: it is halved when the
+// p99 read latency of a period goes over the target and creeps back up
+// while it stays well under.
+class Throttle
 {
 public:
-    StreamCollector(std::ostream *stream);
-    virtual ~StreamCollector();
-    virtual void collect(const char *buffer, size_t buffer_size);
-    
+    // rate in bytes and iops in reads per second, 0: unlimited;
+    // max_latency in nanoseconds, 0: the rate stays as given.
+    Throttle(uint64_t rate, uint64_t iops, uint64_t max_latency);
+    ~Throttle();
+    // Waits until a read of bytes may be issued.
+    void acquire(uint64_t bytes);
+    // A read of asked bytes issued with acquire returned bytes after
+    // latency nanoseconds. Bytes it fell short by are given back.
+    void done(uint64_t asked, uint64_t bytes, uint64_t latency);
+    // Byte rate in force, 0: unlimited.
+    uint64_t rate() const;
+    // Monotonic nanoseconds.
+    static uint64_t clock();
+
 private:
-    std::ostream *_stream;
+    // Latency samples are evaluated once there are this many, or a
+    // period has passed.
+    static const size_t kWindow = 128;
+    static const uint64_t kPeriod = 1000000000ULL;
+    // Bursts are capped at this much time's worth of tokens.
+    static const uint64_t kBurst = 100000000ULL;
+    // Backing off never goes below this rate, so the scan goes on.
+    static const uint64_t kMinRate = 1024 * 1024;
+
+    void refill(uint64_t now);
+    void adapt(uint64_t now);
+
+    mutable pthread_mutex_t _lock;
+    uint64_t _max_rate;
+    uint64_t _iops;
+    uint64_t _max_latency;
+    uint64_t _rate;
+    double _bytes;                    // tokens, negative in debt
+    double _reads;
+    uint64_t _last;                   // when tokens were last added
+    std::vector<uint64_t> _latencies; // of the current period
+    uint64_t _period_bytes;
+    uint64_t _period_start;
 };
 
-StreamCollector::StreamCollector(std::ostream *stream)
-        : Collector(),
-          _stream(stream)
-{ }
+// std::min and std::max take it by reference.
+const uint64_t Throttle::kMinRate;
 
-StreamCollector::~StreamCollector()
-{ }
+Throttle::Throttle(uint64_t rate, uint64_t iops, uint64_t max_latency)
+        : _max_rate(rate),
+          _iops(iops),
+          _max_latency(max_latency),
+          _rate(rate),
+          _bytes(0),
+          _reads(0),
+          _last(clock()),
+          _period_bytes(0),
+          _period_start(_last)
+{
+    pthread_mutex_init(&_lock, NULL);
+    // Start with a full burst.
+    _bytes = (double)_rate * kBurst / 1e9;
+    _reads = std::max(1.0, (double)_iops * kBurst / 1e9);
+}
 
-void StreamCollector::collect(const char *buffer, size_t buffer_size)
+Throttle::~Throttle()
 {
-    assert(_stream != NULL);
-    _stream->write(buffer, buffer_size);
+    pthread_mutex_destroy(&_lock);
 }
 
-class Target
+uint64_t Throttle::clock()
 {
-public:
-    Target()
-    { }
-    ~Target()
-    { }
-    
-    virtual bool match(const char *str, size_t len) const;
-    void addTarget(const std::string &target);
-    
-private:
-    std::vector<std::string> _targets;
-};
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-void Target::addTarget(const std::string &target)
+void Throttle::refill(uint64_t now)
 {
-    _targets.push_back(target);
+    double elapsed = (now - _last) / 1e9;
+    _last = now;
+    _bytes = _rate > 0 ? std::min(_bytes + elapsed * _rate, (double)_rate * kBurst / 1e9) : 0;
+    _reads = _iops > 0 ? std::min(_reads + elapsed * _iops,
+                                  std::max(1.0, (double)_iops * kBurst / 1e9)) : 0;
 }
 
-bool Target::match(const char *str, size_t len) const
+void Throttle::acquire(uint64_t bytes)
 {
-    bool matched = false;
-    for (size_t i = 0; i < _targets.size(); ++i)
+    pthread_mutex_lock(&_lock);
+    refill(clock());
+    // Taking the tokens now queues concurrent readers behind this one.
+    double wait = 0;
+    if (_rate > 0)
     {
-        const std::string &target = _targets[i];
-        if (memmem(str, len, target.c_str(), target.size()) != NULL)
-        {
-            matched = true;
-            break;
-        }
+        wait = std::max(wait, -_bytes / _rate);
+        _bytes -= bytes;
+    }
+    if (_iops > 0)
+    {
+        wait = std::max(wait, -_reads / _iops);
+        _reads -= 1;
+    }
+    pthread_mutex_unlock(&_lock);
+    if (wait > 0)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        while (::nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        { }
     }
-    return matched;
 }
 
-class RingBuffer
+void Throttle::done(uint64_t asked, uint64_t bytes, uint64_t latency)
 {
-public:
-    RingBuffer(int buf_num, int buf_size, const Target *target);
-    ~RingBuffer();
-    char *getBuffer(int buffer_idx);
-    inline int getBufferSize() const;
-    bool readFrom(Reader *reader, Collector *collector);
-    void collectTo(int start, Collector *collector) const;
-    
-private:
-    char **_buffer;
-    int _buffer_num;
-    int _buffer_size;
-    int _next_buffer_idx;
-    int _matched_buffer_idx;
-    const Target *_target;
-    char *_buffer_print_flag; // 0: not printed
-};
+    pthread_mutex_lock(&_lock);
+    if (_rate > 0 && bytes < asked)
+        _bytes += asked - bytes;
+    if (_max_latency == 0)
+    {
+        pthread_mutex_unlock(&_lock);
+        return;
+    }
+    _latencies.push_back(latency);
+    _period_bytes += bytes;
+    uint64_t now = clock();
+    if (_latencies.size() >= kWindow || now - _period_start >= kPeriod)
+        adapt(now);
+    pthread_mutex_unlock(&_lock);
+}
 
-RingBuffer::RingBuffer(int buffer_num, int buffer_size, const Target *target)
-        : _buffer_num(buffer_num),
-          _buffer_size(buffer_size),
-          _next_buffer_idx(0),
-          _matched_buffer_idx(-1),
-          _target(target)
+void Throttle::adapt(uint64_t now)
 {
-    assert(_buffer_num > 0);
-    assert(_buffer_size > 0);
-    _buffer = new char *[_buffer_num];
-    _buffer_print_flag = new char[_buffer_num];
-    for (int i = 0; i < _buffer_num; ++i)
+    std::sort(_latencies.begin(), _latencies.end());
+    uint64_t p99 = _latencies[_latencies.size() * 99 / 100];
+    uint64_t elapsed = now - _period_start;
+    double delivered = elapsed > 0 ? _period_bytes * 1e9 / elapsed : 0;
+    uint64_t floor = _max_rate > 0 ? std::min(kMinRate, _max_rate) : kMinRate;
+    refill(now);
+    if (p99 > _max_latency)
     {
-        _buffer[i] = new char[_buffer_size];
-        _buffer_print_flag[i] = 1;
+        // Halve what the device delivered, which an unlimited or a high
+        // rate says nothing about.
+        double base = _rate > 0 ? std::min((double)_rate, delivered) : delivered;
+        _rate = std::max(floor, (uint64_t)(base / 2));
+    }
+    else if (_rate > 0 && p99 < _max_latency / 2)
+    {
+        _rate += _rate / 8 + floor;
+        if (_max_rate > 0)
+            _rate = std::min(_rate, _max_rate);
+        else if (_rate > 2 * delivered && delivered > 0)
+            _rate = 0;   // no longer what holds the scan back
     }
+    _latencies.clear();
+    _period_bytes = 0;
+    _period_start = now;
 }
 
-RingBuffer::~RingBuffer()
+uint64_t Throttle::rate() const
 {
-    for (int i = 0; i < _buffer_num; ++i)
-        delete _buffer[i];
-    delete _buffer;
-    _buffer = NULL;
+    pthread_mutex_lock(&_lock);
+    uint64_t rate = _rate;
+    pthread_mutex_unlock(&_lock);
+    return rate;
 }
 
-bool RingBuffer::readFrom(Reader *reader, Collector *collector)
+// Reads a file descriptor in large chunks, optionally with O_DIRECT so a
+// sweep over a whole device does not go through the page cache. Windows
+// handed out by view() point into the chunks, which are recycled once
+// released.
+class FileReader : public Reader
 {
-    int buffer_idx = _next_buffer_idx++;
-    _next_buffer_idx %= _buffer_num;
-    char *buffer = _buffer[buffer_idx];
-    
-    int nread = reader->read(buffer, _buffer_size);
-    _buffer_print_flag[buffer_idx] = 0;
+public:
+    static const size_t kDefaultIoSize = 4 * 1024 * 1024;
+    // O_DIRECT needs buffers, offsets and sizes aligned to the logical
+    // block size; a page covers every device we care about.
+    static const size_t kAlignment = 4096;
 
-    uint64_t total_read = reader->tell();
-    if (total_read % (1024 * 1024 * 1024) == 0)
-    {
-        fprintf(stderr, "%llu scanned\n", (total_read / (1024 * 1024 * 1024)));
-    }
+    FileReader();
+    virtual ~FileReader();
+    bool open(const std::string &path, bool direct = false,
+              size_t io_size = kDefaultIoSize);
+    virtual int read(char *buffer, size_t buffer_size);
+    virtual uint64_t tell() const;
+    virtual int view(char *buffer, size_t buffer_size, const char **data);
+    virtual void release(uint64_t offset);
+    virtual bool setRange(uint64_t start, uint64_t end);
+    virtual bool setSkipped(const std::vector<std::pair<uint64_t, uint64_t> > &skipped);
+    virtual bool setThrottle(Throttle *throttle);
+    bool isDirect() const { return _direct; }
+    // Reads past sectors that fail instead of ending there: they are
+    // tried retries more times, then recorded in bad and read as zeros.
+    // Ranges bad already lists are not read.
+    void setRescue(BadBlocks *bad, unsigned retries);
 
-    if (nread <= 0)
+protected:
+    struct Chunk
     {
-        if (_matched_buffer_idx >= 0)
-        {
-            int start = _matched_buffer_idx + _buffer_num / 2;
-            start %= _buffer_num;
-            collectTo(start, collector);
-            _matched_buffer_idx = -1;
-        }
-        return false;
-    }
+        char *data;       // NULL for a hole, which reads as zeros()
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // Appends the chunk starting at _fill_pos to _chunks.
+    virtual bool fill();
+    bool clipToData(uint64_t offset, size_t *length, uint64_t *hole_end);
+    ssize_t readFull(char *data, size_t length);
+    size_t rescue(char *data, uint64_t offset, size_t length);
+    // Reads length bytes at offset unless the input ends first; *done is
+    // set to the bytes read either way. False on a read error.
+    virtual bool readAt(char *data, size_t length, uint64_t offset, size_t *done);
+    char *allocChunk();
+    void setBuffered();
+
+protected:
+    int _fd;
+    uint64_t _pos;
+    bool _direct;
+    bool _error;
+    size_t _io_size;
+    uint64_t _fill_pos;          // source offset of the next chunk
+    uint64_t _end;
+    std::deque<Chunk> _chunks;   // oldest first, all still referenced
+    std::vector<char *> _free;
+    HoleMap _holes;
+    std::string _path;
+    BadBlocks *_bad;             // NULL: read errors end the input
+    unsigned _retries;
+    uint64_t _sector;            // unit bad ranges are pinned down to
+    Throttle *_throttle;         // NULL: reads are not paced
+};
+
+FileReader::FileReader()
+        : _fd(-1),
+          _pos(0),
+          _direct(false),
+          _error(false),
+          _io_size(kDefaultIoSize),
+          _fill_pos(0),
+          _end(UINT64_MAX),
+          _bad(NULL),
+          _retries(0),
+          _sector(512),
+          _throttle(NULL)
+{ }
 
-    if (_matched_buffer_idx < 0 && _target->match(buffer, nread))
+FileReader::~FileReader()
+{
+    if (_fd != -1)
     {
-        fprintf(stderr, "%llu matched\n", reader->tell());
-        _matched_buffer_idx = buffer_idx;
+        ::close(_fd);
+        _fd = -1;
     }
+    for (size_t i = 0; i < _chunks.size(); ++i)
+        free(_chunks[i].data);
+    for (size_t i = 0; i < _free.size(); ++i)
+        free(_free[i]);
+}
 
-    if (_matched_buffer_idx >= 0)
+bool FileReader::open(const std::string &path, bool direct, size_t io_size)
+{
+    assert(io_size > 0 && io_size % kAlignment == 0);
+    int fd = ::open(path.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+    if (fd < 0 && direct && errno == EINVAL)
     {
-        int start = _matched_buffer_idx + _buffer_num / 2;
-        start %= _buffer_num;
-        if (_next_buffer_idx == start)
-        {
-            collectTo(start, collector);
-            _matched_buffer_idx = -1;
-        }
+        direct = false;
+        fd = ::open(path.c_str(), O_RDONLY);
     }
-
+    if (fd < 0)
+        return false;
+    _fd = fd;
+    _path = path;
+    _direct = direct;
+    _io_size = io_size;
+    if (!_direct)
+        setBuffered();
+    _holes.open(_fd);
     return true;
 }
 
-void RingBuffer::collectTo(int start, Collector *collector) const
+void FileReader::setRescue(BadBlocks *bad, unsigned retries)
 {
-    for (int i = start; i < _buffer_num; ++i)
-    {
-        if (_buffer_print_flag[i] == 0)
-        {
-            collector->collect(_buffer[i], _buffer_size);
+    _bad = bad;
+    _retries = retries;
+    // Devices are read down to their logical sectors, which is also what
+    // O_DIRECT needs; files down to 512 bytes.
+    struct stat st;
+    int sector = 0;
+    if (::fstat(_fd, &st) == 0 && S_ISBLK(st.st_mode)
+        && ::ioctl(_fd, BLKSSZGET, &sector) == 0 && sector > 0)
+        _sector = sector;
+}
+
+void FileReader::setBuffered()
+{
+    _direct = false;
+    ::posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+char *FileReader::allocChunk()
+{
+    char *data = NULL;
+    if (!_free.empty())
+    {
+        data = _free.back();
+        _free.pop_back();
+    }
+    else if (::posix_memalign((void **)&data, kAlignment, _io_size) != 0)
+    {
+        data = NULL;
+    }
+    return data;
+}
+
+bool FileReader::setSkipped(const std::vector<std::pair<uint64_t, uint64_t> > &skipped)
+{
+    _holes.setSkipped(skipped);
+    return true;
+}
+
+bool FileReader::setThrottle(Throttle *throttle)
+{
+    _throttle = throttle;
+    return true;
+}
+
+bool FileReader::setRange(uint64_t start, uint64_t end)
+{
+    assert(_chunks.empty());
+    if (::lseek(_fd, start, SEEK_SET) == (off_t)-1)
+        return false;
+    _pos = _fill_pos = start;
+    _end = end;
+    return true;
+}
+
+ssize_t FileReader::readFull(char *data, size_t length)
+{
+    // Pipes and network block devices return what they have; gather a
+    // whole chunk so slots stay full and nothing is padded.
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t nread = ::read(_fd, data + done, length - done);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0)
+            return done > 0 ? (ssize_t)done : -1;
+        if (nread == 0)
+            break;
+        done += nread;
+    }
+    return done;
+}
+
+bool FileReader::readAt(char *data, size_t length, uint64_t offset, size_t *done)
+{
+    *done = 0;
+    while (*done < length)
+    {
+        ssize_t nread = ::pread(_fd, data + *done, length - *done, offset + *done);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0)
+            return false;
+        if (nread == 0)
+            break;
+        *done += nread;
+    }
+    return true;
+}
+
+// Reads [offset, offset + length) into data around sectors that fail,
+// the way ddrescue does. A range that fails is halved on sector
+// boundaries until the failure is pinned to one sector, which is tried
+// _retries more times and then recorded as bad and zeroed. The halves
+// that read fine are read whole, so reads are large again right past a
+// bad spot. Returns the bytes covered, short only at the end of input.
+size_t FileReader::rescue(char *data, uint64_t offset, size_t length)
+{
+    // Known bad, say found by the thread reading the shard before.
+    uint64_t bad_start = 0;
+    uint64_t bad_end = 0;
+    if (_bad->next(_path, offset, &bad_start, &bad_end) && bad_start == offset
+        && bad_end >= offset + length)
+    {
+        memset(data, 0, length);
+        return length;
+    }
+    size_t done = 0;
+    if (readAt(data, length, offset, &done))
+        return done;
+
+    // Bytes before the failure are good.
+    uint64_t start = offset + done;
+    size_t rest = length - done;
+    uint64_t sector_end = (start / _sector + 1) * _sector;
+    if (rest <= sector_end - start)
+    {
+        for (unsigned i = 0; i < _retries; ++i)
+        {
+            size_t n = 0;
+            if (readAt(data + done, rest, start, &n))
+                return done + n;
+        }
+        memset(data + done, 0, rest);
+        _bad->add(_path, start, start + rest);
+        return length;
+    }
+    uint64_t middle = (start + rest / 2) / _sector * _sector;
+    if (middle <= start)
+        middle = sector_end;
+    size_t first = middle - start;
+    size_t head = rescue(data + done, start, first);
+    if (head < first)
+        return done + head;
+    return done + first + rescue(data + done + first, middle, rest - first);
+}
+
+// Shortens a read of length bytes at offset that would run into a hole
+// or a known bad range; true if offset is in one, which then is
+// [offset, *hole_end).
+bool FileReader::clipToData(uint64_t offset, size_t *length, uint64_t *hole_end)
+{
+    uint64_t hole_start = 0;
+    // Holes start on file system blocks, which O_DIRECT reads can end on.
+    uint64_t unit = _direct ? kAlignment : 1;
+    bool found = _holes.next(offset, &hole_start, hole_end);
+    uint64_t bad_start = 0;
+    uint64_t bad_end = 0;
+    if (_bad != NULL && _bad->next(_path, offset, &bad_start, &bad_end)
+        && (!found || bad_start < hole_start))
+    {
+        // Bad ranges start on sectors.
+        hole_start = bad_start;
+        *hole_end = bad_end;
+        unit = _direct ? _sector : 1;
+        found = true;
+    }
+    if (!found)
+        return false;
+    *hole_end = std::min(*hole_end, _end);
+    if (hole_start == offset)
+        return true;
+    if (hole_start < offset + *length && (hole_start - offset) % unit == 0)
+        *length = hole_start - offset;
+    return false;
+}
+
+bool FileReader::fill()
+{
+    if (_fill_pos >= _end)
+        return false;
+    size_t length = std::min((uint64_t)_io_size, _end - _fill_pos);
+    uint64_t hole_end = 0;
+    if (clipToData(_fill_pos, &length, &hole_end))
+    {
+        Chunk chunk;
+        chunk.data = NULL;
+        chunk.offset = _fill_pos;
+        chunk.length = hole_end - _fill_pos;
+        _chunks.push_back(chunk);
+        _fill_pos = hole_end;
+        ::lseek(_fd, _fill_pos, SEEK_SET);
+        return true;
+    }
+    char *data = allocChunk();
+    if (data == NULL)
+    {
+        _error = true;
+        return false;
+    }
+
+    uint64_t issued = 0;
+    if (_throttle != NULL)
+    {
+        _throttle->acquire(length);
+        issued = Throttle::clock();
+    }
+    ssize_t nread = readFull(data, length);
+    if (_throttle != NULL)
+        _throttle->done(length, nread > 0 ? nread : 0, Throttle::clock() - issued);
+    if (nread < 0 && _direct && errno == EINVAL)
+    {
+        // Unaligned tail of a regular file or a device that refuses
+        // direct I/O: carry on through the page cache.
+        ::fcntl(_fd, F_SETFL, ::fcntl(_fd, F_GETFL) & ~O_DIRECT);
+        setBuffered();
+        nread = readFull(data, length);
+    }
+    if (nread < 0 && _bad != NULL)
+    {
+        nread = rescue(data, _fill_pos, length);
+        ::lseek(_fd, _fill_pos + nread, SEEK_SET);
+    }
+    if (nread <= 0)
+    {
+        _error = nread < 0;
+        _free.push_back(data);
+        return false;
+    }
+
+    _holes.zeroSkipped(_fill_pos, data, nread);
+    Chunk chunk;
+    chunk.data = data;
+    chunk.offset = _fill_pos;
+    chunk.length = nread;
+    _chunks.push_back(chunk);
+    _fill_pos += nread;
+    return true;
+}
+
+int FileReader::view(char *buffer, size_t buffer_size, const char **data)
+{
+    // Hand out the chunk directly when the window lies inside it; windows
+    // straddling two chunks are assembled in buffer.
+    size_t done = 0;
+    while (done < buffer_size)
+    {
+        if (_pos == _fill_pos && !fill())
+            break;
+        const Chunk &chunk = _chunks.back();
+        const char *src = chunk.data != NULL ? chunk.data + (_pos - chunk.offset) : Reader::zeros();
+        size_t n = std::min((uint64_t)(buffer_size - done), _fill_pos - _pos);
+        if (done == 0 && n == buffer_size)
+        {
+            *data = src;
+            _pos += n;
+            return n;
+        }
+        memcpy(buffer + done, src, n);
+        done += n;
+        _pos += n;
+    }
+    *data = buffer;
+    if (done == 0 && _error)
+        return -1;
+    return done;
+}
+
+int FileReader::read(char *buffer, size_t buffer_size)
+{
+    const char *data = NULL;
+    int nread = view(buffer, buffer_size, &data);
+    if (nread > 0 && data != buffer)
+        memcpy(buffer, data, nread);
+    return nread;
+}
+
+void FileReader::release(uint64_t offset)
+{
+    while (_chunks.size() > 1
+           && _chunks.front().offset + _chunks.front().length <= offset)
+    {
+        const Chunk &chunk = _chunks.front();
+        if (chunk.data != NULL && !_direct)
+            ::posix_fadvise(_fd, chunk.offset, chunk.length, POSIX_FADV_DONTNEED);
+        if (chunk.data != NULL)
+            _free.push_back(chunk.data);
+        _chunks.pop_front();
+    }
+}
+
+uint64_t FileReader::tell() const
+{
+    return _pos;
+}
+
+// FileReader that keeps up to queue_depth chunk reads in flight through
+// io_uring, so the device is busy while the ring scans completed chunks.
+// Chunks are handed out in file order whatever order they complete in.
+// Falls back to synchronous reads when io_uring is unavailable.
+class UringReader : public FileReader
+{
+public:
+    static const unsigned kDefaultQueueDepth = 8;
+
+    UringReader();
+    virtual ~UringReader();
+    bool open(const std::string &path, bool direct = false,
+              size_t io_size = kDefaultIoSize,
+              unsigned queue_depth = kDefaultQueueDepth);
+    virtual bool setRange(uint64_t start, uint64_t end);
+
+protected:
+    virtual bool fill();
+
+private:
+    struct Request
+    {
+        char *data;       // NULL for a hole
+        uint64_t offset;
+        uint64_t length;
+        bool done;
+        int result;
+        uint64_t issued;  // Throttle::clock() at submission
+    };
+
+    bool setup(unsigned entries);
+    void enter(unsigned submitted);
+    void submitAhead();
+    bool reap(bool wait);
+    void cancelAhead();
+
+private:
+    int _ring_fd;
+    unsigned _queue_depth;
+    uint64_t _submit_pos;          // source offset of the next request
+    std::deque<Request> _inflight; // in file order
+    uint64_t _next_id;             // user_data of _inflight.back() + 1
+
+    void *_sq_map;
+    size_t _sq_map_size;
+    void *_cq_map;
+    size_t _cq_map_size;
+    struct io_uring_sqe *_sqes;
+    size_t _sqes_size;
+    unsigned *_sq_head;
+    unsigned *_sq_tail;
+    unsigned *_sq_mask;
+    unsigned *_sq_array;
+    unsigned *_cq_head;
+    unsigned *_cq_tail;
+    unsigned *_cq_mask;
+    struct io_uring_cqe *_cqes;
+};
+
+UringReader::UringReader()
+        : FileReader(),
+          _ring_fd(-1),
+          _queue_depth(kDefaultQueueDepth),
+          _submit_pos(0),
+          _next_id(0),
+          _sq_map(NULL),
+          _sq_map_size(0),
+          _cq_map(NULL),
+          _cq_map_size(0),
+          _sqes(NULL),
+          _sqes_size(0)
+{ }
+
+UringReader::~UringReader()
+{
+    if (_ring_fd != -1)
+    {
+        cancelAhead();
+        ::close(_ring_fd);
+        _ring_fd = -1;
+    }
+    if (_sqes != NULL)
+        ::munmap(_sqes, _sqes_size);
+    if (_cq_map != NULL && _cq_map != _sq_map)
+        ::munmap(_cq_map, _cq_map_size);
+    if (_sq_map != NULL)
+        ::munmap(_sq_map, _sq_map_size);
+}
+
+bool UringReader::open(const std::string &path, bool direct, size_t io_size,
+                       unsigned queue_depth)
+{
+    assert(queue_depth > 0);
+    if (!FileReader::open(path, direct, io_size))
+        return false;
+    _queue_depth = queue_depth;
+    if (!setup(queue_depth))
+        fprintf(stderr, "io_uring unavailable, reading synchronously\n");
+    return true;
+}
+
+bool UringReader::setup(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = ::syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return false;
+    _ring_fd = fd;
+
+    _sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        _sq_map_size = _cq_map_size = std::max(_sq_map_size, _cq_map_size);
+    _sq_map = ::mmap(NULL, _sq_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (_sq_map == MAP_FAILED)
+    {
+        _sq_map = NULL;
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        _cq_map = _sq_map;
+    else
+    {
+        _cq_map = ::mmap(NULL, _cq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (_cq_map == MAP_FAILED)
+        {
+            _cq_map = NULL;
+            return false;
+        }
+    }
+    _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = ::mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+    _sqes = (struct io_uring_sqe *)sqes;
+
+    char *sq = (char *)_sq_map;
+    char *cq = (char *)_cq_map;
+    _sq_head = (unsigned *)(sq + params.sq_off.head);
+    _sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    _sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    _sq_array = (unsigned *)(sq + params.sq_off.array);
+    _cq_head = (unsigned *)(cq + params.cq_off.head);
+    _cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    _cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    _submit_pos = _fill_pos;
+    return true;
+}
+
+bool UringReader::setRange(uint64_t start, uint64_t end)
+{
+    assert(_inflight.empty());
+    if (!FileReader::setRange(start, end))
+        return false;
+    _submit_pos = start;
+    return true;
+}
+
+void UringReader::submitAhead()
+{
+    unsigned submitted = 0;
+    while (_inflight.size() < _queue_depth && _submit_pos < _end)
+    {
+        size_t length = std::min((uint64_t)_io_size, _end - _submit_pos);
+        uint64_t hole_end = 0;
+        if (clipToData(_submit_pos, &length, &hole_end))
+        {
+            // Holes take a place in the queue, and an id, but no read.
+            Request request;
+            request.data = NULL;
+            request.offset = _submit_pos;
+            request.length = hole_end - _submit_pos;
+            request.done = true;
+            request.result = 0;
+            request.issued = 0;
+            _inflight.push_back(request);
+            ++_next_id;
+            _submit_pos = hole_end;
+            continue;
+        }
+        char *data = allocChunk();
+        if (data == NULL)
+            break;
+        uint64_t issued = 0;
+        if (_throttle != NULL)
+        {
+            // What is queued goes out before waiting for tokens, and
+            // reads that came back short, say past the end, return
+            // theirs first.
+            enter(submitted);
+            submitted = 0;
+            reap(false);
+            _throttle->acquire(length);
+            issued = Throttle::clock();
+        }
+        unsigned tail = *_sq_tail;
+        unsigned idx = tail & *_sq_mask;
+        struct io_uring_sqe *sqe = &_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = _fd;
+        sqe->addr = (uint64_t)(uintptr_t)data;
+        sqe->len = length;
+        sqe->off = _submit_pos;
+        sqe->user_data = _next_id++;
+        _sq_array[idx] = idx;
+        __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        Request request;
+        request.data = data;
+        request.offset = _submit_pos;
+        request.length = length;
+        request.done = false;
+        request.result = 0;
+        request.issued = issued;
+        _inflight.push_back(request);
+        _submit_pos += length;
+        ++submitted;
+    }
+    enter(submitted);
+}
+
+void UringReader::enter(unsigned submitted)
+{
+    if (submitted > 0)
+        ::syscall(__NR_io_uring_enter, _ring_fd, submitted, 0, 0, NULL, 0);
+}
+
+bool UringReader::reap(bool wait)
+{
+    if (wait && ::syscall(__NR_io_uring_enter, _ring_fd, 0, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        return false;
+    unsigned head = *_cq_head;
+    while (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+    {
+        const struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+        // Ids are handed out consecutively, so they index _inflight.
+        uint64_t first = _next_id - _inflight.size();
+        if (cqe->user_data >= first)
+        {
+            Request &request = _inflight[cqe->user_data - first];
+            request.done = true;
+            request.result = cqe->res;
+            // Completions are only seen here, so the latency includes
+            // any time spent scanning since the last reap.
+            if (_throttle != NULL && request.data != NULL)
+                _throttle->done(request.length, cqe->res > 0 ? cqe->res : 0,
+                                Throttle::clock() - request.issued);
+        }
+        ++head;
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+void UringReader::cancelAhead()
+{
+    // Requests cannot be taken back from the kernel; wait them out and
+    // recycle their buffers.
+    while (!_inflight.empty())
+    {
+        while (!_inflight.front().done)
+        {
+            if (!reap(true))
+                return;
+        }
+        if (_inflight.front().data != NULL)
+            _free.push_back(_inflight.front().data);
+        _inflight.pop_front();
+    }
+}
+
+bool UringReader::fill()
+{
+    if (_ring_fd == -1)
+        return FileReader::fill();
+
+    for (;;)
+    {
+        submitAhead();
+        if (_inflight.empty())
+            return false;
+        while (!_inflight.front().done)
+        {
+            if (!reap(true))
+            {
+                _error = true;
+                return false;
+            }
+        }
+        Request request = _inflight.front();
+        _inflight.pop_front();
+
+        if (request.data == NULL)
+        {
+            Chunk hole;
+            hole.data = NULL;
+            hole.offset = request.offset;
+            hole.length = request.length;
+            _chunks.push_back(hole);
+            _fill_pos += request.length;
+            return true;
+        }
+        if (request.result == -EINVAL && _direct)
+        {
+            // Same fallback as FileReader::fill: resubmit everything
+            // through the page cache.
+            ::fcntl(_fd, F_SETFL, ::fcntl(_fd, F_GETFL) & ~O_DIRECT);
+            setBuffered();
+            _free.push_back(request.data);
+            cancelAhead();
+            _submit_pos = _fill_pos;
+            continue;
+        }
+        if (request.result < 0 && _bad != NULL)
+        {
+            // Read the chunk again around its bad sectors; the queue
+            // restarts right after it.
+            cancelAhead();
+            request.result = rescue(request.data, request.offset, request.length);
+            _submit_pos = request.offset + request.result;
+        }
+        if (request.result <= 0)
+        {
+            _error = request.result < 0;
+            _free.push_back(request.data);
+            cancelAhead();
+            return false;
+        }
+
+        _holes.zeroSkipped(request.offset, request.data, request.result);
+        Chunk chunk;
+        chunk.data = request.data;
+        chunk.offset = request.offset;
+        chunk.length = request.result;
+        _chunks.push_back(chunk);
+        _fill_pos += request.result;
+        if ((size_t)request.result < request.length)
+        {
+            // End of file or an interrupted read; later requests would
+            // leave a gap, so restart the queue after this chunk.
+            cancelAhead();
+            _submit_pos = _fill_pos;
+        }
+        return true;
+    }
+}
+
+// Maps a regular file and hands out windows of the mapping, so scanning
+// and context dumps never copy the data. Pages behind the caller are
+// dropped from the mapping as it moves on.
+class MmapReader : public Reader
+{
+public:
+    MmapReader();
+    virtual ~MmapReader();
+    bool open(const std::string &path);
+    virtual int read(char *buffer, size_t buffer_size);
+    virtual uint64_t tell() const;
+    virtual int view(char *buffer, size_t buffer_size, const char **data);
+    virtual void release(uint64_t offset);
+    virtual bool setRange(uint64_t start, uint64_t end);
+    virtual bool setSkipped(const std::vector<std::pair<uint64_t, uint64_t> > &skipped);
+
+private:
+    // Granularity of MADV_DONTNEED, to keep the syscall off the hot path.
+    static const uint64_t kReleaseChunk = 8 * 1024 * 1024;
+
+    int _fd;
+    char *_map;
+    uint64_t _size;
+    uint64_t _pos;
+    uint64_t _end;
+    uint64_t _released;
+    HoleMap _holes;
+};
+
+MmapReader::MmapReader()
+        : Reader(),
+          _fd(-1),
+          _map(NULL),
+          _size(0),
+          _pos(0),
+          _end(0),
+          _released(0)
+{ }
+
+MmapReader::~MmapReader()
+{
+    if (_map != NULL)
+    {
+        ::munmap(_map, _size);
+        _map = NULL;
+    }
+    if (_fd != -1)
+    {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+bool MmapReader::open(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        ::close(fd);
+        return false;
+    }
+    _fd = fd;
+    _size = _end = st.st_size;
+    if (_size == 0)
+        return true;
+    _holes.open(_fd);
+    void *map = ::mmap(NULL, _size, PROT_READ, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+    _map = (char *)map;
+    ::madvise(_map, _size, MADV_SEQUENTIAL);
+    return true;
+}
+
+int MmapReader::read(char *buffer, size_t buffer_size)
+{
+    const char *data = NULL;
+    int nread = view(buffer, buffer_size, &data);
+    if (nread > 0 && data != buffer)
+        memcpy(buffer, data, nread);
+    return nread;
+}
+
+int MmapReader::view(char *buffer, size_t buffer_size, const char **data)
+{
+    uint64_t left = _end > _pos ? _end - _pos : 0;
+    if (left == 0)
+        return 0;
+    // Windows inside a hole are not faulted in.
+    uint64_t hole_start = 0;
+    uint64_t hole_end = 0;
+    size_t length = std::min(left, (uint64_t)buffer_size);
+    if (_holes.next(_pos, &hole_start, &hole_end) && hole_start == _pos
+        && hole_end - _pos >= length)
+    {
+        *data = Reader::zeros();
+        _pos += length;
+        return length;
+    }
+    if (left >= buffer_size && !_holes.overlaps(_pos, buffer_size))
+    {
+        *data = _map + _pos;
+        _pos += buffer_size;
+        return buffer_size;
+    }
+    // The tail window is copied out so that callers may keep treating
+    // views as buffer_size bytes long, and so are windows that need
+    // left out bytes zeroed.
+    memcpy(buffer, _map + _pos, length);
+    _holes.zeroSkipped(_pos, buffer, length);
+    *data = buffer;
+    _pos += length;
+    return length;
+}
+
+uint64_t MmapReader::tell() const
+{
+    return _pos;
+}
+
+bool MmapReader::setSkipped(const std::vector<std::pair<uint64_t, uint64_t> > &skipped)
+{
+    _holes.setSkipped(skipped);
+    return true;
+}
+
+bool MmapReader::setRange(uint64_t start, uint64_t end)
+{
+    uint64_t page = ::sysconf(_SC_PAGESIZE);
+    _pos = std::min(start, _size);
+    _end = std::min(end, _size);
+    _released = _pos - _pos % page;
+    return true;
+}
+
+void MmapReader::release(uint64_t offset)
+{
+    uint64_t page = ::sysconf(_SC_PAGESIZE);
+    offset -= offset % page;
+    if (offset < _released + kReleaseChunk)
+        return;
+    ::madvise(_map + _released, offset - _released, MADV_DONTNEED);
+    _released = offset;
+}
+
+// Reads memory the caller keeps alive; views point straight into it.
+class MemoryReader : public Reader
+{
+public:
+    MemoryReader(const char *data, size_t size);
+    virtual ~MemoryReader();
+    virtual int read(char *buffer, size_t buffer_size);
+    virtual uint64_t tell() const;
+    virtual int view(char *buffer, size_t buffer_size, const char **data);
+    virtual bool setRange(uint64_t start, uint64_t end);
+
+private:
+    const char *_data;
+    uint64_t _size;
+    uint64_t _pos;
+    uint64_t _end;
+};
+
+MemoryReader::MemoryReader(const char *data, size_t size)
+        : Reader(),
+          _data(data),
+          _size(size),
+          _pos(0),
+          _end(size)
+{ }
+
+MemoryReader::~MemoryReader()
+{ }
+
+int MemoryReader::read(char *buffer, size_t buffer_size)
+{
+    const char *data = NULL;
+    int nread = view(buffer, buffer_size, &data);
+    if (nread > 0)
+        memcpy(buffer, data, nread);
+    return nread;
+}
+
+uint64_t MemoryReader::tell() const
+{
+    return _pos;
+}
+
+int MemoryReader::view(char *, size_t buffer_size, const char **data)
+{
+    size_t length = std::min((uint64_t)buffer_size, _end - _pos);
+    *data = _data + _pos;
+    _pos += length;
+    return length;
+}
+
+bool MemoryReader::setRange(uint64_t start, uint64_t end)
+{
+    _pos = std::min(start, _size);
+    _end = std::max(_pos, std::min(end, _size));
+    return true;
+}
+
+// Decompresses gzip, BGZF, zstd or lz4 input ahead of the scan on
+// decoder threads, and reads like the decompressed data, offsets
+// included. Chunks are decoded in order, or in parallel for BGZF, whose
+// blocks record their sizes; views point into decoded chunks until they
+// are released. Input that is not compressed is passed through.
+class DecompressReader : public Reader
+{
+public:
+    enum Format { FORMAT_NONE, FORMAT_GZIP, FORMAT_BGZF, FORMAT_ZSTD, FORMAT_LZ4 };
+
+    // Decoded bytes per chunk; BGZF chunks hold whole blocks, up to this.
+    static const size_t kChunkSize = 4 * 1024 * 1024;
+
+    // The format of the first bytes of a stream.
+    static Format detect(const unsigned char *data, size_t length);
+
+    DecompressReader();
+    virtual ~DecompressReader();
+    bool open(const std::string &path, unsigned threads);
+    virtual int read(char *buffer, size_t buffer_size);
+    virtual uint64_t tell() const;
+    virtual int view(char *buffer, size_t buffer_size, const char **data);
+    virtual void release(uint64_t offset);
+    // Decompressed data cannot be seeked: start may only lie ahead, and
+    // the bytes before it are decoded and dropped.
+    virtual bool setRange(uint64_t start, uint64_t end);
+    // Paces the reads of compressed input.
+    virtual bool setThrottle(Throttle *throttle);
+
+private:
+    // Compressed bytes are read in this size.
+    static const size_t kInputSize = 256 * 1024;
+    // The largest BGZF block, compressed or not.
+    static const size_t kBlockSize = 65536;
+
+    struct Chunk
+    {
+        char *data;
+        uint64_t offset;               // in the decompressed data
+        size_t length;
+        std::string input;             // BGZF blocks still compressed
+        std::vector<uint32_t> blocks;  // their compressed sizes
+        bool ready;
+        bool failed;
+    };
+
+    static void *decodeThread(void *arg);
+    void decodeLoop();
+    // Fills the next chunk; called in chunk order, under _input_lock.
+    bool load(Chunk *chunk);
+    // Decodes what load left compressed, in parallel with other chunks.
+    bool decode(Chunk *chunk);
+    bool loadStream(Chunk *chunk);
+    bool loadBlocks(Chunk *chunk);
+    bool refill();
+    // The chunk holding _pos, NULL at the end of the data or on errors.
+    Chunk *current();
+
+    int _fd;
+    Format _format;
+    std::vector<pthread_t> _threads;
+
+    pthread_mutex_t _input_lock;       // input state below
+    std::vector<char> _input;
+    size_t _input_pos;
+    size_t _input_end;
+    bool _input_eof;
+    Throttle *_throttle;
+    uint64_t _load_offset;
+    bool _stream_end;                  // between frames or gzip members
+#ifdef HAVE_ZLIB
+    z_stream _zstream;
+    bool _zstream_ready;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *_zstd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx *_lz4;
+#endif
+
+    pthread_mutex_t _lock;             // chunk state below
+    pthread_cond_t _cond;
+    std::deque<Chunk *> _chunks;       // oldest first, all still referenced
+    std::vector<char *> _free;
+    uint64_t _first_seq;               // sequence number of _chunks.front()
+    uint64_t _next_seq;                // of the next chunk to load
+    uint64_t _read_seq;                // of the chunk holding _pos
+    size_t _ahead;                     // chunks decoded ahead of the reader
+    bool _done;                        // no chunk follows _next_seq - 1
+    bool _stop;
+
+    uint64_t _pos;
+    uint64_t _end;
+    bool _error;
+};
+
+DecompressReader::Format DecompressReader::detect(const unsigned char *data, size_t length)
+{
+    if (length >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f && data[3] == 0xfd)
+        return FORMAT_ZSTD;
+    if (length >= 4 && data[0] == 0x04 && data[1] == 0x22 && data[2] == 0x4d && data[3] == 0x18)
+        return FORMAT_LZ4;
+    if (length < 3 || data[0] != 0x1f || data[1] != 0x8b || data[2] != 8)
+        return FORMAT_NONE;
+    // BGZF is gzip with a "BC" extra field holding the block size.
+    if (length >= 16 && (data[3] & 4) != 0 && data[10] == 6 && data[11] == 0
+        && data[12] == 'B' && data[13] == 'C' && data[14] == 2 && data[15] == 0)
+        return FORMAT_BGZF;
+    return FORMAT_GZIP;
+}
+
+DecompressReader::DecompressReader()
+        : Reader(),
+          _fd(-1),
+          _format(FORMAT_NONE),
+          _input(kInputSize),
+          _input_pos(0),
+          _input_end(0),
+          _input_eof(false),
+          _throttle(NULL),
+          _load_offset(0),
+          _stream_end(true),
+#ifdef HAVE_ZLIB
+          _zstream_ready(false),
+#endif
+#ifdef HAVE_ZSTD
+          _zstd(NULL),
+#endif
+#ifdef HAVE_LZ4
+          _lz4(NULL),
+#endif
+          _first_seq(0),
+          _next_seq(0),
+          _read_seq(0),
+          _ahead(2),
+          _done(false),
+          _stop(false),
+          _pos(0),
+          _end(UINT64_MAX),
+          _error(false)
+{
+    pthread_mutex_init(&_input_lock, NULL);
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+DecompressReader::~DecompressReader()
+{
+    pthread_mutex_lock(&_lock);
+    _stop = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+    for (size_t i = 0; i < _threads.size(); ++i)
+        pthread_join(_threads[i], NULL);
+    for (size_t i = 0; i < _chunks.size(); ++i)
+    {
+        free(_chunks[i]->data);
+        delete _chunks[i];
+    }
+    for (size_t i = 0; i < _free.size(); ++i)
+        free(_free[i]);
+#ifdef HAVE_ZLIB
+    if (_zstream_ready)
+        inflateEnd(&_zstream);
+#endif
+#ifdef HAVE_ZSTD
+    if (_zstd != NULL)
+        ZSTD_freeDStream(_zstd);
+#endif
+#ifdef HAVE_LZ4
+    if (_lz4 != NULL)
+        LZ4F_freeDecompressionContext(_lz4);
+#endif
+    if (_fd != -1)
+        ::close(_fd);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+    pthread_mutex_destroy(&_input_lock);
+}
+
+bool DecompressReader::open(const std::string &path, unsigned threads)
+{
+    _fd = ::open(path.c_str(), O_RDONLY);
+    if (_fd < 0)
+        return false;
+    ::posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // The header is sniffed from the input buffer, so pipes work too.
+    while (_input_end < 16 && !_input_eof)
+    {
+        if (!refill())
+            return false;
+    }
+    _format = detect((const unsigned char *)&_input[0], _input_end);
+    const char *missing = NULL;
+    switch (_format)
+    {
+    case FORMAT_GZIP:
+    case FORMAT_BGZF:
+#ifdef HAVE_ZLIB
+        memset(&_zstream, 0, sizeof(_zstream));
+        // 15 + 16: gzip headers and trailers.
+        _zstream_ready = inflateInit2(&_zstream, 15 + 16) == Z_OK;
+        if (!_zstream_ready)
+            return false;
+        _stream_end = _format == FORMAT_BGZF;
+#else
+        missing = "gzip";
+#endif
+        break;
+    case FORMAT_ZSTD:
+#ifdef HAVE_ZSTD
+        _zstd = ZSTD_createDStream();
+        if (_zstd == NULL || ZSTD_isError(ZSTD_initDStream(_zstd)))
+            return false;
+#else
+        missing = "zstd";
+#endif
+        break;
+    case FORMAT_LZ4:
+#ifdef HAVE_LZ4
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&_lz4, LZ4F_VERSION)))
+            return false;
+#else
+        missing = "lz4";
+#endif
+        break;
+    case FORMAT_NONE:
+        break;
+    }
+    if (missing != NULL)
+    {
+        fprintf(stderr, "%s: built without %s support\n", path.c_str(), missing);
+        errno = ENOTSUP;
+        return false;
+    }
+
+    // Streams decode on one thread; BGZF blocks on as many as asked for.
+    size_t decoders = _format == FORMAT_BGZF ? std::max(1U, threads) : 1;
+    _ahead = decoders + 2;
+    _threads.resize(decoders);
+    for (size_t i = 0; i < _threads.size(); ++i)
+    {
+        if (pthread_create(&_threads[i], NULL, decodeThread, this) != 0)
+        {
+            _threads.resize(i);
+            return false;
+        }
+    }
+    return !_threads.empty();
+}
+
+void *DecompressReader::decodeThread(void *arg)
+{
+    ((DecompressReader *)arg)->decodeLoop();
+    return NULL;
+}
+
+void DecompressReader::decodeLoop()
+{
+    for (;;)
+    {
+        // Chunks are loaded in turn, so holding _input_lock while waiting
+        // for room keeps their order.
+        pthread_mutex_lock(&_input_lock);
+        pthread_mutex_lock(&_lock);
+        while (!_stop && !_done && _next_seq >= _read_seq + _ahead)
+            pthread_cond_wait(&_cond, &_lock);
+        if (_stop || _done)
+        {
+            pthread_mutex_unlock(&_lock);
+            pthread_mutex_unlock(&_input_lock);
+            break;
+        }
+        Chunk *chunk = new Chunk;
+        chunk->data = NULL;
+        if (!_free.empty())
+        {
+            chunk->data = _free.back();
+            _free.pop_back();
+        }
+        chunk->offset = _load_offset;
+        chunk->length = 0;
+        chunk->ready = false;
+        chunk->failed = false;
+        _chunks.push_back(chunk);
+        ++_next_seq;
+        pthread_mutex_unlock(&_lock);
+
+        if (chunk->data == NULL)
+            chunk->data = (char *)malloc(kChunkSize);
+        bool ok = chunk->data != NULL && load(chunk);
+        _load_offset += chunk->length;
+        bool last = !ok || (_input_eof && _input_pos == _input_end && _stream_end);
+        if (last)
+        {
+            pthread_mutex_lock(&_lock);
+            _done = true;
+            pthread_cond_broadcast(&_cond);
+            pthread_mutex_unlock(&_lock);
+        }
+        pthread_mutex_unlock(&_input_lock);
+
+        ok = ok && decode(chunk);
+        pthread_mutex_lock(&_lock);
+        chunk->ready = true;
+        chunk->failed = !ok;
+        pthread_cond_broadcast(&_cond);
+        pthread_mutex_unlock(&_lock);
+    }
+}
+
+bool DecompressReader::refill()
+{
+    if (_input_pos > 0)
+    {
+        memmove(&_input[0], &_input[_input_pos], _input_end - _input_pos);
+        _input_end -= _input_pos;
+        _input_pos = 0;
+    }
+    while (_input_end < _input.size())
+    {
+        size_t length = _input.size() - _input_end;
+        uint64_t issued = 0;
+        if (_throttle != NULL)
+        {
+            _throttle->acquire(length);
+            issued = Throttle::clock();
+        }
+        ssize_t nread = ::read(_fd, &_input[_input_end], length);
+        if (_throttle != NULL)
+            _throttle->done(length, nread > 0 ? nread : 0, Throttle::clock() - issued);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0)
+            return false;
+        if (nread == 0)
+        {
+            _input_eof = true;
+            break;
+        }
+        _input_end += nread;
+        // Pipes hand out what they have; decode that rather than wait.
+        break;
+    }
+    return true;
+}
+
+bool DecompressReader::load(Chunk *chunk)
+{
+    if (_format == FORMAT_BGZF)
+        return loadBlocks(chunk);
+    return loadStream(chunk);
+}
+
+bool DecompressReader::loadStream(Chunk *chunk)
+{
+    while (chunk->length < kChunkSize)
+    {
+        size_t avail = _input_end - _input_pos;
+        if (avail < 2 && !_input_eof)
+        {
+            if (!refill())
+                return false;
+            continue;
+        }
+        if (avail == 0 && _stream_end)
+            break;
+        char *out = chunk->data + chunk->length;
+        size_t room = kChunkSize - chunk->length;
+        const char *in = &_input[_input_pos];
+        size_t used = 0;
+        size_t made = 0;
+        switch (_format)
+        {
+        case FORMAT_NONE:
+            used = made = std::min(room, avail);
+            memcpy(out, in, made);
+            break;
+        case FORMAT_GZIP:
+        case FORMAT_BGZF:
+#ifdef HAVE_ZLIB
+            if (_stream_end)
+            {
+                // Members may be concatenated; anything else after one,
+                // such as padding, ends the data.
+                if (avail < 2 || (unsigned char)in[0] != 0x1f || (unsigned char)in[1] != 0x8b)
+                {
+                    _input_pos = _input_end;
+                    _input_eof = true;
+                    return true;
+                }
+                inflateReset(&_zstream);
+                _stream_end = false;
+            }
+            _zstream.next_in = (Bytef *)in;
+            _zstream.avail_in = avail;
+            _zstream.next_out = (Bytef *)out;
+            _zstream.avail_out = room;
+            {
+                int ret = inflate(&_zstream, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                    return false;
+                _stream_end = ret == Z_STREAM_END;
+            }
+            used = avail - _zstream.avail_in;
+            made = room - _zstream.avail_out;
+            break;
+#else
+            return false;
+#endif
+        case FORMAT_ZSTD:
+#ifdef HAVE_ZSTD
+        {
+            ZSTD_inBuffer input = { in, avail, 0 };
+            ZSTD_outBuffer output = { out, room, 0 };
+            size_t ret = ZSTD_decompressStream(_zstd, &output, &input);
+            if (ZSTD_isError(ret))
+                return false;
+            // 0: a frame is complete and flushed.
+            _stream_end = ret == 0;
+            used = input.pos;
+            made = output.pos;
+            break;
+        }
+#else
+            return false;
+#endif
+        case FORMAT_LZ4:
+#ifdef HAVE_LZ4
+        {
+            used = avail;
+            made = room;
+            size_t ret = LZ4F_decompress(_lz4, out, &made, in, &used, NULL);
+            if (LZ4F_isError(ret))
+                return false;
+            _stream_end = ret == 0;
+            break;
+        }
+#else
+            return false;
+#endif
+        }
+        // No progress with room left: the stream is cut short or corrupt.
+        if (used == 0 && made == 0 && (avail >= 2 || _input_eof))
+            return false;
+        _input_pos += used;
+        chunk->length += made;
+    }
+    return true;
+}
+
+bool DecompressReader::loadBlocks(Chunk *chunk)
+{
+    chunk->input.clear();
+    chunk->blocks.clear();
+    while (chunk->length + kBlockSize <= kChunkSize)
+    {
+        if (_input_end - _input_pos < 18 && !_input_eof)
+        {
+            if (!refill())
+                return false;
+            continue;
+        }
+        if (_input_pos == _input_end)
+            break;
+        const unsigned char *header = (const unsigned char *)&_input[_input_pos];
+        if (_input_end - _input_pos < 18 || detect(header, 16) != FORMAT_BGZF)
+            return false;
+        size_t size = (header[16] | header[17] << 8) + 1;
+        while (_input_end - _input_pos < size && !_input_eof)
+        {
+            if (!refill())
+                return false;
+        }
+        if (_input_end - _input_pos < size || size < 26)
+            return false;
+        const unsigned char *block = (const unsigned char *)&_input[_input_pos];
+        uint32_t decoded = block[size - 4] | block[size - 3] << 8 | block[size - 2] << 16
+                          | (uint32_t)block[size - 1] << 24;
+        if (decoded > kBlockSize)
+            return false;
+        chunk->input.append((const char *)block, size);
+        chunk->blocks.push_back(size);
+        chunk->length += decoded;
+        _input_pos += size;
+    }
+    return true;
+}
+
+bool DecompressReader::decode(Chunk *chunk)
+{
+    if (chunk->blocks.empty())
+        return true;
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // Raw deflate: the gzip header and trailer of blocks are parsed here.
+    if (inflateInit2(&stream, -15) != Z_OK)
+        return false;
+    bool ok = true;
+    size_t in = 0;
+    size_t out = 0;
+    for (size_t i = 0; i < chunk->blocks.size() && ok; ++i)
+    {
+        const unsigned char *block = (const unsigned char *)&chunk->input[in];
+        size_t size = chunk->blocks[i];
+        size_t header = 12 + (block[10] | block[11] << 8);
+        uint32_t crc = block[size - 8] | block[size - 7] << 8 | block[size - 6] << 16
+                       | (uint32_t)block[size - 5] << 24;
+        uint32_t decoded = block[size - 4] | block[size - 3] << 8 | block[size - 2] << 16
+                           | (uint32_t)block[size - 1] << 24;
+        ok = header + 8 <= size && out + decoded <= chunk->length;
+        if (ok)
+        {
+            inflateReset(&stream);
+            stream.next_in = (Bytef *)block + header;
+            stream.avail_in = size - header - 8;
+            stream.next_out = (Bytef *)chunk->data + out;
+            stream.avail_out = decoded;
+            ok = inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.avail_out == 0
+                 && crc32(0, (const Bytef *)chunk->data + out, decoded) == crc;
+        }
+        in += size;
+        out += decoded;
+    }
+    inflateEnd(&stream);
+    // The chunk's copy of the compressed blocks is not needed any more.
+    std::string().swap(chunk->input);
+    return ok && out == chunk->length;
+#else
+    return false;
+#endif
+}
+
+DecompressReader::Chunk *DecompressReader::current()
+{
+    pthread_mutex_lock(&_lock);
+    Chunk *chunk = NULL;
+    for (;;)
+    {
+        while (_read_seq < _next_seq && !_chunks[_read_seq - _first_seq]->ready)
+            pthread_cond_wait(&_cond, &_lock);
+        if (_read_seq == _next_seq)
+        {
+            if (_done)
+                break;
+            pthread_cond_wait(&_cond, &_lock);
+            continue;
+        }
+        chunk = _chunks[_read_seq - _first_seq];
+        if (chunk->failed)
+        {
+            _error = true;
+            chunk = NULL;
+            break;
+        }
+        if (_pos < chunk->offset + chunk->length)
+            break;
+        // Let the decoders move on once the chunk is read.
+        ++_read_seq;
+        pthread_cond_broadcast(&_cond);
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&_lock);
+    return chunk;
+}
+
+int DecompressReader::view(char *buffer, size_t buffer_size, const char **data)
+{
+    size_t want = std::min((uint64_t)buffer_size, _end > _pos ? _end - _pos : 0);
+    size_t done = 0;
+    while (done < want)
+    {
+        Chunk *chunk = current();
+        if (chunk == NULL)
+            break;
+        const char *src = chunk->data + (_pos - chunk->offset);
+        size_t n = std::min(want - done, (size_t)(chunk->offset + chunk->length - _pos));
+        if (done == 0 && n == want)
+        {
+            *data = src;
+            _pos += n;
+            return n;
+        }
+        memcpy(buffer + done, src, n);
+        done += n;
+        _pos += n;
+    }
+    *data = buffer;
+    if (done == 0 && _error)
+        return -1;
+    return done;
+}
+
+int DecompressReader::read(char *buffer, size_t buffer_size)
+{
+    const char *data = NULL;
+    int nread = view(buffer, buffer_size, &data);
+    if (nread > 0 && data != buffer)
+        memcpy(buffer, data, nread);
+    return nread;
+}
+
+void DecompressReader::release(uint64_t offset)
+{
+    pthread_mutex_lock(&_lock);
+    while (_first_seq < _read_seq
+           && _chunks.front()->offset + _chunks.front()->length <= offset)
+    {
+        _free.push_back(_chunks.front()->data);
+        delete _chunks.front();
+        _chunks.pop_front();
+        ++_first_seq;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+uint64_t DecompressReader::tell() const
+{
+    return _pos;
+}
+
+bool DecompressReader::setRange(uint64_t start, uint64_t end)
+{
+    if (start < _pos)
+        return false;
+    while (_pos < start)
+    {
+        Chunk *chunk = current();
+        if (chunk == NULL)
+            break;
+        _pos = std::min(start, chunk->offset + chunk->length);
+        release(_pos);
+    }
+    _end = end;
+    return !_error;
+}
+
+bool DecompressReader::setThrottle(Throttle *throttle)
+{
+    // Decode threads may be reading already.
+    pthread_mutex_lock(&_input_lock);
+    _throttle = throttle;
+    pthread_mutex_unlock(&_input_lock);
+    return true;
+}
+
+// Scan counters, updated with relaxed atomics from any thread and
+// sampled by a reporter thread. Nothing is counted or timed until
+// enable() is called, so a scan without --progress only pays a branch.
+class Stats
+{
+public:
+    enum Phase { PHASE_READ, PHASE_MATCH, PHASE_OUTPUT, kPhaseNum };
+
+    static void enable()
+    { _enabled = true; }
+    static bool enabled()
+    { return _enabled; }
+    static void addBytes(uint64_t bytes)
+    {
+        if (_enabled)
+            __atomic_fetch_add(&_bytes, bytes, __ATOMIC_RELAXED);
+    }
+    static void addHit()
+    {
+        if (_enabled)
+            __atomic_fetch_add(&_hits, 1, __ATOMIC_RELAXED);
+    }
+    // Monotonic nanoseconds, or 0 when disabled.
+    static uint64_t now();
+    static void addTime(Phase phase, uint64_t since)
+    {
+        if (_enabled)
+            __atomic_fetch_add(&_time[phase], now() - since, __ATOMIC_RELAXED);
+    }
+    // Reports on stderr every interval seconds until stop, against total
+    // bytes expected; 0 if unknown.
+    static void start(uint64_t total, unsigned interval);
+    // Stops the reporter and prints the totals.
+    static void stop();
+
+private:
+    static void *report(void *arg);
+    static void print(const char *what, uint64_t elapsed, uint64_t rate);
+
+    static bool _enabled;
+    static uint64_t _bytes;
+    static uint64_t _hits;
+    static uint64_t _time[kPhaseNum];
+    static uint64_t _total;
+    static uint64_t _started;
+    static unsigned _interval;
+    static bool _stopping;
+    static pthread_t _thread;
+    static pthread_mutex_t _lock;
+    static pthread_cond_t _cond;
+};
+
+// Adds the time until it goes out of scope to one phase.
+class StatsTimer
+{
+public:
+    explicit StatsTimer(Stats::Phase phase)
+            : _phase(phase),
+              _start(Stats::now())
+    { }
+    ~StatsTimer()
+    { Stats::addTime(_phase, _start); }
+
+private:
+    Stats::Phase _phase;
+    uint64_t _start;
+};
+
+bool Stats::_enabled = false;
+uint64_t Stats::_bytes = 0;
+uint64_t Stats::_hits = 0;
+uint64_t Stats::_time[Stats::kPhaseNum] = { 0 };
+uint64_t Stats::_total = 0;
+uint64_t Stats::_started = 0;
+unsigned Stats::_interval = 0;
+bool Stats::_stopping = false;
+pthread_t Stats::_thread;
+pthread_mutex_t Stats::_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Stats::_cond = PTHREAD_COND_INITIALIZER;
+
+uint64_t Stats::now()
+{
+    if (!_enabled)
+        return 0;
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void Stats::start(uint64_t total, unsigned interval)
+{
+    assert(_enabled);
+    _total = total;
+    _interval = interval;
+    _started = now();
+    pthread_create(&_thread, NULL, report, NULL);
+}
+
+void Stats::stop()
+{
+    pthread_mutex_lock(&_lock);
+    _stopping = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_thread, NULL);
+    uint64_t elapsed = now() - _started;
+    uint64_t bytes = __atomic_load_n(&_bytes, __ATOMIC_RELAXED);
+    print("done", elapsed, elapsed > 0 ? bytes * 1000000000.0 / elapsed : 0);
+}
+
+void *Stats::report(void *)
+{
+    uint64_t last_time = _started;
+    uint64_t last_bytes = 0;
+    pthread_mutex_lock(&_lock);
+    while (!_stopping)
+    {
+        struct timespec deadline;
+        ::clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += _interval;
+        pthread_cond_timedwait(&_cond, &_lock, &deadline);
+        if (_stopping)
+            break;
+        // The rate shown is the one since the last report; the ETA uses
+        // the average, which moves less.
+        uint64_t time = now();
+        uint64_t bytes = __atomic_load_n(&_bytes, __ATOMIC_RELAXED);
+        uint64_t rate = time > last_time ? (bytes - last_bytes) * 1000000000.0 / (time - last_time) : 0;
+        print("scanned", time - _started, rate);
+        last_time = time;
+        last_bytes = bytes;
+    }
+    pthread_mutex_unlock(&_lock);
+    return NULL;
+}
+
+static std::string formatSize(uint64_t bytes)
+{
+    static const char *const units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    double value = bytes;
+    size_t unit = 0;
+    while (value >= 1024 && unit + 1 < sizeof(units) / sizeof(units[0]))
+    {
+        value /= 1024;
+        ++unit;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%.1f %s", value, units[unit]);
+    return text;
+}
+
+void Stats::print(const char *what, uint64_t elapsed, uint64_t rate)
+{
+    uint64_t bytes = __atomic_load_n(&_bytes, __ATOMIC_RELAXED);
+    uint64_t hits = __atomic_load_n(&_hits, __ATOMIC_RELAXED);
+    std::string progress;
+    if (_total > 0 && !_stopping)
+    {
+        double average = elapsed > 0 ? bytes * 1000000000.0 / elapsed : 0;
+        uint64_t eta = average > 0 && _total > bytes ? (_total - bytes) / average : 0;
+        char text[64];
+        snprintf(text, sizeof(text), " (%.1f%%), ETA %llu:%02llu:%02llu",
+                 100.0 * bytes / _total, (unsigned long long)(eta / 3600),
+                 (unsigned long long)(eta / 60 % 60), (unsigned long long)(eta % 60));
+        progress = " of " + formatSize(_total) + text;
+    }
+    // Phases are summed over all threads, so only their shares mean
+    // something: read-heavy is disk-bound, match-heavy CPU-bound.
+    uint64_t times[kPhaseNum];
+    uint64_t sum = 0;
+    for (int i = 0; i < kPhaseNum; ++i)
+        sum += times[i] = __atomic_load_n(&_time[i], __ATOMIC_RELAXED);
+    if (sum == 0)
+        sum = 1;
+    fprintf(stderr, "%s %s%s at %.1f MB/s, %llu hits; read %.0f%% match %.0f%% output %.0f%%\n",
+            what, formatSize(bytes).c_str(), progress.c_str(), rate / 1e6, (unsigned long long)hits,
+            100.0 * times[PHASE_READ] / sum, 100.0 * times[PHASE_MATCH] / sum,
+            100.0 * times[PHASE_OUTPUT] / sum);
+}
+
+// A hit located in the source.
+struct Hit
+{
+    uint64_t offset;
+    int pattern;
+    uint32_t length;
+};
+
+class Collector
+{
+public:
+    Collector() : _input_number(0)
+    { }
+    virtual ~Collector()
+    { }
+
+    // Hits reported from here on are in input name, the number-th input
+    // of a multi-input scan; single input scans leave the name empty.
+    void setInput(const std::string &name, uint32_t number)
+    {
+        _input = name;
+        _input_number = number;
+    }
+
+    virtual void collect(const char *buffer, size_t buffer_size) = 0;
+    // Same as collect, for callers that know where the bytes came from.
+    virtual void collectAt(uint64_t /* offset */, const char *buffer, size_t buffer_size)
+    { collect(buffer, buffer_size); }
+    // Lets the collector move size bytes at offset of fd to its output
+    // without them passing through the caller. Returns false if the caller
+    // has to read them and call collectAt instead.
+    virtual bool collectFrom(int /* fd */, uint64_t /* offset */, size_t /* size */)
+    { return false; }
+    // End of a window; everything collected so far must be written before
+    // the caller reuses the memory it pointed at.
+    virtual void flush()
+    { }
+    // Collectors writing on another thread are not done at flush. They
+    // number windows from 1 by flush; window is the last one, and the
+    // memory of window n may be reused once waitWritten(n) returns.
+    virtual uint64_t window() const
+    { return 0; }
+    virtual void waitWritten(uint64_t /* window */)
+    { }
+    // A hit was found; its context window is [context_start,
+    // context_end), possibly running past the end of input.
+    virtual void matched(const Hit &hit, uint64_t /* context_start */,
+                         uint64_t /* context_end */)
+    {
+        if (_input.empty())
+            fprintf(stderr, "%llu matched\n", (unsigned long long)hit.offset);
+        else
+            fprintf(stderr, "%s: %llu matched\n", _input.c_str(), (unsigned long long)hit.offset);
+    }
+    // True once output could not be written.
+    virtual bool failed() const
+    { return false; }
+    // Writes out and syncs everything collected so far and returns the
+    // output position, or -1 if the output cannot be rewound to it.
+    virtual off_t sync()
+    { flush(); return -1; }
+    // Drops output written after position, as returned by sync.
+    virtual bool rewind(off_t /* position */)
+    { return false; }
+
+protected:
+    std::string _input;
+    uint32_t _input_number;
+};
+
+// Position of a regular file output after making it durable.
+static off_t syncOutput(int fd)
+{
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    ::fdatasync(fd);
+    return ::lseek(fd, 0, SEEK_CUR);
+}
+
+static bool rewindOutput(int fd, off_t position)
+{
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || position > st.st_size)
+        return false;
+    return ::ftruncate(fd, position) == 0 && ::lseek(fd, position, SEEK_SET) == position;
+}
+
+class StreamCollector : public Collector
+{
+public:
+    StreamCollector(std::ostream *stream);
+    virtual ~StreamCollector();
+    virtual void collect(const char *buffer, size_t buffer_size);
+    
+private:
+    std::ostream *_stream;
+};
+
+StreamCollector::StreamCollector(std::ostream *stream)
+        : Collector(),
+          _stream(stream)
+{ }
+
+StreamCollector::~StreamCollector()
+{ }
+
+void StreamCollector::collect(const char *buffer, size_t buffer_size)
+{
+    assert(_stream != NULL);
+    _stream->write(buffer, buffer_size);
+}
+
+// Writes to a file descriptor. The pieces of a window are only referenced
+// until flush, which hands them to the kernel with a single writev; when
+// the output is a pipe, collectFrom splices straight from the source file.
+class FdCollector : public Collector
+{
+public:
+    FdCollector(int fd);
+    virtual ~FdCollector();
+    virtual void collect(const char *buffer, size_t buffer_size);
+    virtual bool collectFrom(int fd, uint64_t offset, size_t size);
+    virtual void flush();
+    virtual bool failed() const
+    { return _error; }
+    virtual off_t sync()
+    { flush(); return syncOutput(_fd); }
+    virtual bool rewind(off_t position)
+    { return rewindOutput(_fd, position); }
+
+private:
+    bool writeAll(struct iovec *iov, int count);
+
+    int _fd;
+    bool _pipe;
+    bool _error;
+    std::vector<struct iovec> _iov;
+};
+
+FdCollector::FdCollector(int fd)
+        : Collector(),
+          _fd(fd),
+          _pipe(false),
+          _error(false)
+{
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+        _pipe = true;
+}
+
+FdCollector::~FdCollector()
+{
+    flush();
+}
+
+void FdCollector::collect(const char *buffer, size_t buffer_size)
+{
+    if (buffer_size == 0)
+        return;
+    if (_iov.size() == IOV_MAX)
+        flush();
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(buffer);
+    iov.iov_len = buffer_size;
+    _iov.push_back(iov);
+}
+
+bool FdCollector::collectFrom(int fd, uint64_t offset, size_t size)
+{
+    if (!_pipe || _error)
+        return false;
+    flush();
+    loff_t pos = offset;
+    while (size > 0)
+    {
+        ssize_t ret = ::splice(fd, &pos, _fd, NULL, size, SPLICE_F_MOVE);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            // Source or pipe does not do splice and nothing was moved yet,
+            // so the caller can still copy it.
+            if (pos == (loff_t)offset && (ret == 0 || errno == EINVAL))
+            {
+                _pipe = false;
+                return false;
+            }
+            _error = true;
+            return true;
+        }
+        size -= ret;
+    }
+    return true;
+}
+
+void FdCollector::flush()
+{
+    if (!_iov.empty() && !_error)
+        _error = !writeAll(&_iov[0], _iov.size());
+    _iov.clear();
+}
+
+bool FdCollector::writeAll(struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t ret = ::writev(_fd, iov, count);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return false;
+        // Skip what was written, possibly stopping inside one piece.
+        while (count > 0 && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+// Writes windows on a thread of its own, so that a slow output does not
+// hold up the scan. Pieces are queued by reference: the caller's memory
+// stays in use until waitWritten for its window returns. If the writer is
+// still behind by then, the pieces it has not taken are copied, into at
+// most limit bytes of memory, and past that either written to an unlinked
+// temp file or waited for, as policy says. Hits are passed on to out's
+// matched on the caller's thread, so it must not write out's output.
+class AsyncCollector : public Collector
+{
+public:
+    enum Policy { POLICY_BLOCK, POLICY_SPILL };
+
+    // out is only used by the writer thread, and by sync and rewind once
+    // everything is written.
+    AsyncCollector(Collector *out, size_t limit, Policy policy);
+    virtual ~AsyncCollector();
+    virtual void collect(const char *buffer, size_t buffer_size)
+    { collectAt(0, buffer, buffer_size); }
+    virtual void collectAt(uint64_t offset, const char *buffer, size_t buffer_size);
+    virtual bool collectFrom(int fd, uint64_t offset, size_t size);
+    virtual void flush();
+    virtual uint64_t window() const
+    { return _window; }
+    virtual void waitWritten(uint64_t window);
+    virtual void matched(const Hit &hit, uint64_t context_start, uint64_t context_end)
+    {
+        _out->setInput(_input, _input_number);
+        _out->matched(hit, context_start, context_end);
+    }
+    virtual bool failed() const;
+    virtual off_t sync()
+    { drain(); return _out->sync(); }
+    virtual bool rewind(off_t position)
+    { drain(); return _out->rewind(position); }
+    // Waits until everything flushed so far is written.
+    void drain();
+
+private:
+    // Source ranges queued at once; each holds a descriptor.
+    static const size_t kMaxFiles = 64;
+    static const size_t kCopySize = 1024 * 1024;
+
+    // A part of a window: bytes in the caller's memory, in a copy of
+    // them, in the spill file or in a source file. PIECE_SPILLING is
+    // still in the caller's memory, which is being written to the spill
+    // file outside _lock. PIECE_END closes the window.
+    enum Kind { PIECE_MEMORY, PIECE_COPY, PIECE_SPILLING, PIECE_SPILL, PIECE_FILE,
+                PIECE_END };
+    struct Piece
+    {
+        Kind kind;
+        uint64_t offset;
+        const char *data;
+        size_t size;
+        int fd;             // PIECE_FILE: a dup of the source
+        off_t spilled;      // PIECE_SPILL: where in the spill file
+        uint64_t window;
+    };
+
+    static void *writeLoop(void *arg);
+    bool writeWindow(const std::vector<Piece> &pieces);
+    bool readBack(int fd, off_t at, size_t size, uint64_t offset);
+    bool copy(Piece *piece);
+    bool spill(const std::vector<Piece> &pieces);
+
+    Collector *_out;
+    size_t _limit;
+    Policy _policy;
+    pthread_t _thread;
+    mutable pthread_mutex_t _lock;
+    pthread_cond_t _cond;       // a window was queued or written
+    std::vector<Piece> _open;   // of the window not flushed yet
+    std::deque<Piece> _queue;   // flushed, not taken by the writer
+    uint64_t _window;           // windows flushed
+    uint64_t _written;          // windows written
+    uint64_t _busy;             // window being written, 0: none
+    bool _busy_pinned;          // it points at the caller's memory
+    size_t _files;              // PIECE_FILE queued or being written
+    size_t _copied;             // bytes in PIECE_COPY pieces
+    int _spill_fd;
+    off_t _spill_end;
+    size_t _spill_held;         // spilled bytes not written yet
+    bool _spill_failed;         // spill from then on as with POLICY_BLOCK
+    bool _stop;
+    bool _error;
+    std::vector<char> _buffer;  // the writer's, for spilled and file pieces
+};
+
+// std::min takes it by reference.
+const size_t AsyncCollector::kCopySize;
+
+AsyncCollector::AsyncCollector(Collector *out, size_t limit, Policy policy)
+        : Collector(),
+          _out(out),
+          _limit(limit),
+          _policy(policy),
+          _window(0),
+          _written(0),
+          _busy(0),
+          _busy_pinned(false),
+          _files(0),
+          _copied(0),
+          _spill_fd(-1),
+          _spill_end(0),
+          _spill_held(0),
+          _spill_failed(false),
+          _stop(false),
+          _error(false)
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+    pthread_create(&_thread, NULL, writeLoop, this);
+}
+
+AsyncCollector::~AsyncCollector()
+{
+    flush();
+    pthread_mutex_lock(&_lock);
+    _stop = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_thread, NULL);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+    if (_spill_fd >= 0)
+        ::close(_spill_fd);
+}
+
+void AsyncCollector::collectAt(uint64_t offset, const char *buffer, size_t buffer_size)
+{
+    if (buffer_size == 0)
+        return;
+    Piece piece;
+    piece.kind = PIECE_MEMORY;
+    piece.offset = offset;
+    piece.data = buffer;
+    piece.size = buffer_size;
+    piece.fd = -1;
+    piece.spilled = 0;
+    piece.window = 0;
+    _open.push_back(piece);
+}
+
+bool AsyncCollector::collectFrom(int fd, uint64_t offset, size_t size)
+{
+    // The caller may close fd as soon as this returns.
+    pthread_mutex_lock(&_lock);
+    while (_files >= kMaxFiles)
+        pthread_cond_wait(&_cond, &_lock);
+    pthread_mutex_unlock(&_lock);
+    int copy = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (copy < 0)
+        return false;
+    Piece piece;
+    piece.kind = PIECE_FILE;
+    piece.offset = offset;
+    piece.data = NULL;
+    piece.size = size;
+    piece.fd = copy;
+    piece.spilled = 0;
+    piece.window = 0;
+    _open.push_back(piece);
+    return true;
+}
+
+void AsyncCollector::flush()
+{
+    if (_open.empty())
+        return;
+    Piece end;
+    end.kind = PIECE_END;
+    end.offset = 0;
+    end.data = NULL;
+    end.size = 0;
+    end.fd = -1;
+    end.spilled = 0;
+    _open.push_back(end);
+    pthread_mutex_lock(&_lock);
+    ++_window;
+    for (size_t i = 0; i < _open.size(); ++i)
+    {
+        _open[i].window = _window;
+        if (_open[i].kind == PIECE_FILE)
+            ++_files;
+        _queue.push_back(_open[i]);
+    }
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+    _open.clear();
+}
+
+void AsyncCollector::waitWritten(uint64_t window)
+{
+    pthread_mutex_lock(&_lock);
+    while (_written < window)
+    {
+        // Pieces the writer has not taken can be moved out of the way;
+        // the window it is writing has to be waited for.
+        bool pinned = _busy != 0 && _busy <= window && _busy_pinned;
+        std::vector<Piece> spills;
+        for (size_t i = 0; i < _queue.size() && _queue[i].window <= window; ++i)
+        {
+            Piece &piece = _queue[i];
+            if (piece.kind != PIECE_MEMORY || copy(&piece))
+                continue;
+            if (_policy != POLICY_SPILL || _spill_failed)
+            {
+                pinned = true;
+                continue;
+            }
+            // Nothing is left to read back, so start over.
+            if (_spill_held == 0)
+                _spill_end = 0;
+            piece.kind = PIECE_SPILLING;
+            piece.spilled = _spill_end;
+            _spill_end += piece.size;
+            _spill_held += piece.size;
+            spills.push_back(piece);
+        }
+        if (!spills.empty())
+        {
+            // The spill disk may be slow; the writer goes on meanwhile,
+            // and writes pieces it takes from the caller's memory.
+            pthread_mutex_unlock(&_lock);
+            bool ok = spill(spills);
+            pthread_mutex_lock(&_lock);
+            _spill_failed = _spill_failed || !ok;
+            for (size_t i = 0, j = 0; i < _queue.size() && j < spills.size(); ++i)
+            {
+                Piece &piece = _queue[i];
+                if (piece.kind != PIECE_SPILLING)
+                    continue;
+                // Pieces the writer took are gone from the queue.
+                while (j < spills.size() && spills[j].spilled < piece.spilled)
+                    ++j;
+                if (j == spills.size() || spills[j].spilled != piece.spilled)
+                    continue;
+                if (ok)
+                {
+                    piece.kind = PIECE_SPILL;
+                    piece.data = NULL;
+                }
+                else
+                {
+                    piece.kind = PIECE_MEMORY;
+                    _spill_held -= piece.size;
+                }
+            }
+            continue;
+        }
+        if (!pinned)
+            break;
+        pthread_cond_wait(&_cond, &_lock);
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+// Called with _lock held.
+bool AsyncCollector::copy(Piece *piece)
+{
+    if (_copied + piece->size > _limit)
+        return false;
+    char *copy = new char[piece->size];
+    memcpy(copy, piece->data, piece->size);
+    piece->kind = PIECE_COPY;
+    piece->data = copy;
+    _copied += piece->size;
+    return true;
+}
+
+// Writes pieces, in the caller's memory, to where they were given in the
+// spill file. Only the scan thread spills, so the file is created here.
+bool AsyncCollector::spill(const std::vector<Piece> &pieces)
+{
+    if (_spill_fd < 0)
+    {
+        const char *dir = getenv("TMPDIR");
+        std::string path = std::string(dir != NULL && *dir != '\0' ? dir : "/tmp")
+                           + "/bgrep-spill.XXXXXX";
+        int fd = ::mkostemp(&path[0], O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        ::unlink(path.c_str());
+        _spill_fd = fd;
+    }
+    for (size_t i = 0; i < pieces.size(); ++i)
+    {
+        const Piece &piece = pieces[i];
+        for (size_t done = 0; done < piece.size; )
+        {
+            ssize_t ret = ::pwrite(_spill_fd, piece.data + done, piece.size - done,
+                                   piece.spilled + done);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            done += ret;
+        }
+    }
+    return true;
+}
+
+bool AsyncCollector::failed() const
+{
+    pthread_mutex_lock(&_lock);
+    bool error = _error;
+    pthread_mutex_unlock(&_lock);
+    return error;
+}
+
+void AsyncCollector::drain()
+{
+    flush();
+    pthread_mutex_lock(&_lock);
+    while (_written < _window)
+        pthread_cond_wait(&_cond, &_lock);
+    pthread_mutex_unlock(&_lock);
+}
+
+void *AsyncCollector::writeLoop(void *arg)
+{
+    AsyncCollector *self = (AsyncCollector *)arg;
+    std::vector<Piece> pieces;
+    pthread_mutex_lock(&self->_lock);
+    for (;;)
+    {
+        while (self->_queue.empty() && !self->_stop)
+            pthread_cond_wait(&self->_cond, &self->_lock);
+        if (self->_queue.empty())
+            break;
+        // flush queues whole windows; take the oldest.
+        pieces.clear();
+        self->_busy_pinned = false;
+        do
+        {
+            pieces.push_back(self->_queue.front());
+            self->_queue.pop_front();
+            if (pieces.back().kind == PIECE_MEMORY || pieces.back().kind == PIECE_SPILLING)
+                self->_busy_pinned = true;
+        }
+        while (pieces.back().kind != PIECE_END);
+        self->_busy = pieces.back().window;
+        pthread_mutex_unlock(&self->_lock);
+
+        bool ok = self->writeWindow(pieces);
+
+        pthread_mutex_lock(&self->_lock);
+        for (size_t i = 0; i < pieces.size(); ++i)
+        {
+            if (pieces[i].kind == PIECE_COPY)
+            {
+                delete[] pieces[i].data;
+                self->_copied -= pieces[i].size;
+            }
+            else if (pieces[i].kind == PIECE_SPILL || pieces[i].kind == PIECE_SPILLING)
+                self->_spill_held -= pieces[i].size;
+            else if (pieces[i].kind == PIECE_FILE)
+                --self->_files;
+        }
+        self->_error = self->_error || !ok || self->_out->failed();
+        self->_written = self->_busy;
+        self->_busy = 0;
+        pthread_cond_broadcast(&self->_cond);
+    }
+    pthread_mutex_unlock(&self->_lock);
+    return NULL;
+}
+
+bool AsyncCollector::writeWindow(const std::vector<Piece> &pieces)
+{
+    bool ok = true;
+    for (size_t i = 0; i < pieces.size(); ++i)
+    {
+        const Piece &piece = pieces[i];
+        switch (piece.kind)
+        {
+        case PIECE_MEMORY:
+        case PIECE_COPY:
+        case PIECE_SPILLING:
+            _out->collectAt(piece.offset, piece.data, piece.size);
+            break;
+        case PIECE_SPILL:
+            // _buffer is reused, so what is before it goes out first.
+            _out->flush();
+            ok = readBack(_spill_fd, piece.spilled, piece.size, piece.offset) && ok;
+            break;
+        case PIECE_FILE:
+            _out->flush();
+            if (!_out->collectFrom(piece.fd, piece.offset, piece.size))
+                ok = readBack(piece.fd, piece.offset, piece.size, piece.offset) && ok;
+            ::close(piece.fd);
+            break;
+        case PIECE_END:
+            _out->flush();
+            break;
+        }
+    }
+    return ok;
+}
+
+// Writes size bytes at at of fd, input bytes from offset on, to _out a
+// piece at a time.
+bool AsyncCollector::readBack(int fd, off_t at, size_t size, uint64_t offset)
+{
+    _buffer.resize(std::min(size, kCopySize));
+    for (size_t done = 0; done < size; )
+    {
+        size_t len = std::min(size - done, kCopySize);
+        ssize_t ret = ::pread(fd, &_buffer[0], len, at + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        _out->collectAt(offset + done, &_buffer[0], ret);
+        _out->flush();
+        done += ret;
+    }
+    return true;
+}
+
+// Helpers for the pattern cache and checkpoints: numbers, strings and
+// vectors packed into a byte string, hashes, and files replaced in one
+// step.
+
+// FNV-1a, continued from h over data[0, size).
+static const uint64_t kFnvBasis = 14695981039346656037ULL;
+
+static uint64_t fnv1a(uint64_t h, const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Checkpoint and pattern cache fields, in host byte order.
+static void putU64(std::string *out, uint64_t value)
+{
+    out->append((const char *)&value, sizeof(value));
+}
+
+static bool getU64(const std::string &in, size_t *pos, uint64_t *value)
+{
+    if (in.size() - *pos < sizeof(*value))
+        return false;
+    memcpy(value, in.data() + *pos, sizeof(*value));
+    *pos += sizeof(*value);
+    return true;
+}
+
+template <typename T>
+static void putVector(std::string *out, const std::vector<T> &values)
+{
+    putU64(out, values.size());
+    if (!values.empty())
+        out->append((const char *)&values[0], values.size() * sizeof(T));
+}
+
+template <typename T>
+static bool getVector(const std::string &in, size_t *pos, std::vector<T> *values)
+{
+    uint64_t count = 0;
+    if (!getU64(in, pos, &count) || count > (in.size() - *pos) / sizeof(T))
+        return false;
+    values->resize(count);
+    if (count > 0)
+        memcpy(&(*values)[0], in.data() + *pos, count * sizeof(T));
+    *pos += count * sizeof(T);
+    return true;
+}
+
+static void putString(std::string *out, const std::string &value)
+{
+    putU64(out, value.size());
+    *out += value;
+}
+
+static bool getString(const std::string &in, size_t *pos, std::string *value)
+{
+    uint64_t size = 0;
+    if (!getU64(in, pos, &size) || size > in.size() - *pos)
+        return false;
+    value->assign(in, *pos, size);
+    *pos += size;
+    return true;
+}
+
+static bool readFile(const char *path, std::string *data)
+{
+    int fd = ::open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return false;
+    bool ok = ::fstat(fd, &st) == 0;
+    data->resize(ok ? st.st_size : 0);
+    for (size_t pos = 0; ok && pos < data->size(); )
+    {
+        ssize_t ret = ::read(fd, &(*data)[pos], data->size() - pos);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        ok = ret > 0;
+        pos += ok ? ret : 0;
+    }
+    ::close(fd);
+    return ok;
+}
+
+// Integrity check of cache files that can be hundreds of megabytes, so
+// it mixes in a word at a time rather than FNV's byte.
+static uint64_t checksum(const char *data, size_t size)
+{
+    uint64_t h = kFnvBasis ^ size;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return fnv1a(h, data + i, size - i);
+}
+
+// Written aside and renamed, so a crash leaves the previous file.
+static bool replaceFile(const char *path, const std::string &data)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = ::write(fd, data.data(), data.size()) == (ssize_t)data.size()
+              && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || ::rename(tmp.c_str(), path) != 0)
+    {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Single literal search. Candidate positions are found by comparing the
+// first and the last byte of the needle against a whole vector of input at
+// once; only positions where both agree are verified with memcmp. The
+// widest kernel the CPU supports is picked once at startup.
+class LiteralScanner
+{
+public:
+    // With fold_case ASCII letters in needle match either case.
+    static const char *find(const char *haystack, size_t len,
+                            const char *needle, size_t needle_len, bool fold_case = false);
+    // Whether data[0, len) is all zero bytes.
+    static bool isZero(const char *data, size_t len);
+    static const char *isa();
+
+private:
+    typedef const char *(*FindFunc)(const char *, size_t, const char *, size_t);
+    static FindFunc select(bool fold_case);
+
+    static FindFunc _find;
+    static FindFunc _find_folded;
+    static const char *_isa;
+};
+
+static inline bool isAsciiLetter(unsigned char c)
+{
+    return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+}
+
+static inline bool equalFolded(const char *a, const char *b, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned char x = a[i];
+        unsigned char y = b[i];
+        if (x != y && !(isAsciiLetter(x) && (x ^ y) == 0x20))
+            return false;
+    }
+    return true;
+}
+
+template <bool Fold>
+static const char *findScalar(const char *haystack, size_t len,
+                              const char *needle, size_t needle_len)
+{
+    if (!Fold)
+        return (const char *)memmem(haystack, len, needle, needle_len);
+    for (size_t i = 0; i + needle_len <= len; ++i)
+        if (equalFolded(haystack + i, needle, needle_len))
+            return haystack + i;
+    return NULL;
+}
+
+// The byte a vector lane is compared against, and the bits set in the
+// input first: folding a letter sets 0x20 on both sides. Other bytes
+// that turn into it are weeded out when verifying.
+static inline char foldedByte(char c, bool fold)
+{
+    return fold && isAsciiLetter(c) ? c | 0x20 : c;
+}
+
+static inline char foldMask(char c, bool fold)
+{
+    return fold && isAsciiLetter(c) ? 0x20 : 0;
+}
+
+// Verifies the candidate bits of mask (bit k = position base + k) and
+// returns the first real hit.
+template <bool Fold>
+static inline const char *verifyCandidates(uint64_t mask, const char *base,
+                                           const char *needle, size_t needle_len)
+{
+    while (mask != 0)
+    {
+        const char *candidate = base + __builtin_ctzll(mask);
+        if (Fold ? equalFolded(candidate, needle, needle_len)
+                 : memcmp(candidate + 1, needle + 1, needle_len - 2) == 0)
+            return candidate;
+        mask &= mask - 1;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <bool Fold>
+static const char *findSse2(const char *haystack, size_t len,
+                            const char *needle, size_t needle_len)
+{
+    if (needle_len < 2 || len < needle_len + 15)
+        return findScalar<Fold>(haystack, len, needle, needle_len);
+    const __m128i first = _mm_set1_epi8(foldedByte(needle[0], Fold));
+    const __m128i last = _mm_set1_epi8(foldedByte(needle[needle_len - 1], Fold));
+    const __m128i first_mask = _mm_set1_epi8(foldMask(needle[0], Fold));
+    const __m128i last_mask = _mm_set1_epi8(foldMask(needle[needle_len - 1], Fold));
+    size_t i = 0;
+    for (; i + needle_len + 15 <= len; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1));
+        if (Fold)
+        {
+            block_first = _mm_or_si128(block_first, first_mask);
+            block_last = _mm_or_si128(block_last, last_mask);
+        }
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                   _mm_cmpeq_epi8(last, block_last));
+        uint64_t mask = (uint32_t)_mm_movemask_epi8(eq);
+        const char *found = verifyCandidates<Fold>(mask, haystack + i, needle, needle_len);
+        if (found != NULL)
+            return found;
+    }
+    return findScalar<Fold>(haystack + i, len - i, needle, needle_len);
+}
+
+template <bool Fold>
+__attribute__((target("avx2")))
+static const char *findAvx2(const char *haystack, size_t len,
+                            const char *needle, size_t needle_len)
+{
+    if (needle_len < 2 || len < needle_len + 31)
+        return findSse2<Fold>(haystack, len, needle, needle_len);
+    const __m256i first = _mm256_set1_epi8(foldedByte(needle[0], Fold));
+    const __m256i last = _mm256_set1_epi8(foldedByte(needle[needle_len - 1], Fold));
+    const __m256i first_mask = _mm256_set1_epi8(foldMask(needle[0], Fold));
+    const __m256i last_mask = _mm256_set1_epi8(foldMask(needle[needle_len - 1], Fold));
+    size_t i = 0;
+    for (; i + needle_len + 31 <= len; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(haystack + i + needle_len - 1));
+        if (Fold)
+        {
+            block_first = _mm256_or_si256(block_first, first_mask);
+            block_last = _mm256_or_si256(block_last, last_mask);
+        }
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                      _mm256_cmpeq_epi8(last, block_last));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(eq);
+        const char *found = verifyCandidates<Fold>(mask, haystack + i, needle, needle_len);
+        if (found != NULL)
+            return found;
+    }
+    return findSse2<Fold>(haystack + i, len - i, needle, needle_len);
+}
+#elif defined(__aarch64__)
+template <bool Fold>
+static const char *findNeon(const char *haystack, size_t len,
+                            const char *needle, size_t needle_len)
+{
+    if (needle_len < 2 || len < needle_len + 15)
+        return findScalar<Fold>(haystack, len, needle, needle_len);
+    const uint8x16_t first = vdupq_n_u8(foldedByte(needle[0], Fold));
+    const uint8x16_t last = vdupq_n_u8(foldedByte(needle[needle_len - 1], Fold));
+    const uint8x16_t first_mask = vdupq_n_u8(foldMask(needle[0], Fold));
+    const uint8x16_t last_mask = vdupq_n_u8(foldMask(needle[needle_len - 1], Fold));
+    size_t i = 0;
+    for (; i + needle_len + 15 <= len; i += 16)
+    {
+        uint8x16_t block_first = vld1q_u8((const uint8_t *)haystack + i);
+        uint8x16_t block_last = vld1q_u8((const uint8_t *)haystack + i + needle_len - 1);
+        if (Fold)
+        {
+            block_first = vorrq_u8(block_first, first_mask);
+            block_last = vorrq_u8(block_last, last_mask);
+        }
+        uint8x16_t eq = vandq_u8(vceqq_u8(first, block_first), vceqq_u8(last, block_last));
+        // Narrow to 4 bits per byte; keep one bit per position.
+        uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        nibbles &= 0x1111111111111111ULL;
+        while (nibbles != 0)
+        {
+            const char *candidate = haystack + i + (__builtin_ctzll(nibbles) >> 2);
+            if (Fold ? equalFolded(candidate, needle, needle_len)
+                     : memcmp(candidate + 1, needle + 1, needle_len - 2) == 0)
+                return candidate;
+            nibbles &= nibbles - 1;
+        }
+    }
+    return findScalar<Fold>(haystack + i, len - i, needle, needle_len);
+}
+#endif
+
+LiteralScanner::FindFunc LiteralScanner::_find = LiteralScanner::select(false);
+LiteralScanner::FindFunc LiteralScanner::_find_folded = LiteralScanner::select(true);
+const char *LiteralScanner::_isa = "scalar";
+
+LiteralScanner::FindFunc LiteralScanner::select(bool fold_case)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        _isa = "avx2";
+        return fold_case ? findAvx2<true> : findAvx2<false>;
+    }
+    _isa = "sse2";
+    return fold_case ? findSse2<true> : findSse2<false>;
+#elif defined(__aarch64__)
+    _isa = "neon";
+    return fold_case ? findNeon<true> : findNeon<false>;
+#else
+    return fold_case ? findScalar<true> : findScalar<false>;
+#endif
+}
+
+const char *LiteralScanner::find(const char *haystack, size_t len,
+                                 const char *needle, size_t needle_len, bool fold_case)
+{
+    if (fold_case)
+    {
+        if (needle_len == 1 && !isAsciiLetter(needle[0]))
+            return (const char *)memchr(haystack, needle[0], len);
+        return needle_len == 1 ? findScalar<true>(haystack, len, needle, needle_len)
+                               : _find_folded(haystack, len, needle, needle_len);
+    }
+    if (needle_len == 1)
+        return (const char *)memchr(haystack, needle[0], len);
+    return _find(haystack, len, needle, needle_len);
+}
+
+bool LiteralScanner::isZero(const char *data, size_t len)
+{
+    // Data slots nearly always fail on the first word.
+    size_t i = 0;
+    uint64_t word = 0;
+    if (len >= 8)
+    {
+        memcpy(&word, data, 8);
+        if (word != 0)
+            return false;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    for (; i + 64 <= len; i += 64)
+    {
+        const __m128i *block = (const __m128i *)(data + i);
+        __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+                                   _mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff)
+            return false;
+    }
+#elif defined(__aarch64__)
+    for (; i + 64 <= len; i += 64)
+    {
+        const uint8_t *block = (const uint8_t *)data + i;
+        uint8x16_t any = vorrq_u8(vorrq_u8(vld1q_u8(block), vld1q_u8(block + 16)),
+                                  vorrq_u8(vld1q_u8(block + 32), vld1q_u8(block + 48)));
+        if (vmaxvq_u8(any) != 0)
+            return false;
+    }
+#endif
+    for (; i + 8 <= len; i += 8)
+    {
+        memcpy(&word, data + i, 8);
+        if (word != 0)
+            return false;
+    }
+    for (; i < len; ++i)
+    {
+        if (data[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+const char *LiteralScanner::isa()
+{
+    return _isa;
+}
+
+// Multi-pattern matcher: an Aho-Corasick automaton stored as one flat,
+// premultiplied transition table over byte equivalence classes, so each
+// input byte costs a single table lookup no matter how many patterns.
+class AhoCorasick
+{
+public:
+    AhoCorasick();
+    ~AhoCorasick();
+
+    // With fold_case each ASCII letter shares a class with its other
+    // case, so patterns match either without any extra states.
+    void build(const std::vector<std::string> &patterns, bool fold_case = false);
+    // Scans str[0, len) and stops at the first position where a pattern
+    // ends. On success *end is the offset one past the last matched byte
+    // and *pattern the index of the longest pattern ending there.
+    bool search(const char *str, size_t len, size_t *end, int *pattern) const;
+    // Resumable form of search: scanning starts at str[*end] in *state,
+    // and both are left just past the reported hit.
+    bool resume(const char *str, size_t len, uint32_t *state, size_t *end,
+                int *pattern) const;
+    // Appends every pattern ending at a state left by resume.
+    void outputs(uint32_t state, std::vector<int> *patterns) const;
+    size_t stateCount() const { return _state_num; }
+    // The built tables, for a pattern cache. load checks that they are
+    // consistent for pattern_num patterns before taking them.
+    void save(std::string *out) const;
+    bool load(const std::string &in, size_t *pos, size_t pattern_num);
+
+private:
+    int output(uint32_t state) const;
+
+private:
+    uint8_t _class[256];           // byte -> equivalence class
+    uint32_t _stride;              // number of classes
+    uint32_t _state_num;
+    uint32_t _accept_start;        // states from here on accept, times stride
+    std::vector<uint32_t> _delta;  // [state * stride + class] -> next * stride
+    std::vector<int> _out;         // pattern ending exactly at state, -1 if none
+    std::vector<uint32_t> _dict;   // nearest proper suffix state with an output
+    std::vector<char> _accept;     // any pattern ends at state
+};
+
+AhoCorasick::AhoCorasick() : _stride(1), _state_num(0), _accept_start(0)
+{
+    memset(_class, 0, sizeof(_class));
+}
+
+AhoCorasick::~AhoCorasick()
+{ }
+
+void AhoCorasick::build(const std::vector<std::string> &patterns, bool fold_case)
+{
+    // Bytes that never occur in a pattern all share class 0, when there
+    // are such bytes; _class could not number 257 classes.
+    bool used[256] = { false };
+    for (size_t i = 0; i < patterns.size(); ++i)
+        for (size_t j = 0; j < patterns[i].size(); ++j)
+            used[(uint8_t)patterns[i][j]] = true;
+    for (int c = 'A'; fold_case && c <= 'Z'; ++c)
+    {
+        used[c] = used[c] || used[c - 'A' + 'a'];
+        used[c - 'A' + 'a'] = false;
+    }
+    _stride = std::count(used, used + 256, true) < 256 ? 1 : 0;
+    for (int c = 0; c < 256; ++c)
+        _class[c] = used[c] ? _stride++ : 0;
+    for (int c = 'A'; fold_case && c <= 'Z'; ++c)
+        _class[c - 'A' + 'a'] = _class[c];
+
+    // Trie over classes; 0 marks a missing edge (the root is never a child).
+    std::vector<uint32_t> trie(_stride, 0);
+    _out.assign(1, -1);
+    _state_num = 1;
+    for (size_t i = 0; i < patterns.size(); ++i)
+    {
+        const std::string &pattern = patterns[i];
+        if (pattern.empty())
+            continue;
+        uint32_t state = 0;
+        for (size_t j = 0; j < pattern.size(); ++j)
+        {
+            uint32_t c = _class[(uint8_t)pattern[j]];
+            if (trie[state * _stride + c] == 0)
+            {
+                trie[state * _stride + c] = _state_num++;
+                trie.resize(_state_num * _stride, 0);
+                _out.push_back(-1);
+            }
+            state = trie[state * _stride + c];
+        }
+        if (_out[state] < 0)
+            _out[state] = (int)i;
+    }
+
+    // Breadth-first fill of the failure transitions into a complete DFA.
+    _delta.assign(_state_num * _stride, 0);
+    _dict.assign(_state_num, 0);
+    _accept.assign(_state_num, 0);
+    std::vector<uint32_t> fail(_state_num, 0);
+    std::vector<uint32_t> queue;
+    queue.reserve(_state_num);
+    for (uint32_t c = 0; c < _stride; ++c)
+    {
+        uint32_t child = trie[c];
+        _delta[c] = child * _stride;
+        if (child != 0)
+            queue.push_back(child);
+    }
+    for (size_t head = 0; head < queue.size(); ++head)
+    {
+        uint32_t state = queue[head];
+        uint32_t f = fail[state];
+        _dict[state] = _out[f] >= 0 ? f : _dict[f];
+        _accept[state] = _out[state] >= 0 || _dict[state] != 0;
+        for (uint32_t c = 0; c < _stride; ++c)
+        {
+            uint32_t child = trie[state * _stride + c];
+            if (child != 0)
+            {
+                fail[child] = _delta[f * _stride + c] / _stride;
+                _delta[state * _stride + c] = child * _stride;
+                queue.push_back(child);
+            }
+            else
+            {
+                _delta[state * _stride + c] = _delta[f * _stride + c];
+            }
+        }
+    }
+
+    // Accepting states are numbered last, so the scan loop tells them
+    // apart by one compare rather than a division by the stride. The
+    // root accepts nothing and stays state 0.
+    std::vector<uint32_t> order;
+    order.reserve(_state_num);
+    for (int accepting = 0; accepting < 2; ++accepting)
+        for (uint32_t state = 0; state < _state_num; ++state)
+            if (_accept[state] == accepting)
+                order.push_back(state);
+    std::vector<uint32_t> number(_state_num);
+    for (uint32_t i = 0; i < _state_num; ++i)
+        number[order[i]] = i;
+    std::vector<uint32_t> delta(_delta.size());
+    std::vector<int> out(_state_num);
+    std::vector<uint32_t> dict(_state_num);
+    std::vector<char> accept(_state_num);
+    for (uint32_t i = 0; i < _state_num; ++i)
+    {
+        uint32_t old = order[i];
+        for (uint32_t c = 0; c < _stride; ++c)
+            delta[i * _stride + c] = number[_delta[old * _stride + c] / _stride] * _stride;
+        out[i] = _out[old];
+        dict[i] = number[_dict[old]];
+        accept[i] = _accept[old];
+    }
+    _delta.swap(delta);
+    _out.swap(out);
+    _dict.swap(dict);
+    _accept.swap(accept);
+    _accept_start = (std::find(_accept.begin(), _accept.end(), 1) - _accept.begin()) * _stride;
+}
+
+void AhoCorasick::outputs(uint32_t state, std::vector<int> *patterns) const
+{
+    uint32_t s = state / _stride;
+    if (_out[s] >= 0)
+        patterns->push_back(_out[s]);
+    for (s = _dict[s]; s != 0; s = _dict[s])
+        patterns->push_back(_out[s]);
+}
+
+void AhoCorasick::save(std::string *out) const
+{
+    out->append((const char *)_class, sizeof(_class));
+    putU64(out, _stride);
+    putU64(out, _state_num);
+    putVector(out, _delta);
+    putVector(out, _out);
+    putVector(out, _dict);
+    putVector(out, _accept);
+}
+
+bool AhoCorasick::load(const std::string &in, size_t *pos, size_t pattern_num)
+{
+    uint64_t stride = 0;
+    uint64_t state_num = 0;
+    if (in.size() - *pos < sizeof(_class))
+        return false;
+    memcpy(_class, in.data() + *pos, sizeof(_class));
+    *pos += sizeof(_class);
+    if (!getU64(in, pos, &stride) || !getU64(in, pos, &state_num)
+        || stride == 0 || stride > 256 || state_num == 0 || state_num > UINT32_MAX / stride
+        || !getVector(in, pos, &_delta) || !getVector(in, pos, &_out)
+        || !getVector(in, pos, &_dict) || !getVector(in, pos, &_accept)
+        || _delta.size() != state_num * stride || _out.size() != state_num
+        || _dict.size() != state_num || _accept.size() != state_num)
+        return false;
+    _stride = stride;
+    _state_num = state_num;
+    bool ok = true;
+    for (int c = 0; c < 256; ++c)
+        ok = ok && _class[c] < _stride;
+    for (size_t i = 0; i < _delta.size(); ++i)
+        ok = ok && _delta[i] % _stride == 0 && _delta[i] / _stride < _state_num;
+    for (size_t i = 0; i < _state_num; ++i)
+        ok = ok && _out[i] >= -1 && _out[i] < (int)pattern_num && _dict[i] < _state_num;
+    // Accepting states must come last, as build numbers them.
+    size_t accept_from = std::find(_accept.begin(), _accept.end(), 1) - _accept.begin();
+    ok = ok && accept_from > 0
+         && (size_t)std::count(_accept.begin(), _accept.end(), 1) == _state_num - accept_from;
+    _accept_start = accept_from * _stride;
+    if (!ok)
+        _state_num = 0;
+    return ok;
+}
+
+int AhoCorasick::output(uint32_t state) const
+{
+    return _out[state] >= 0 ? _out[state] : _out[_dict[state]];
+}
+
+bool AhoCorasick::search(const char *str, size_t len, size_t *end, int *pattern) const
+{
+    uint32_t state = 0;
+    *end = 0;
+    return resume(str, len, &state, end, pattern);
+}
+
+bool AhoCorasick::resume(const char *str, size_t len, uint32_t *state, size_t *end,
+                         int *pattern) const
+{
+    if (_state_num == 0)
+        return false;
+    const uint32_t *delta = &_delta[0];
+    const uint8_t *p = (const uint8_t *)str;
+    const uint32_t accept_start = _accept_start;
+    uint32_t s = *state;
+    for (size_t i = *end; i < len; ++i)
+    {
+        s = delta[s + _class[p[i]]];
+        if (s >= accept_start)
+        {
+            *state = s;
+            *end = i + 1;
+            *pattern = output(s / _stride);
+            return true;
+        }
+    }
+    *state = s;
+    *end = len;
+    return false;
+}
+
+// Regular expression over bytes, compiled to a DFA that is run anchored
+// at candidate starts. Supported are literal bytes, \xHH, \n \r \t \0,
+// \d \w \s, '.', [classes] with ranges and '^', (groups), '|' and the
+// repeats ?, *, +, {m}, {m,} and {m,n}. Each start reports its shortest
+// match, so a hit is known as soon as its last byte is seen; matches are
+// at most kMaxLength bytes long.
+class Regex
+{
+public:
+    static const size_t kMaxLength = 1024;
+
+    Regex();
+    ~Regex();
+
+    // With fold_case ASCII letters match either case.
+    bool compile(const std::string &expr, std::string *error, bool fold_case = false);
+    // Length of the shortest match starting at str[0], 0 if there is none
+    // within str[0, len).
+    size_t matchAt(const char *str, size_t len) const;
+    // Moves *pos forward to the first start in str[0, len) that can begin
+    // a match: one where the required literal follows at the right
+    // distance or, lacking one, whose byte can start a match.
+    bool nextCandidate(const char *str, size_t len, size_t *pos) const;
+    size_t maxLength() const { return _max_length; }
+    // Whether a match can contain byte.
+    bool canMatch(unsigned char byte) const;
+    const std::string &required() const { return _required; }
+    // The compiled DFA, for a pattern cache; load checks it is consistent.
+    void save(std::string *out) const;
+    bool load(const std::string &in, size_t *pos);
+
+private:
+    enum NodeKind { NODE_BYTES, NODE_CONCAT, NODE_ALT, NODE_REPEAT };
+    static const int kUnbounded = -1;
+    static const size_t kMaxRepeat = 1024;
+    static const size_t kMaxNfaStates = 65536;
+    static const size_t kMaxDfaStates = 4096;
+
+    struct Node
+    {
+        NodeKind kind;
+        uint64_t set[4];          // NODE_BYTES
+        std::vector<int> children;
+        int min;                  // NODE_REPEAT
+        int max;
+    };
+    // Thompson NFA state: an optional byte edge and epsilon edges.
+    struct NfaState
+    {
+        uint64_t set[4];
+        int next;                 // -1 if there is no byte edge
+        std::vector<int> eps;
+    };
+
+    static bool contains(const uint64_t *set, int byte)
+    { return (set[byte >> 6] >> (byte & 63)) & 1; }
+    static void insert(uint64_t *set, int byte)
+    { set[byte >> 6] |= 1ULL << (byte & 63); }
+    void foldCase(uint64_t *set) const;
+
+    int newNode(NodeKind kind);
+    int parseAlt();
+    int parseConcat();
+    int parseRepeat();
+    int parseAtom();
+    bool parseClass(uint64_t *set);
+    bool parseEscape(uint64_t *set);
+    bool fail(const char *message);
+    void lengths(int node, uint64_t *min, uint64_t *max) const;
+    void findRequired(int root);
+    int newState();
+    bool build(int node, int *start, int *end);
+    void closure(std::vector<int> *states) const;
+    bool buildDfa(int start, int accept);
+
+    // Parser and NFA state, only used while compiling.
+    std::string _expr;
+    size_t _pos;
+    std::string *_error;
+    bool _fold_case;
+    std::vector<Node> _nodes;
+    std::vector<NfaState> _nfa;
+
+    uint8_t _class[256];
+    uint32_t _stride;
+    std::vector<int32_t> _delta;   // [state * stride + class] -> state, -1: no match
+    std::vector<char> _accept;
+    bool _first[256];              // bytes a match can start with
+    std::string _required;
+    size_t _required_min;          // distance of _required from the start
+    size_t _required_max;
+    size_t _max_length;
+};
+
+Regex::Regex()
+        : _pos(0),
+          _error(NULL),
+          _fold_case(false),
+          _stride(1),
+          _required_min(0),
+          _required_max(0),
+          _max_length(0)
+{
+    memset(_class, 0, sizeof(_class));
+    memset(_first, 0, sizeof(_first));
+}
+
+Regex::~Regex()
+{ }
+
+bool Regex::fail(const char *message)
+{
+    if (_error->empty())
+    {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "%s at offset %zu", message, _pos);
+        *_error = buffer;
+    }
+    return false;
+}
+
+int Regex::newNode(NodeKind kind)
+{
+    Node node;
+    node.kind = kind;
+    memset(node.set, 0, sizeof(node.set));
+    node.min = node.max = 0;
+    _nodes.push_back(node);
+    return _nodes.size() - 1;
+}
+
+int Regex::parseAlt()
+{
+    int left = parseConcat();
+    while (left >= 0 && _pos < _expr.size() && _expr[_pos] == '|')
+    {
+        ++_pos;
+        int right = parseConcat();
+        if (right < 0)
+            return -1;
+        int alt = newNode(NODE_ALT);
+        _nodes[alt].children.push_back(left);
+        _nodes[alt].children.push_back(right);
+        left = alt;
+    }
+    return left;
+}
+
+int Regex::parseConcat()
+{
+    int concat = newNode(NODE_CONCAT);
+    while (_pos < _expr.size() && _expr[_pos] != '|' && _expr[_pos] != ')')
+    {
+        int item = parseRepeat();
+        if (item < 0)
+            return -1;
+        _nodes[concat].children.push_back(item);
+    }
+    if (_nodes[concat].children.empty())
+    {
+        fail("empty expression");
+        return -1;
+    }
+    if (_nodes[concat].children.size() == 1)
+        return _nodes[concat].children[0];
+    return concat;
+}
+
+int Regex::parseRepeat()
+{
+    int atom = parseAtom();
+    while (atom >= 0 && _pos < _expr.size())
+    {
+        char c = _expr[_pos];
+        int min = 0;
+        int max = 0;
+        if (c == '?')
+            max = 1;
+        else if (c == '*')
+            max = kUnbounded;
+        else if (c == '+')
+            min = 1, max = kUnbounded;
+        else if (c == '{')
+        {
+            size_t end = _expr.find('}', _pos);
+            unsigned lo = 0;
+            unsigned hi = 0;
+            int used = 0;
+            std::string bounds = end == std::string::npos ? "" : _expr.substr(_pos + 1, end - _pos - 1);
+            if (sscanf(bounds.c_str(), "%u,%u%n", &lo, &hi, &used) == 2 && used == (int)bounds.size())
+                min = lo, max = hi;
+            else if (sscanf(bounds.c_str(), "%u,%n", &lo, &used) == 1 && used == (int)bounds.size())
+                min = lo, max = kUnbounded;
+            else if (sscanf(bounds.c_str(), "%u%n", &lo, &used) == 1 && used == (int)bounds.size())
+                min = max = lo;
+            else
+            {
+                fail("bad repeat bounds");
+                return -1;
+            }
+            if (lo > kMaxRepeat || hi > kMaxRepeat || (max != kUnbounded && max < min))
+            {
+                fail("bad repeat bounds");
+                return -1;
+            }
+            _pos = end;
+        }
+        else
+            break;
+        ++_pos;
+        int repeat = newNode(NODE_REPEAT);
+        _nodes[repeat].children.push_back(atom);
+        _nodes[repeat].min = min;
+        _nodes[repeat].max = max;
+        atom = repeat;
+    }
+    return atom;
+}
+
+int Regex::parseAtom()
+{
+    char c = _expr[_pos];
+    if (c == '(')
+    {
+        ++_pos;
+        int inner = parseAlt();
+        if (inner < 0)
+            return -1;
+        if (_pos >= _expr.size() || _expr[_pos] != ')')
+        {
+            fail("missing )");
+            return -1;
+        }
+        ++_pos;
+        return inner;
+    }
+    if (c == '?' || c == '*' || c == '+' || c == '{')
+    {
+        fail("nothing to repeat");
+        return -1;
+    }
+    int node = newNode(NODE_BYTES);
+    uint64_t *set = _nodes[node].set;
+    bool ok = true;
+    if (c == '[')
+    {
+        ++_pos;
+        ok = parseClass(set);
+    }
+    else if (c == '.')
+    {
+        ++_pos;
+        memset(set, 0xff, 4 * sizeof(uint64_t));
+    }
+    else if (c == '\\')
+    {
+        ++_pos;
+        ok = parseEscape(set);
+    }
+    else
+    {
+        ++_pos;
+        insert(set, (unsigned char)c);
+    }
+    if (ok && c != '[')
+        foldCase(set);
+    return ok ? node : -1;
+}
+
+void Regex::foldCase(uint64_t *set) const
+{
+    if (!_fold_case)
+        return;
+    for (int c = 'a'; c <= 'z'; ++c)
+    {
+        if (contains(set, c) || contains(set, c - 'a' + 'A'))
+        {
+            insert(set, c);
+            insert(set, c - 'a' + 'A');
+        }
+    }
+}
+
+bool Regex::parseEscape(uint64_t *set)
+{
+    if (_pos >= _expr.size())
+        return fail("trailing backslash");
+    char c = _expr[_pos++];
+    switch (c)
+    {
+    case 'x':
+    {
+        unsigned value = 0;
+        if (_pos + 2 > _expr.size() || !isxdigit((unsigned char)_expr[_pos])
+            || !isxdigit((unsigned char)_expr[_pos + 1])
+            || sscanf(_expr.substr(_pos, 2).c_str(), "%x", &value) != 1)
+            return fail("bad \\x escape");
+        _pos += 2;
+        insert(set, value);
+        return true;
+    }
+    case 'n': insert(set, '\n'); return true;
+    case 'r': insert(set, '\r'); return true;
+    case 't': insert(set, '\t'); return true;
+    case '0': insert(set, '\0'); return true;
+    case 'd':
+        for (int b = '0'; b <= '9'; ++b)
+            insert(set, b);
+        return true;
+    case 'w':
+        for (int b = 0; b < 256; ++b)
+            if (isalnum(b) || b == '_')
+                insert(set, b);
+        return true;
+    case 's':
+        for (int b = 0; b < 256; ++b)
+            if (isspace(b))
+                insert(set, b);
+        return true;
+    default:
+        insert(set, (unsigned char)c);
+        return true;
+    }
+}
+
+bool Regex::parseClass(uint64_t *set)
+{
+    bool negate = _pos < _expr.size() && _expr[_pos] == '^';
+    if (negate)
+        ++_pos;
+    bool first = true;
+    while (_pos < _expr.size() && (_expr[_pos] != ']' || first))
+    {
+        first = false;
+        uint64_t item[4] = { 0, 0, 0, 0 };
+        int lo = (unsigned char)_expr[_pos];
+        if (_expr[_pos] == '\\')
+        {
+            ++_pos;
+            if (!parseEscape(item))
+                return false;
+        }
+        else
+        {
+            ++_pos;
+            insert(item, lo);
+        }
+        // A single byte followed by '-' and not ']' starts a range.
+        int count = 0;
+        for (int b = 0; b < 256; ++b)
+            if (contains(item, b))
+                lo = b, ++count;
+        if (count == 1 && _pos + 1 < _expr.size() && _expr[_pos] == '-' && _expr[_pos + 1] != ']')
+        {
+            ++_pos;
+            uint64_t end[4] = { 0, 0, 0, 0 };
+            if (_expr[_pos] == '\\')
+            {
+                ++_pos;
+                if (!parseEscape(end))
+                    return false;
+            }
+            else
+                insert(end, (unsigned char)_expr[_pos++]);
+            int hi = -1;
+            for (int b = 0; b < 256; ++b)
+                if (contains(end, b))
+                    hi = b;
+            if (hi < lo)
+                return fail("bad class range");
+            for (int b = lo; b <= hi; ++b)
+                insert(item, b);
+        }
+        for (int i = 0; i < 4; ++i)
+            set[i] |= item[i];
+    }
+    if (_pos >= _expr.size())
+        return fail("missing ]");
+    ++_pos;
+    // Folded first, so [^a] excludes both cases.
+    foldCase(set);
+    if (negate)
+        for (int i = 0; i < 4; ++i)
+            set[i] = ~set[i];
+    return true;
+}
+
+void Regex::lengths(int index, uint64_t *min, uint64_t *max) const
+{
+    // max saturates at kMaxLength + 1, which stands for unbounded.
+    const uint64_t kCap = kMaxLength + 1;
+    const Node &node = _nodes[index];
+    *min = *max = 0;
+    if (node.kind == NODE_BYTES)
+    {
+        *min = *max = 1;
+        return;
+    }
+    if (node.kind == NODE_REPEAT)
+    {
+        lengths(node.children[0], min, max);
+        *min = std::min(kCap, *min * node.min);
+        *max = node.max == kUnbounded ? (*max > 0 ? kCap : 0) : std::min(kCap, *max * node.max);
+        return;
+    }
+    for (size_t i = 0; i < node.children.size(); ++i)
+    {
+        uint64_t child_min = 0;
+        uint64_t child_max = 0;
+        lengths(node.children[i], &child_min, &child_max);
+        if (node.kind == NODE_CONCAT)
+        {
+            *min = std::min(kCap, *min + child_min);
+            *max = std::min(kCap, *max + child_max);
+        }
+        else
+        {
+            *min = i == 0 ? child_min : std::min(*min, child_min);
+            *max = std::max(*max, child_max);
+        }
+    }
+}
+
+void Regex::findRequired(int root)
+{
+    // Longest run of single bytes in the top-level sequence, and how far
+    // from the start of a match it can begin.
+    std::vector<int> items;
+    if (_nodes[root].kind == NODE_CONCAT)
+        items = _nodes[root].children;
+    else
+        items.push_back(root);
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    std::string run;
+    uint64_t run_lo = 0;
+    uint64_t run_hi = 0;
+    for (size_t i = 0; i <= items.size(); ++i)
+    {
+        int byte = -1;
+        int times = 0;
+        if (i < items.size())
+        {
+            const Node *node = &_nodes[items[i]];
+            times = 1;
+            if (node->kind == NODE_REPEAT && node->min == node->max)
+            {
+                times = node->min;
+                node = &_nodes[node->children[0]];
+            }
+            int count = 0;
+            for (int b = 0; node->kind == NODE_BYTES && b < 256; ++b)
+                if (contains(node->set, b))
+                    byte = b, ++count;
+            if (count != 1)
+                byte = -1;
+        }
+        if (byte >= 0)
+        {
+            if (run.empty())
+                run_lo = lo, run_hi = hi;
+            run.append(times, (char)byte);
+            lo += times;
+            hi += times;
+            continue;
+        }
+        if (run.size() > _required.size())
+        {
+            _required = run;
+            _required_min = run_lo;
+            _required_max = std::min(run_hi, (uint64_t)kMaxLength);
+        }
+        run.clear();
+        if (i < items.size())
+        {
+            uint64_t min = 0;
+            uint64_t max = 0;
+            lengths(items[i], &min, &max);
+            lo += min;
+            hi += max;
+        }
+    }
+    if (_required.size() < 2)
+        _required.clear();
+}
+
+int Regex::newState()
+{
+    NfaState state;
+    memset(state.set, 0, sizeof(state.set));
+    state.next = -1;
+    _nfa.push_back(state);
+    return _nfa.size() - 1;
+}
+
+bool Regex::build(int index, int *start, int *end)
+{
+    if (_nfa.size() > kMaxNfaStates)
+        return fail("expression too large");
+    // Copy what is needed: _nodes does not change, _nfa grows.
+    NodeKind kind = _nodes[index].kind;
+    *start = newState();
+    *end = newState();
+    if (kind == NODE_BYTES)
+    {
+        memcpy(_nfa[*start].set, _nodes[index].set, sizeof(_nfa[*start].set));
+        _nfa[*start].next = *end;
+        return true;
+    }
+    if (kind == NODE_CONCAT || kind == NODE_ALT)
+    {
+        int last = *start;
+        std::vector<int> children = _nodes[index].children;
+        for (size_t i = 0; i < children.size(); ++i)
+        {
+            int child_start = 0;
+            int child_end = 0;
+            if (!build(children[i], &child_start, &child_end))
+                return false;
+            if (kind == NODE_ALT)
+            {
+                _nfa[*start].eps.push_back(child_start);
+                _nfa[child_end].eps.push_back(*end);
+            }
+            else
+            {
+                _nfa[last].eps.push_back(child_start);
+                last = child_end;
+            }
+        }
+        if (kind == NODE_CONCAT)
+            _nfa[last].eps.push_back(*end);
+        return true;
+    }
+    // Repeats: min copies, then either a loop or max - min optional ones.
+    int child = _nodes[index].children[0];
+    int min = _nodes[index].min;
+    int max = _nodes[index].max;
+    int last = *start;
+    for (int i = 0; i < min; ++i)
+    {
+        int child_start = 0;
+        int child_end = 0;
+        if (!build(child, &child_start, &child_end))
+            return false;
+        _nfa[last].eps.push_back(child_start);
+        last = child_end;
+    }
+    if (max == kUnbounded)
+    {
+        int child_start = 0;
+        int child_end = 0;
+        if (!build(child, &child_start, &child_end))
+            return false;
+        _nfa[last].eps.push_back(child_start);
+        _nfa[last].eps.push_back(*end);
+        _nfa[child_end].eps.push_back(child_start);
+        _nfa[child_end].eps.push_back(*end);
+        return true;
+    }
+    for (int i = min; i < max; ++i)
+    {
+        int child_start = 0;
+        int child_end = 0;
+        if (!build(child, &child_start, &child_end))
+            return false;
+        _nfa[last].eps.push_back(child_start);
+        _nfa[last].eps.push_back(*end);
+        last = child_end;
+    }
+    _nfa[last].eps.push_back(*end);
+    return true;
+}
+
+void Regex::closure(std::vector<int> *states) const
+{
+    std::vector<char> seen(_nfa.size(), 0);
+    std::vector<int> stack(*states);
+    states->clear();
+    while (!stack.empty())
+    {
+        int s = stack.back();
+        stack.pop_back();
+        if (seen[s])
+            continue;
+        seen[s] = 1;
+        states->push_back(s);
+        for (size_t i = 0; i < _nfa[s].eps.size(); ++i)
+            stack.push_back(_nfa[s].eps[i]);
+    }
+    std::sort(states->begin(), states->end());
+}
+
+bool Regex::buildDfa(int start, int accept)
+{
+    // Bytes no byte edge tells apart share a class.
+    std::vector<std::vector<char> > signatures;
+    for (int b = 0; b < 256; ++b)
+    {
+        std::vector<char> signature;
+        for (size_t s = 0; s < _nfa.size(); ++s)
+            if (_nfa[s].next >= 0)
+                signature.push_back(contains(_nfa[s].set, b));
+        size_t c = std::find(signatures.begin(), signatures.end(), signature) - signatures.begin();
+        if (c == signatures.size())
+            signatures.push_back(signature);
+        _class[b] = c;
+    }
+    _stride = signatures.size();
+    std::vector<int> representative(_stride, 0);
+    for (int b = 255; b >= 0; --b)
+        representative[_class[b]] = b;
+
+    std::vector<std::vector<int> > states;
+    std::map<std::vector<int>, int> ids;
+    std::vector<int> initial(1, start);
+    closure(&initial);
+    states.push_back(initial);
+    ids[initial] = 0;
+    for (size_t d = 0; d < states.size(); ++d)
+    {
+        _accept.push_back(std::binary_search(states[d].begin(), states[d].end(), accept));
+        for (uint32_t c = 0; c < _stride; ++c)
+        {
+            std::vector<int> next;
+            for (size_t i = 0; i < states[d].size(); ++i)
+            {
+                const NfaState &state = _nfa[states[d][i]];
+                if (state.next >= 0 && contains(state.set, representative[c]))
+                    next.push_back(state.next);
+            }
+            int id = -1;
+            if (!next.empty())
+            {
+                closure(&next);
+                std::map<std::vector<int>, int>::iterator it = ids.find(next);
+                if (it != ids.end())
+                    id = it->second;
+                else if (states.size() >= kMaxDfaStates)
+                    return fail("expression too complex");
+                else
+                {
+                    id = states.size();
+                    ids[next] = id;
+                    states.push_back(next);
+                }
+            }
+            _delta.push_back(id);
+        }
+    }
+    return true;
+}
+
+bool Regex::compile(const std::string &expr, std::string *error, bool fold_case)
+{
+    _expr = expr;
+    _pos = 0;
+    _error = error;
+    _fold_case = fold_case;
+    _error->clear();
+    _nodes.clear();
+    _nfa.clear();
+    _delta.clear();
+    _accept.clear();
+    _required.clear();
+
+    bool ok = !expr.empty();
+    int root = ok ? parseAlt() : -1;
+    if (!ok)
+        fail("empty expression");
+    else if (root >= 0 && _pos < _expr.size())
+        fail("unmatched )");
+    ok = root >= 0 && _error->empty();
+    uint64_t min = 0;
+    uint64_t max = 0;
+    if (ok)
+    {
+        lengths(root, &min, &max);
+        if (min == 0)
+        {
+            *_error = "expression matches empty input";
+            ok = false;
+        }
+    }
+    int start = 0;
+    int end = 0;
+    if (ok)
+        ok = build(root, &start, &end) && buildDfa(start, end);
+    if (ok)
+    {
+        _max_length = std::min(max, (uint64_t)kMaxLength);
+        findRequired(root);
+        for (int b = 0; b < 256; ++b)
+            _first[b] = _delta[_class[b]] >= 0;
+    }
+    _nodes.clear();
+    _nfa.clear();
+    _error = NULL;
+    return ok;
+}
+
+void Regex::save(std::string *out) const
+{
+    out->append((const char *)_class, sizeof(_class));
+    putU64(out, _stride);
+    putVector(out, _delta);
+    putVector(out, _accept);
+    for (int b = 0; b < 256; ++b)
+        out->push_back(_first[b]);
+    putString(out, _required);
+    putU64(out, _required_min);
+    putU64(out, _required_max);
+    putU64(out, _max_length);
+}
+
+bool Regex::load(const std::string &in, size_t *pos)
+{
+    uint64_t stride = 0;
+    uint64_t required_min = 0;
+    uint64_t required_max = 0;
+    uint64_t max_length = 0;
+    if (in.size() - *pos < sizeof(_class))
+        return false;
+    memcpy(_class, in.data() + *pos, sizeof(_class));
+    *pos += sizeof(_class);
+    if (!getU64(in, pos, &stride) || stride == 0 || stride > 256
+        || !getVector(in, pos, &_delta) || !getVector(in, pos, &_accept)
+        || _accept.empty() || _delta.size() != _accept.size() * stride
+        || in.size() - *pos < 256)
+        return false;
+    for (int b = 0; b < 256; ++b)
+        _first[b] = in[(*pos)++] != 0;
+    if (!getString(in, pos, &_required) || !getU64(in, pos, &required_min)
+        || !getU64(in, pos, &required_max) || !getU64(in, pos, &max_length)
+        || required_min > required_max || max_length == 0 || max_length > kMaxLength)
+        return false;
+    _stride = stride;
+    _required_min = required_min;
+    _required_max = required_max;
+    _max_length = max_length;
+    bool ok = true;
+    for (int c = 0; c < 256; ++c)
+        ok = ok && _class[c] < _stride;
+    for (size_t i = 0; i < _delta.size(); ++i)
+        ok = ok && _delta[i] >= -1 && _delta[i] < (int32_t)_accept.size();
+    return ok;
+}
+
+bool Regex::canMatch(unsigned char byte) const
+{
+    for (size_t state = 0; state < _accept.size(); ++state)
+    {
+        if (_delta[state * _stride + _class[byte]] >= 0)
+            return true;
+    }
+    return false;
+}
+
+size_t Regex::matchAt(const char *str, size_t len) const
+{
+    len = std::min(len, _max_length);
+    int32_t state = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        state = _delta[state * _stride + _class[(unsigned char)str[i]]];
+        if (state < 0)
+            return 0;
+        if (_accept[state])
+            return i + 1;
+    }
+    return 0;
+}
+
+bool Regex::nextCandidate(const char *str, size_t len, size_t *pos) const
+{
+    if (!_required.empty())
+    {
+        // A match starting at s has the literal at s + [min, max], so
+        // the first occurrence at or past *pos + min bounds the start.
+        size_t search = *pos + _required_min;
+        if (search >= len)
+            return false;
+        const char *found = LiteralScanner::find(str + search, len - search,
+                                                 _required.data(), _required.size());
+        if (found == NULL)
+            return false;
+        size_t at = found - str;
+        *pos = std::max(*pos, at > _required_max ? at - _required_max : 0);
+        return true;
+    }
+    for (size_t i = *pos; i < len; ++i)
+    {
+        if (_first[(unsigned char)str[i]])
+        {
+            *pos = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Location of a hit inside the buffer passed to Target::match.
+struct Match
+{
+    size_t offset;   // first byte of the matched pattern
+    int pattern;     // index in the order patterns were added
+    size_t length;   // bytes matched
+};
+
+// A few literals searched in one pass, each vector block compared for
+// the first and last byte of every one of them. The kernel is a template
+// on the number of literals, on whether all fit in a word and on the
+// vector width, chosen once in build(), so the common handful of fixed
+// markers runs an unrolled loop without a per-literal pass or call.
+class LiteralSet
+{
+public:
+    // Sets of more literals are left to the callers' other matchers.
+    static const size_t kMaxLiterals = 4;
+
+    LiteralSet()
+            : _count(0), _min_length(0), _max_length(0), _short(false), _fold(false),
+              _first(NULL), _all(NULL)
+    { }
+    // Takes 2 to kMaxLiterals literals; otherwise the set stays empty.
+    void build(const std::vector<std::string> &literals, bool fold_case);
+    size_t size() const { return _count; }
+    // The hit ending earliest in str[0, len), the longest on a tie, as
+    // with AhoCorasick; m->pattern is the index of the literal.
+    bool first(const char *str, size_t len, Match *m) const { return _first(*this, str, len, m); }
+    // Appends every hit in str[0, len).
+    void all(const char *str, size_t len, std::vector<Match> *matches) const
+    {
+        _all(*this, str, len, matches);
+    }
+
+private:
+    // Literals up to this long are verified with one word compare.
+    static const size_t kShortLength = 8;
+
+    struct Needle
+    {
+        std::string text;
+        // The first and last byte, with 0x20 set when folding: blocks
+        // get it set on every byte, and verify weeds out the non-letters
+        // that turn into a letter.
+        char first;
+        char last;
+        uint64_t word;     // the text, folded and zero padded
+        uint64_t word_mask;
+        uint64_t word_fold;
+    };
+    // Progress of one search: the best hit so far, or where all go.
+    struct Scan
+    {
+        size_t best_end;
+        int best;
+        std::vector<Match> *matches;
+    };
+    typedef bool (*FirstFunc)(const LiteralSet &, const char *, size_t, Match *);
+    typedef void (*AllFunc)(const LiteralSet &, const char *, size_t, std::vector<Match> *);
+
+    template <int Count>
+    void pick();
+    template <int Count, bool Short>
+    void pickFold();
+    template <int Count, bool Short, bool Fold>
+    void pickWidth(bool wide);
+    template <int Count, bool Short, bool Fold, bool Wide>
+    static bool findFirst(const LiteralSet &set, const char *str, size_t len, Match *m);
+    template <int Count, bool Short, bool Fold, bool Wide>
+    static void findAll(const LiteralSet &set, const char *str, size_t len,
+                        std::vector<Match> *matches);
+    template <int Count, bool Short, bool Fold, bool All, bool Wide>
+    static void search(const LiteralSet &set, const char *str, size_t len, Scan *scan);
+    // The vector part of search: returns where the scalar tail starts.
+#if defined(__x86_64__) || defined(__i386__)
+    template <int Count, bool Short, bool Fold, bool All>
+    static size_t blocksSse2(const LiteralSet &set, const char *str, size_t len, Scan *scan);
+    template <int Count, bool Short, bool Fold, bool All>
+    static size_t blocksAvx2(const LiteralSet &set, const char *str, size_t len, Scan *scan);
+#elif defined(__aarch64__)
+    template <int Count, bool Short, bool Fold, bool All>
+    static size_t blocksNeon(const LiteralSet &set, const char *str, size_t len, Scan *scan);
+#endif
+    // Verifies the candidate bits of mask for literal k, bit b standing
+    // for position base + (b >> shift).
+    template <bool Short, bool Fold, bool All>
+    inline void candidates(uint64_t mask, int shift, int k, const char *str, size_t base,
+                           Scan *scan) const;
+    template <bool All>
+    inline void record(size_t start, int k, Scan *scan) const;
+    template <bool Short, bool Fold>
+    static inline bool verify(const Needle &needle, const char *candidate);
+    // Bytes past a block start the vector loops read.
+    size_t reach(bool is_short) const { return std::max(_max_length, is_short ? kShortLength : 0); }
+
+    Needle _needles[kMaxLiterals];
+    size_t _count;
+    size_t _min_length;
+    size_t _max_length;
+    bool _short;
+    bool _fold;
+    FirstFunc _first;
+    AllFunc _all;
+};
+
+void LiteralSet::build(const std::vector<std::string> &literals, bool fold_case)
+{
+    *this = LiteralSet();
+    if (literals.size() < 2 || literals.size() > kMaxLiterals)
+        return;
+    _count = literals.size();
+    _fold = fold_case;
+    _min_length = literals[0].size();
+    _short = true;
+    for (size_t k = 0; k < _count; ++k)
+    {
+        Needle &needle = _needles[k];
+        const std::string &text = literals[k];
+        needle.text = text;
+        needle.first = fold_case ? text[0] | 0x20 : text[0];
+        needle.last = fold_case ? text[text.size() - 1] | 0x20 : text[text.size() - 1];
+        unsigned char word[8] = { 0 };
+        unsigned char word_mask[8] = { 0 };
+        unsigned char word_fold[8] = { 0 };
+        for (size_t j = 0; j < text.size() && j < 8; ++j)
+        {
+            word[j] = foldedByte(text[j], fold_case);
+            word_mask[j] = 0xff;
+            word_fold[j] = foldMask(text[j], fold_case);
+        }
+        memcpy(&needle.word, word, 8);
+        memcpy(&needle.word_mask, word_mask, 8);
+        memcpy(&needle.word_fold, word_fold, 8);
+        _min_length = std::min(_min_length, text.size());
+        _max_length = std::max(_max_length, text.size());
+        _short = _short && text.size() <= kShortLength;
+    }
+    switch (_count)
+    {
+    case 2: pick<2>(); break;
+    case 3: pick<3>(); break;
+    default: pick<4>(); break;
+    }
+}
+
+template <int Count>
+void LiteralSet::pick()
+{
+    if (_short)
+        pickFold<Count, true>();
+    else
+        pickFold<Count, false>();
+}
+
+template <int Count, bool Short>
+void LiteralSet::pickFold()
+{
+    bool wide = false;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    wide = __builtin_cpu_supports("avx2");
+#endif
+    if (_fold)
+        pickWidth<Count, Short, true>(wide);
+    else
+        pickWidth<Count, Short, false>(wide);
+}
+
+template <int Count, bool Short, bool Fold>
+void LiteralSet::pickWidth(bool wide)
+{
+    _first = wide ? findFirst<Count, Short, Fold, true> : findFirst<Count, Short, Fold, false>;
+    _all = wide ? findAll<Count, Short, Fold, true> : findAll<Count, Short, Fold, false>;
+}
+
+template <int Count, bool Short, bool Fold, bool Wide>
+bool LiteralSet::findFirst(const LiteralSet &set, const char *str, size_t len, Match *m)
+{
+    Scan scan = { (size_t)-1, -1, NULL };
+    search<Count, Short, Fold, false, Wide>(set, str, len, &scan);
+    if (scan.best < 0)
+        return false;
+    m->length = set._needles[scan.best].text.size();
+    m->offset = scan.best_end - m->length;
+    m->pattern = scan.best;
+    return true;
+}
+
+template <int Count, bool Short, bool Fold, bool Wide>
+void LiteralSet::findAll(const LiteralSet &set, const char *str, size_t len,
+                         std::vector<Match> *matches)
+{
+    Scan scan = { (size_t)-1, -1, matches };
+    search<Count, Short, Fold, true, Wide>(set, str, len, &scan);
+}
+
+// With Short the candidate must have 8 readable bytes.
+template <bool Short, bool Fold>
+inline bool LiteralSet::verify(const Needle &needle, const char *candidate)
+{
+    if (Short)
+    {
+        uint64_t word;
+        memcpy(&word, candidate, 8);
+        if (Fold)
+            word |= needle.word_fold;
+        return ((word ^ needle.word) & needle.word_mask) == 0;
+    }
+    return Fold ? equalFolded(candidate, needle.text.data(), needle.text.size())
+                : memcmp(candidate, needle.text.data(), needle.text.size()) == 0;
+}
+
+template <bool All>
+inline void LiteralSet::record(size_t start, int k, Scan *scan) const
+{
+    size_t length = _needles[k].text.size();
+    if (All)
+    {
+        Match found;
+        found.offset = start;
+        found.pattern = k;
+        found.length = length;
+        scan->matches->push_back(found);
+    }
+    else if (start + length < scan->best_end
+             || (start + length == scan->best_end && length > _needles[scan->best].text.size()))
+    {
+        scan->best_end = start + length;
+        scan->best = k;
+    }
+}
+
+template <bool Short, bool Fold, bool All>
+inline void LiteralSet::candidates(uint64_t mask, int shift, int k, const char *str,
+                                   size_t base, Scan *scan) const
+{
+    for (; mask != 0; mask &= mask - 1)
+    {
+        size_t start = base + (__builtin_ctzll(mask) >> shift);
+        if (verify<Short, Fold>(_needles[k], str + start))
+            record<All>(start, k, scan);
+    }
+}
+
+template <int Count, bool Short, bool Fold, bool All, bool Wide>
+void LiteralSet::search(const LiteralSet &set, const char *str, size_t len, Scan *scan)
+{
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    i = Wide ? blocksAvx2<Count, Short, Fold, All>(set, str, len, scan)
+             : blocksSse2<Count, Short, Fold, All>(set, str, len, scan);
+#elif defined(__aarch64__)
+    i = blocksNeon<Count, Short, Fold, All>(set, str, len, scan);
+#endif
+    for (; i < len; ++i)
+    {
+        // Hits starting here or later end past the best one.
+        if (!All && i + set._min_length > scan->best_end)
+            break;
+        for (int k = 0; k < Count; ++k)
+        {
+            const Needle &needle = set._needles[k];
+            if (len - i >= needle.text.size() && verify<false, Fold>(needle, str + i))
+                set.record<All>(i, k, scan);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <int Count, bool Short, bool Fold, bool All>
+size_t LiteralSet::blocksSse2(const LiteralSet &set, const char *str, size_t len, Scan *scan)
+{
+    __m128i first[Count];
+    __m128i last[Count];
+    size_t last_at[Count];
+    for (int k = 0; k < Count; ++k)
+    {
+        first[k] = _mm_set1_epi8(set._needles[k].first);
+        last[k] = _mm_set1_epi8(set._needles[k].last);
+        last_at[k] = set._needles[k].text.size() - 1;
+    }
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const size_t reach = set.reach(Short) + 15;
+    size_t i = 0;
+    for (; i + reach <= len; i += 16)
+    {
+        if (!All && i + set._min_length > scan->best_end)
+            break;
+        __m128i block = _mm_loadu_si128((const __m128i *)(str + i));
+        if (Fold)
+            block = _mm_or_si128(block, fold);
+        __m128i eq[Count];
+        __m128i any = _mm_setzero_si128();
+        for (int k = 0; k < Count; ++k)
+        {
+            __m128i block_last = _mm_loadu_si128((const __m128i *)(str + i + last_at[k]));
+            if (Fold)
+                block_last = _mm_or_si128(block_last, fold);
+            eq[k] = _mm_and_si128(_mm_cmpeq_epi8(first[k], block),
+                                  _mm_cmpeq_epi8(last[k], block_last));
+            any = _mm_or_si128(any, eq[k]);
+        }
+        // Candidates are rare; one test covers the whole set.
+        if (_mm_movemask_epi8(any) == 0)
+            continue;
+        for (int k = 0; k < Count; ++k)
+            set.candidates<Short, Fold, All>((uint32_t)_mm_movemask_epi8(eq[k]), 0, k, str, i,
+                                             scan);
+    }
+    return i;
+}
+
+template <int Count, bool Short, bool Fold, bool All>
+__attribute__((target("avx2")))
+size_t LiteralSet::blocksAvx2(const LiteralSet &set, const char *str, size_t len, Scan *scan)
+{
+    __m256i first[Count];
+    __m256i last[Count];
+    size_t last_at[Count];
+    for (int k = 0; k < Count; ++k)
+    {
+        first[k] = _mm256_set1_epi8(set._needles[k].first);
+        last[k] = _mm256_set1_epi8(set._needles[k].last);
+        last_at[k] = set._needles[k].text.size() - 1;
+    }
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    const size_t reach = set.reach(Short) + 31;
+    size_t i = 0;
+    for (; i + reach <= len; i += 32)
+    {
+        if (!All && i + set._min_length > scan->best_end)
+            break;
+        __m256i block = _mm256_loadu_si256((const __m256i *)(str + i));
+        if (Fold)
+            block = _mm256_or_si256(block, fold);
+        __m256i eq[Count];
+        __m256i any = _mm256_setzero_si256();
+        for (int k = 0; k < Count; ++k)
+        {
+            __m256i block_last = _mm256_loadu_si256((const __m256i *)(str + i + last_at[k]));
+            if (Fold)
+                block_last = _mm256_or_si256(block_last, fold);
+            eq[k] = _mm256_and_si256(_mm256_cmpeq_epi8(first[k], block),
+                                     _mm256_cmpeq_epi8(last[k], block_last));
+            any = _mm256_or_si256(any, eq[k]);
+        }
+        // Candidates are rare; one test covers the whole set.
+        if (_mm256_movemask_epi8(any) == 0)
+            continue;
+        for (int k = 0; k < Count; ++k)
+            set.candidates<Short, Fold, All>((uint32_t)_mm256_movemask_epi8(eq[k]), 0, k, str,
+                                             i, scan);
+    }
+    return i;
+}
+#elif defined(__aarch64__)
+template <int Count, bool Short, bool Fold, bool All>
+size_t LiteralSet::blocksNeon(const LiteralSet &set, const char *str, size_t len, Scan *scan)
+{
+    uint8x16_t first[Count];
+    uint8x16_t last[Count];
+    size_t last_at[Count];
+    for (int k = 0; k < Count; ++k)
+    {
+        first[k] = vdupq_n_u8(set._needles[k].first);
+        last[k] = vdupq_n_u8(set._needles[k].last);
+        last_at[k] = set._needles[k].text.size() - 1;
+    }
+    const uint8x16_t fold = vdupq_n_u8(0x20);
+    const size_t reach = set.reach(Short) + 15;
+    size_t i = 0;
+    for (; i + reach <= len; i += 16)
+    {
+        if (!All && i + set._min_length > scan->best_end)
+            break;
+        uint8x16_t block = vld1q_u8((const uint8_t *)str + i);
+        if (Fold)
+            block = vorrq_u8(block, fold);
+        uint8x16_t eq[Count];
+        uint8x16_t any = vdupq_n_u8(0);
+        for (int k = 0; k < Count; ++k)
+        {
+            uint8x16_t block_last = vld1q_u8((const uint8_t *)str + i + last_at[k]);
+            if (Fold)
+                block_last = vorrq_u8(block_last, fold);
+            eq[k] = vandq_u8(vceqq_u8(first[k], block), vceqq_u8(last[k], block_last));
+            any = vorrq_u8(any, eq[k]);
+        }
+        // Candidates are rare; one test covers the whole set.
+        if (vmaxvq_u8(any) == 0)
+            continue;
+        for (int k = 0; k < Count; ++k)
+        {
+            // Narrow to 4 bits per byte; keep one bit per position.
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                    vshrn_n_u16(vreinterpretq_u16_u8(eq[k]), 4)), 0) & 0x1111111111111111ULL;
+            set.candidates<Short, Fold, All>(mask, 2, k, str, i, scan);
+        }
+    }
+    return i;
+}
+#endif
+
+// Literal search for signature sets too large for an automaton that
+// stays in cache: two hashed q-gram bitmaps, one for the first q bytes of
+// every literal and one for the q bytes ending at the shortest literal's
+// length, reject nearly every position; the rest are verified against
+// the literals sharing the first hash. When the bitmaps have room, only
+// every stride-th position is looked up in a third one holding each
+// literal's first stride grams, and the starts it may belong to are
+// checked on a hit. Memory is the literals, one entry per literal and
+// bitmaps capped at L2 size, whatever the count.
+class GramFilter
+{
+public:
+    // Shorter literals would pass nearly every position through.
+    static const size_t kMinLength = 2;
+
+    GramFilter();
+    // False, leaving the filter empty, if a literal is shorter than
+    // kMinLength. Literals equal to an earlier one are not reported, as
+    // with AhoCorasick.
+    bool build(const std::vector<std::string> &literals, bool fold_case);
+    size_t size() const { return _offset.empty() ? 0 : _offset.size() - 1; }
+    // The hit ending earliest in str[0, len), the longest on a tie;
+    // m->pattern is the index of the literal.
+    bool first(const char *str, size_t len, Match *m) const;
+    // Appends every hit in str[0, len).
+    void all(const char *str, size_t len, std::vector<Match> *matches) const;
+
+private:
+    // Bitmap sizes, in bits, range from 2^kMinBits to 2^kMaxBits.
+    static const int kMinBits = 16;
+    static const int kMaxBits = 20;
+    static const uint32_t kHeadFactor = 0x9e3779b1;
+    static const uint32_t kTailFactor = 0x85ebca6b;
+
+    struct Entry
+    {
+        uint32_t gram;     // the literal's first gram
+        uint32_t literal;
+    };
+    struct Scan
+    {
+        size_t best_end;
+        int best;
+        std::vector<Match> *matches;
+    };
+
+    uint32_t gramAt(const char *p, size_t avail) const;
+    uint32_t bit(uint32_t gram, uint32_t factor) const { return gram * factor >> (32 - _bits); }
+    bool test(const std::vector<uint64_t> &bitmap, uint32_t bit) const
+    {
+        return bitmap[bit >> 6] >> (bit & 63) & 1;
+    }
+    template <bool All>
+    void search(const char *str, size_t len, Scan *scan) const;
+    // Tests the start str + i against the head and tail bitmaps, then
+    // verifies it.
+    template <bool All>
+    void check(const char *str, size_t len, size_t i, Scan *scan) const;
+    // Checks the literals whose first gram is gram against str + i.
+    template <bool All>
+    void verify(const char *str, size_t len, size_t i, uint32_t gram, Scan *scan) const;
+
+    size_t _gram_length;   // q, up to 4
+    uint32_t _gram_mask;
+    uint32_t _gram_fold;   // 0x20 on each gram byte when folding
+    size_t _tail_at;       // of the second gram, 0 when there is none
+    size_t _min_length;
+    size_t _stride;        // between sampled positions, 1 for every one
+    bool _fold;
+    int _bits;
+    int _bucket_bits;
+    std::vector<uint64_t> _head;
+    std::vector<uint64_t> _tail;
+    std::vector<uint64_t> _sample;
+    std::vector<uint32_t> _bucket_start;  // into _entries, by first hash
+    std::vector<Entry> _entries;
+    std::string _text;                    // the literals back to back
+    std::vector<uint32_t> _offset;        // of each literal in _text
+};
+
+GramFilter::GramFilter()
+        : _gram_length(0), _gram_mask(0), _gram_fold(0), _tail_at(0), _min_length(0),
+          _stride(1), _fold(false), _bits(kMinBits), _bucket_bits(0)
+{ }
+
+// Orders literals by their folded text, then by index.
+struct FoldedLess
+{
+    explicit FoldedLess(const std::vector<std::string> &folded) : _folded(folded)
+    { }
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+        return _folded[a] != _folded[b] ? _folded[a] < _folded[b] : a < b;
+    }
+    const std::vector<std::string> &_folded;
+};
+
+bool GramFilter::build(const std::vector<std::string> &literals, bool fold_case)
+{
+    *this = GramFilter();
+    if (literals.empty())
+        return false;
+    _min_length = literals[0].size();
+    for (size_t i = 0; i < literals.size(); ++i)
+        _min_length = std::min(_min_length, literals[i].size());
+    if (_min_length < kMinLength)
+        return false;
+    _fold = fold_case;
+    _gram_length = std::min(_min_length, (size_t)4);
+    // The gram's bytes in memory order, for either byte order.
+    unsigned char mask[4] = { 0 };
+    memset(mask, 0xff, _gram_length);
+    memcpy(&_gram_mask, mask, 4);
+    _gram_fold = fold_case ? 0x20202020 & _gram_mask : 0;
+    _tail_at = _min_length - _gram_length;
+    // Every start is covered by one sample as long as the stride grams
+    // fit in the shortest literal; about 16 bits per gram keep the
+    // false positives low.
+    _stride = std::min(_min_length - _gram_length + 1,
+                       ((size_t)1 << kMaxBits) / (16 * literals.size()));
+    _stride = std::max(_stride, (size_t)1);
+    while (_bits < kMaxBits && ((size_t)1 << _bits) < 16 * _stride * literals.size())
+        ++_bits;
+    _bucket_bits = 8;
+    while (_bucket_bits < _bits && ((size_t)1 << _bucket_bits) < literals.size())
+        ++_bucket_bits;
+
+    // Duplicates, folded ones included, keep the first of them.
+    std::vector<std::string> folded(literals);
+    for (size_t i = 0; fold_case && i < folded.size(); ++i)
+        for (size_t j = 0; j < folded[i].size(); ++j)
+            if (isAsciiLetter(folded[i][j]))
+                folded[i][j] |= 0x20;
+    std::vector<uint32_t> order(literals.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), FoldedLess(folded));
+    std::vector<char> keep(literals.size(), 1);
+    for (size_t i = 1; i < order.size(); ++i)
+        if (folded[order[i]] == folded[order[i - 1]])
+            keep[order[i]] = 0;
+
+    _head.assign(((size_t)1 << _bits) / 64, 0);
+    _tail.assign(_tail_at > 0 ? _head.size() : 0, 0);
+    _sample.assign(_stride > 1 ? _head.size() : 0, 0);
+    std::vector<uint32_t> counts((size_t)1 << _bucket_bits, 0);
+    std::vector<Entry> entries;
+    for (size_t i = 0; i < literals.size(); ++i)
+    {
+        _offset.push_back(_text.size());
+        _text += literals[i];
+        if (!keep[i])
+            continue;
+        Entry entry;
+        entry.gram = gramAt(literals[i].data(), literals[i].size());
+        entry.literal = i;
+        uint32_t head_bit = bit(entry.gram, kHeadFactor);
+        _head[head_bit >> 6] |= 1ULL << (head_bit & 63);
+        if (_tail_at > 0)
+        {
+            uint32_t tail_bit = bit(gramAt(literals[i].data() + _tail_at, _gram_length),
+                                    kTailFactor);
+            _tail[tail_bit >> 6] |= 1ULL << (tail_bit & 63);
+        }
+        for (size_t j = 0; _stride > 1 && j < _stride; ++j)
+        {
+            uint32_t sample_bit = bit(gramAt(literals[i].data() + j, literals[i].size() - j),
+                                      kHeadFactor);
+            _sample[sample_bit >> 6] |= 1ULL << (sample_bit & 63);
+        }
+        ++counts[head_bit >> (_bits - _bucket_bits)];
+        entries.push_back(entry);
+    }
+    _offset.push_back(_text.size());
+    _bucket_start.assign(counts.size() + 1, 0);
+    for (size_t b = 0; b < counts.size(); ++b)
+        _bucket_start[b + 1] = _bucket_start[b] + counts[b];
+    _entries.resize(entries.size());
+    std::vector<uint32_t> next(_bucket_start.begin(), _bucket_start.end() - 1);
+    for (size_t i = 0; i < entries.size(); ++i)
+        _entries[next[bit(entries[i].gram, kHeadFactor) >> (_bits - _bucket_bits)]++] = entries[i];
+    return true;
+}
+
+// The gram at p, which has avail >= _gram_length readable bytes.
+inline uint32_t GramFilter::gramAt(const char *p, size_t avail) const
+{
+    uint32_t gram = 0;
+    if (avail >= 4)
+        memcpy(&gram, p, 4);
+    else
+        memcpy(&gram, p, _gram_length);
+    return (gram & _gram_mask) | _gram_fold;
+}
+
+bool GramFilter::first(const char *str, size_t len, Match *m) const
+{
+    Scan scan = { (size_t)-1, -1, NULL };
+    search<false>(str, len, &scan);
+    if (scan.best < 0)
+        return false;
+    m->length = _offset[scan.best + 1] - _offset[scan.best];
+    m->offset = scan.best_end - m->length;
+    m->pattern = scan.best;
+    return true;
+}
+
+void GramFilter::all(const char *str, size_t len, std::vector<Match> *matches) const
+{
+    Scan scan = { (size_t)-1, -1, matches };
+    search<true>(str, len, &scan);
+}
+
+template <bool All>
+void GramFilter::search(const char *str, size_t len, Scan *scan) const
+{
+    if (_offset.empty() || len < _min_length)
+        return;
+    const uint64_t *head = &_head[0];
+    const uint64_t *tail = _tail.empty() ? NULL : &_tail[0];
+    const int shift = 32 - _bits;
+    // Candidates are at starts up to end; up to fast_end both grams load
+    // as whole words.
+    size_t end = len - _min_length + 1;
+    if (_stride > 1)
+    {
+        // Sample p stands for the starts p - stride + 1 to p.
+        const uint64_t *sample = &_sample[0];
+        for (size_t p = _stride - 1; p + _gram_length <= len && p + 1 < end + _stride;
+             p += _stride)
+        {
+            uint32_t sample_bit = gramAt(str + p, len - p) * kHeadFactor >> shift;
+            if (!(sample[sample_bit >> 6] >> (sample_bit & 63) & 1))
+                continue;
+            for (size_t i = p + 1 - _stride; i <= p && i < end; ++i)
+                check<All>(str, len, i, scan);
+            if (!All && scan->best >= 0)
+                end = std::min(end, scan->best_end - _min_length + 1);
+        }
+        return;
+    }
+    size_t fast_end = len >= _tail_at + 4 ? std::min(end, len - _tail_at - 3) : 0;
+    for (size_t i = 0; i < end; ++i)
+    {
+        uint32_t gram;
+        if (i < fast_end)
+        {
+            memcpy(&gram, str + i, 4);
+            gram = (gram & _gram_mask) | _gram_fold;
+            uint32_t head_bit = gram * kHeadFactor >> shift;
+            if (!(head[head_bit >> 6] >> (head_bit & 63) & 1))
+                continue;
+            if (tail != NULL)
+            {
+                uint32_t next;
+                memcpy(&next, str + i + _tail_at, 4);
+                uint32_t tail_bit = ((next & _gram_mask) | _gram_fold) * kTailFactor >> shift;
+                if (!(tail[tail_bit >> 6] >> (tail_bit & 63) & 1))
+                    continue;
+            }
+        }
+        else
+        {
+            gram = gramAt(str + i, len - i);
+            if (!test(_head, bit(gram, kHeadFactor))
+                || (tail != NULL
+                    && !test(_tail, bit(gramAt(str + i + _tail_at, len - i - _tail_at),
+                                        kTailFactor))))
+                continue;
+        }
+        verify<All>(str, len, i, gram, scan);
+        // Hits starting past this end past the best one.
+        if (!All && scan->best >= 0)
+        {
+            end = std::min(end, scan->best_end - _min_length + 1);
+            fast_end = std::min(fast_end, end);
+        }
+    }
+}
+
+template <bool All>
+void GramFilter::check(const char *str, size_t len, size_t i, Scan *scan) const
+{
+    uint32_t gram = gramAt(str + i, len - i);
+    if (test(_head, bit(gram, kHeadFactor))
+        && (_tail_at == 0
+            || test(_tail, bit(gramAt(str + i + _tail_at, len - i - _tail_at), kTailFactor))))
+        verify<All>(str, len, i, gram, scan);
+}
+
+template <bool All>
+void GramFilter::verify(const char *str, size_t len, size_t i, uint32_t gram, Scan *scan) const
+{
+    uint32_t bucket = bit(gram, kHeadFactor) >> (_bits - _bucket_bits);
+    for (uint32_t e = _bucket_start[bucket]; e < _bucket_start[bucket + 1]; ++e)
+    {
+        const Entry &entry = _entries[e];
+        if (entry.gram != gram)
+            continue;
+        const char *text = _text.data() + _offset[entry.literal];
+        size_t length = _offset[entry.literal + 1] - _offset[entry.literal];
+        if (length > len - i
+            || !(_fold ? equalFolded(str + i, text, length) : memcmp(str + i, text, length) == 0))
+            continue;
+        if (All)
+        {
+            Match found;
+            found.offset = i;
+            found.pattern = entry.literal;
+            found.length = length;
+            scan->matches->push_back(found);
+        }
+        else if (i + length < scan->best_end
+                 || (i + length == scan->best_end
+                     && length > _offset[scan->best + 1] - _offset[scan->best]))
+        {
+            scan->best_end = i + length;
+            scan->best = entry.literal;
+        }
+    }
+}
+
+class Target
+{
+public:
+    enum Encoding { ENCODING_RAW = 1, ENCODING_UTF16LE = 2, ENCODING_UTF16BE = 4 };
+
+    Target()
+            : _max_length(0), _zero_free(false), _filtered(false), _fold_case(false),
+              _encodings(ENCODING_RAW)
+    { }
+    ~Target();
+    
+    // Reports the hit that ends earliest in str[0, len).
+    bool match(const char *str, size_t len, Match *m = NULL) const;
+    // Looks for a hit that starts in prev and ends in next, where next
+    // directly follows prev in the input. Only the last and first
+    // maxLength() - 1 bytes of the two are looked at; m->offset is
+    // relative to prev.
+    bool matchAcross(const char *prev, size_t prev_len,
+                     const char *next, size_t next_len, Match *m = NULL) const;
+    // Finds the earliest-ending hit that ends in str[0, len), which sits
+    // at source offset offset right after prev, and starts at or after
+    // source offset from.
+    bool scan(const char *prev, size_t prev_len, const char *str, size_t len,
+              uint64_t offset, uint64_t from, Hit *hit) const;
+    // Appends every hit ending in str[0, len), laid out as for scan,
+    // ordered by start offset. Overlapping hits are all reported.
+    void scanAll(const char *prev, size_t prev_len, const char *str, size_t len,
+                 uint64_t offset, std::vector<Hit> *hits) const;
+    void addTarget(const std::string &target);
+    // Adds a regular expression, see Regex; on a syntax error it returns
+    // false with a message in *error.
+    bool addRegex(const std::string &expr, std::string *error);
+    // For patterns added after these: ASCII letters match either case,
+    // and literals are searched in each of encodings, a mask of Encoding,
+    // reading them as UTF-8. All forms are matched in the same pass and
+    // report the pattern they came from.
+    void setFoldCase(bool fold_case) { _fold_case = fold_case; }
+    void setEncodings(unsigned encodings) { _encodings = encodings; }
+    // Must be called after the last addTarget and before match.
+    void compile();
+    // Drops every pattern.
+    void clear();
+    // The patterns and their compiled matchers, for a pattern cache; load
+    // takes the place of adding patterns and compile.
+    void save(std::string *out) const;
+    bool load(const std::string &in, size_t *pos);
+    size_t size() const { return _targets.size(); }
+    size_t maxLength() const { return _max_length; }
+    // No hit contains a zero byte, so scan and scanAll pass over all-zero
+    // slots, such as holes, without looking for hits.
+    bool zeroFree() const { return _zero_free; }
+    // The literal, or the expression of a regex pattern.
+    const std::string &getTarget(int pattern) const { return _targets[pattern]; }
+    bool isRegex(int pattern) const;
+    
+private:
+    // Up to this many patterns a vector scan per pattern beats the automaton.
+    static const size_t kMemmemMaxTargets = 8;
+    // From this many literals on the automaton outgrows the caches and
+    // the gram filter takes over, given no literal is too short for it.
+    static const size_t kFilterMinTargets = 1024;
+
+    void measure();
+    bool useAutomaton() const { return _literals.size() > kMemmemMaxTargets && !_filtered; }
+    // Builds the gram filter if the literals call for it.
+    void buildFilter();
+    // The hits of literals starting in seam[0, tail) and ending past it,
+    // from the gram filter.
+    void filterAcross(const char *seam, size_t tail, size_t head,
+                      std::vector<Match> *matches) const;
+    void addForms(const std::string &target);
+
+    bool matchLiterals(const char *str, size_t len, Match *m) const;
+    bool acrossLiterals(const char *seam, size_t tail, size_t head, Match *m) const;
+    void allLiterals(const char *prev, size_t prev_len, const char *str, size_t len,
+                     uint64_t offset, std::vector<Hit> *hits) const;
+    // Earliest-ending regex hit in str[0, len) that starts before
+    // start_end and ends past end_min.
+    bool matchRegexes(const char *str, size_t start_end, size_t end_min, size_t len,
+                      Match *m) const;
+    // Every regex hit in str[0, len) that starts before start_end and
+    // ends past end_min.
+    void allRegexes(const char *str, size_t start_end, size_t end_min, size_t len,
+                    std::vector<Match> *matches) const;
+
+    std::vector<std::string> _targets;
+    size_t _max_length;
+    bool _zero_free;
+    // The literal patterns, for the scanners, and their pattern numbers.
+    std::vector<std::string> _literals;
+    std::vector<int> _literal_ids;
+    std::vector<Regex *> _regexes;
+    std::vector<int> _regex_ids;
+    AhoCorasick _automaton;
+    LiteralSet _set;      // for a few literals, see LiteralSet
+    GramFilter _filter;   // for very many, see kFilterMinTargets
+    bool _filtered;
+    bool _fold_case;
+    unsigned _encodings;
+};
+
+Target::~Target()
+{
+    clear();
+}
+
+void Target::clear()
+{
+    for (size_t i = 0; i < _regexes.size(); ++i)
+        delete _regexes[i];
+    _targets.clear();
+    _max_length = 0;
+    _zero_free = false;
+    _literals.clear();
+    _literal_ids.clear();
+    _regexes.clear();
+    _regex_ids.clear();
+    _automaton = AhoCorasick();
+    _set = LiteralSet();
+    _filter = GramFilter();
+    _filtered = false;
+}
+
+bool Target::isRegex(int pattern) const
+{
+    return std::find(_regex_ids.begin(), _regex_ids.end(), pattern) != _regex_ids.end();
+}
+
+void Target::save(std::string *out) const
+{
+    putU64(out, _fold_case);
+    putU64(out, _encodings);
+    putU64(out, _targets.size());
+    for (size_t i = 0; i < _targets.size(); ++i)
+    {
+        putU64(out, isRegex(i));
+        putString(out, _targets[i]);
+    }
+    for (size_t i = 0; i < _regexes.size(); ++i)
+        _regexes[i]->save(out);
+    if (useAutomaton())
+        _automaton.save(out);
+}
+
+bool Target::load(const std::string &in, size_t *pos)
+{
+    clear();
+    uint64_t fold_case = 0;
+    uint64_t encodings = 0;
+    uint64_t count = 0;
+    bool ok = getU64(in, pos, &fold_case) && getU64(in, pos, &encodings)
+              && getU64(in, pos, &count) && count <= in.size() - *pos;
+    _fold_case = fold_case != 0;
+    _encodings = encodings;
+    for (uint64_t i = 0; ok && i < count; ++i)
+    {
+        uint64_t regex = 0;
+        std::string text;
+        ok = getU64(in, pos, &regex) && getString(in, pos, &text) && !text.empty();
+        if (regex)
+            _regex_ids.push_back(_targets.size());
+        else
+            addForms(text);
+        _targets.push_back(text);
+    }
+    for (size_t i = 0; ok && i < _regex_ids.size(); ++i)
+    {
+        _regexes.push_back(new Regex());
+        ok = _regexes.back()->load(in, pos);
+    }
+    if (ok)
+        buildFilter();
+    if (ok && useAutomaton())
+        ok = _automaton.load(in, pos, _literals.size());
+    if (!ok)
+    {
+        clear();
+        return false;
+    }
+    measure();
+    if (!useAutomaton())
+        _set.build(_literals, _fold_case);
+    return true;
+}
+
+void Target::addTarget(const std::string &target)
+{
+    if (target.empty())
+        return;
+    addForms(target);
+    _targets.push_back(target);
+}
+
+// UTF-8 text as UTF-16 code units; bytes that do not decode stand for
+// themselves, as in Latin-1.
+static std::string encodeUtf16(const std::string &text, bool big_endian)
+{
+    static const uint32_t kMinCode[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    std::string out;
+    for (size_t i = 0; i < text.size(); )
+    {
+        unsigned char lead = text[i];
+        size_t n = lead >= 0xf8 ? 1 : lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+        uint32_t c = n == 1 ? lead : lead & (0x7f >> n);
+        size_t j = 1;
+        for (; j < n && i + j < text.size() && (text[i + j] & 0xc0) == 0x80; ++j)
+            c = c << 6 | (text[i + j] & 0x3f);
+        // Truncated and overlong sequences, surrogates and code points
+        // past U+10FFFF are taken byte by byte.
+        if (j < n || c < kMinCode[n] || (c >= 0xd800 && c < 0xe000) || c > 0x10ffff)
+        {
+            n = 1;
+            c = lead;
+        }
+        i += n;
+        uint16_t units[2] = { (uint16_t)c, 0 };
+        int count = 1;
+        if (c >= 0x10000)
+        {
+            units[0] = 0xd800 + ((c - 0x10000) >> 10);
+            units[1] = 0xdc00 + ((c - 0x10000) & 0x3ff);
+            count = 2;
+        }
+        for (int u = 0; u < count; ++u)
+        {
+            out += (char)(big_endian ? units[u] >> 8 : units[u] & 0xff);
+            out += (char)(big_endian ? units[u] & 0xff : units[u] >> 8);
+        }
+    }
+    return out;
+}
+
+// Adds the literal forms of target as the next pattern.
+void Target::addForms(const std::string &target)
+{
+    std::vector<std::string> forms;
+    if (_encodings & ENCODING_RAW)
+        forms.push_back(target);
+    if (_encodings & ENCODING_UTF16LE)
+        forms.push_back(encodeUtf16(target, false));
+    if (_encodings & ENCODING_UTF16BE)
+        forms.push_back(encodeUtf16(target, true));
+    for (size_t i = 0; i < forms.size(); ++i)
+    {
+        if (std::find(forms.begin(), forms.begin() + i, forms[i]) != forms.begin() + i)
+            continue;
+        _literal_ids.push_back(_targets.size());
+        _literals.push_back(forms[i]);
+    }
+}
+
+bool Target::addRegex(const std::string &expr, std::string *error)
+{
+    Regex *regex = new Regex();
+    if (!regex->compile(expr, error, _fold_case))
+    {
+        delete regex;
+        return false;
+    }
+    _regex_ids.push_back(_targets.size());
+    _regexes.push_back(regex);
+    _targets.push_back(expr);
+    return true;
+}
+
+void Target::compile()
+{
+    measure();
+    buildFilter();
+    if (useAutomaton())
+        _automaton.build(_literals, _fold_case);
+    else
+        _set.build(_literals, _fold_case);
+}
+
+void Target::buildFilter()
+{
+    _filtered = _literals.size() >= kFilterMinTargets && _filter.build(_literals, _fold_case);
+}
+
+void Target::filterAcross(const char *seam, size_t tail, size_t head,
+                          std::vector<Match> *matches) const
+{
+    size_t first = matches->size();
+    _filter.all(seam, tail + head, matches);
+    size_t kept = first;
+    for (size_t i = first; i < matches->size(); ++i)
+    {
+        const Match &m = (*matches)[i];
+        if (m.offset < tail && m.offset + m.length > tail)
+            (*matches)[kept++] = m;
+    }
+    matches->resize(kept);
+}
+
+void Target::measure()
+{
+    _max_length = 0;
+    _zero_free = true;
+    for (size_t i = 0; i < _literals.size(); ++i)
+    {
+        _max_length = std::max(_max_length, _literals[i].size());
+        _zero_free = _zero_free && _literals[i].find('\0') == std::string::npos;
+    }
+    for (size_t i = 0; i < _regexes.size(); ++i)
+    {
+        _max_length = std::max(_max_length, _regexes[i]->maxLength());
+        _zero_free = _zero_free && !_regexes[i]->canMatch(0);
+    }
+}
+
+bool Target::matchAcross(const char *prev, size_t prev_len,
+                         const char *next, size_t next_len, Match *m) const
+{
+    if (_max_length < 2 || prev_len == 0 || next_len == 0)
+        return false;
+    size_t tail = std::min(prev_len, _max_length - 1);
+    size_t head = std::min(next_len, _max_length - 1);
+    char local[512];
+    std::string heap;
+    char *seam = local;
+    if (tail + head > sizeof(local))
+    {
+        heap.resize(tail + head);
+        seam = &heap[0];
+    }
+    memcpy(seam, prev + prev_len - tail, tail);
+    memcpy(seam + tail, next, head);
+
+    Match found;
+    Match regex;
+    bool ok = acrossLiterals(seam, tail, head, &found);
+    if (matchRegexes(seam, tail, tail, tail + head, &regex)
+        && (!ok || regex.offset + regex.length < found.offset + found.length))
+    {
+        found = regex;
+        ok = true;
+    }
+    if (!ok)
+        return false;
+    if (m != NULL)
+    {
+        *m = found;
+        m->offset += prev_len - tail;
+    }
+    return true;
+}
+
+bool Target::acrossLiterals(const char *seam, size_t tail, size_t head, Match *m) const
+{
+    // Hits wholly inside the tail were seen with prev; look for the
+    // first one that ends past it.
+    size_t start = 0;
+    int pattern = -1;
+    if (useAutomaton())
+    {
+        // The longest pattern ending at a position is the one reported,
+        // and it is the one most likely to start inside the tail.
+        uint32_t state = 0;
+        size_t end = 0;
+        int found = -1;
+        while (_automaton.resume(seam, tail + head, &state, &end, &found))
+        {
+            size_t len = _literals[found].size();
+            if (end > tail && end - len < tail)
+            {
+                start = end - len;
+                pattern = found;
+                break;
+            }
+        }
+    }
+    else if (_filtered)
+    {
+        std::vector<Match> matches;
+        filterAcross(seam, tail, head, &matches);
+        size_t best_end = 0;
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            size_t end = matches[i].offset + matches[i].length;
+            if (pattern < 0 || end < best_end
+                || (end == best_end && matches[i].length > _literals[pattern].size()))
+            {
+                start = matches[i].offset;
+                best_end = end;
+                pattern = matches[i].pattern;
+            }
+        }
+    }
+    else
+    {
+        // Occurrences of a single pattern come in start order, so a
+        // spanning one is found by skipping those ending in the tail.
+        size_t best_end = 0;
+        for (size_t i = 0; i < _literals.size(); ++i)
+        {
+            const std::string &target = _literals[i];
+            size_t from = 0;
+            while (from < tail)
+            {
+                const char *found = LiteralScanner::find(seam + from, tail + head - from,
+                                                         target.c_str(), target.size(),
+                                                         _fold_case);
+                if (found == NULL || (size_t)(found - seam) >= tail)
+                    break;
+                size_t end = found - seam + target.size();
+                if (end > tail)
+                {
+                    if (pattern < 0 || end < best_end
+                        || (end == best_end && target.size() > _literals[pattern].size()))
+                    {
+                        start = found - seam;
+                        best_end = end;
+                        pattern = (int)i;
+                    }
+                    break;
+                }
+                from = found - seam + 1;
+            }
+        }
+    }
+    if (pattern < 0)
+        return false;
+    m->offset = start;
+    m->pattern = _literal_ids[pattern];
+    m->length = _literals[pattern].size();
+    return true;
+}
+
+bool Target::matchRegexes(const char *str, size_t start_end, size_t end_min, size_t len,
+                          Match *m) const
+{
+    bool found = false;
+    size_t best_end = 0;
+    for (size_t i = 0; i < _regexes.size(); ++i)
+    {
+        const Regex *regex = _regexes[i];
+        // Starts come in order, and none at or past the best end can
+        // end before it.
+        for (size_t pos = 0; pos < start_end && regex->nextCandidate(str, len, &pos); ++pos)
+        {
+            if (pos >= start_end || (found && pos >= best_end))
+                break;
+            size_t length = regex->matchAt(str + pos, len - pos);
+            if (length == 0 || pos + length <= end_min)
+                continue;
+            if (!found || pos + length < best_end)
+            {
+                found = true;
+                best_end = pos + length;
+                m->offset = pos;
+                m->pattern = _regex_ids[i];
+                m->length = length;
+            }
+        }
+    }
+    return found;
+}
+
+void Target::allRegexes(const char *str, size_t start_end, size_t end_min, size_t len,
+                        std::vector<Match> *matches) const
+{
+    Match m;
+    for (size_t i = 0; i < _regexes.size(); ++i)
+    {
+        const Regex *regex = _regexes[i];
+        m.pattern = _regex_ids[i];
+        for (size_t pos = 0; pos < start_end && regex->nextCandidate(str, len, &pos); ++pos)
+        {
+            if (pos >= start_end)
+                break;
+            size_t length = regex->matchAt(str + pos, len - pos);
+            if (length == 0 || pos + length <= end_min)
+                continue;
+            m.offset = pos;
+            m.length = length;
+            matches->push_back(m);
+        }
+    }
+}
+
+static bool hitLess(const Hit &a, const Hit &b)
+{
+    return a.offset < b.offset || (a.offset == b.offset && a.pattern < b.pattern);
+}
+
+void Target::scanAll(const char *prev, size_t prev_len, const char *str, size_t len,
+                     uint64_t offset, std::vector<Hit> *hits) const
+{
+    // Every hit ending in str would end in a zero byte.
+    if (_zero_free && LiteralScanner::isZero(str, len))
+        return;
+    size_t first = hits->size();
+    allLiterals(prev, prev_len, str, len, offset, hits);
+    if (!_regexes.empty())
+    {
+        // Hits starting in the tail of prev and ending in str, then those
+        // wholly inside str.
+        size_t tail = _max_length > 0 ? std::min(prev_len, _max_length - 1) : 0;
+        size_t head = std::min(len, _max_length > 0 ? _max_length - 1 : 0);
+        std::vector<Match> matches;
+        if (tail > 0 && head > 0)
+        {
+            std::string seam(prev + prev_len - tail, tail);
+            seam.append(str, head);
+            allRegexes(seam.data(), tail, tail, seam.size(), &matches);
+        }
+        size_t spanning = matches.size();
+        allRegexes(str, len, 0, len, &matches);
+        Hit hit;
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            hit.offset = i < spanning ? offset - tail + matches[i].offset
+                                      : offset + matches[i].offset;
+            hit.pattern = matches[i].pattern;
+            hit.length = matches[i].length;
+            hits->push_back(hit);
+        }
+    }
+    std::sort(hits->begin() + first, hits->end(), hitLess);
+}
+
+void Target::allLiterals(const char *prev, size_t prev_len, const char *str, size_t len,
+                         uint64_t offset, std::vector<Hit> *hits) const
+{
+    size_t tail = _max_length > 0 ? std::min(prev_len, _max_length - 1) : 0;
+    Hit hit;
+    if (useAutomaton())
+    {
+        // Prime the automaton with the tail of prev so hits starting there
+        // are seen, then collect everything that ends in str.
+        uint32_t state = 0;
+        size_t end = 0;
+        int pattern = -1;
+        while (_automaton.resume(prev + prev_len - tail, tail, &state, &end, &pattern))
+        { }
+        std::vector<int> patterns;
+        end = 0;
+        while (_automaton.resume(str, len, &state, &end, &pattern))
+        {
+            patterns.clear();
+            _automaton.outputs(state, &patterns);
+            for (size_t i = 0; i < patterns.size(); ++i)
+            {
+                hit.offset = offset + end - _literals[patterns[i]].size();
+                hit.pattern = _literal_ids[patterns[i]];
+                hit.length = _literals[patterns[i]].size();
+                hits->push_back(hit);
+            }
+        }
+    }
+    else if (_filtered)
+    {
+        // Hits spanning the tail of prev and the head of str, then those
+        // inside str.
+        std::vector<Match> matches;
+        size_t head = std::min(len, _max_length - 1);
+        if (tail > 0 && head > 0)
+        {
+            std::string seam(prev + prev_len - tail, tail);
+            seam.append(str, head);
+            filterAcross(seam.data(), tail, head, &matches);
+        }
+        size_t spanning = matches.size();
+        _filter.all(str, len, &matches);
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            hit.offset = i < spanning ? offset - tail + matches[i].offset
+                                      : offset + matches[i].offset;
+            hit.pattern = _literal_ids[matches[i].pattern];
+            hit.length = matches[i].length;
+            hits->push_back(hit);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < _literals.size(); ++i)
+        {
+            const std::string &target = _literals[i];
+            hit.pattern = _literal_ids[i];
+            hit.length = target.size();
+            // Spanning hits: enumerate the pattern over the seam.
+            size_t head = std::min(len, target.size() - 1);
+            size_t seam_tail = std::min(tail, target.size() - 1);
+            if (seam_tail > 0 && head > 0)
+            {
+                char seam[512];
+                std::string heap;
+                char *p = seam;
+                if (seam_tail + head > sizeof(seam))
+                {
+                    heap.resize(seam_tail + head);
+                    p = &heap[0];
+                }
+                memcpy(p, prev + prev_len - seam_tail, seam_tail);
+                memcpy(p + seam_tail, str, head);
+                for (size_t from = 0; from < seam_tail; )
+                {
+                    const char *found = LiteralScanner::find(p + from, seam_tail + head - from,
+                                                             target.c_str(), target.size(),
+                                                             _fold_case);
+                    if (found == NULL)
+                        break;
+                    size_t start = found - p;
+                    if (start + target.size() > seam_tail && start < seam_tail)
+                    {
+                        hit.offset = offset - seam_tail + start;
+                        hits->push_back(hit);
+                    }
+                    from = start + 1;
+                }
+            }
+            if (_set.size() > 0)
+                continue;
+            for (size_t from = 0; from < len; )
+            {
+                const char *found = LiteralScanner::find(str + from, len - from,
+                                                         target.c_str(), target.size(),
+                                                         _fold_case);
+                if (found == NULL)
+                    break;
+                hit.offset = offset + (found - str);
+                hits->push_back(hit);
+                from = found - str + 1;
+            }
+        }
+        if (_set.size() > 0)
+        {
+            // The hits inside str, for all literals in one pass.
+            std::vector<Match> matches;
+            _set.all(str, len, &matches);
+            for (size_t i = 0; i < matches.size(); ++i)
+            {
+                hit.offset = offset + matches[i].offset;
+                hit.pattern = _literal_ids[matches[i].pattern];
+                hit.length = matches[i].length;
+                hits->push_back(hit);
+            }
+        }
+    }
+}
+
+bool Target::scan(const char *prev, size_t prev_len, const char *str, size_t len,
+                  uint64_t offset, uint64_t from, Hit *hit) const
+{
+    if (_zero_free && LiteralScanner::isZero(str, len))
+        return false;
+    bool found = false;
+    uint64_t best_end = 0;
+    Match m;
+    if (from < offset && prev_len > 0)
+    {
+        uint64_t prev_offset = offset - prev_len;
+        size_t skip = from > prev_offset ? from - prev_offset : 0;
+        if (matchAcross(prev + skip, prev_len - skip, str, len, &m))
+        {
+            hit->offset = prev_offset + skip + m.offset;
+            hit->pattern = m.pattern;
+            hit->length = m.length;
+            best_end = hit->offset + m.length;
+            found = true;
+        }
+    }
+    size_t skip = from > offset ? from - offset : 0;
+    if (skip < len && match(str + skip, len - skip, &m)
+        && (!found || offset + skip + m.offset + m.length < best_end))
+    {
+        hit->offset = offset + skip + m.offset;
+        hit->pattern = m.pattern;
+        hit->length = m.length;
+        found = true;
+    }
+    return found;
+}
+
+bool Target::match(const char *str, size_t len, Match *m) const
+{
+    Match found;
+    Match regex;
+    bool ok = matchLiterals(str, len, &found);
+    // A regex hit starting past the literal one cannot end before it.
+    if (matchRegexes(str, ok ? found.offset + found.length : len, 0, len, &regex)
+        && (!ok || regex.offset + regex.length < found.offset + found.length))
+    {
+        found = regex;
+        ok = true;
+    }
+    if (ok && m != NULL)
+        *m = found;
+    return ok;
+}
+
+bool Target::matchLiterals(const char *str, size_t len, Match *m) const
+{
+    size_t end = 0;
+    int pattern = -1;
+    if (_literals.empty())
+        return false;
+    if (useAutomaton())
+    {
+        if (!_automaton.search(str, len, &end, &pattern))
+            return false;
+    }
+    else if (_filtered || _set.size() > 0)
+    {
+        Match found;
+        if (!(_filtered ? _filter.first(str, len, &found) : _set.first(str, len, &found)))
+            return false;
+        end = found.offset + found.length;
+        pattern = found.pattern;
+    }
+    else
+    {
+        for (size_t i = 0; i < _literals.size(); ++i)
+        {
+            const std::string &target = _literals[i];
+            const char *found = LiteralScanner::find(str, len, target.c_str(), target.size(),
+                                                     _fold_case);
+            // Ties go to the longest pattern, as with the automaton.
+            if (found != NULL && (pattern < 0 || found - str + target.size() < end
+                                  || (found - str + target.size() == end
+                                      && target.size() > _literals[pattern].size())))
+            {
+                end = found - str + target.size();
+                pattern = (int)i;
+                // Nothing else can end earlier inside this prefix.
+                len = end;
+            }
+        }
+        if (pattern < 0)
+            return false;
+    }
+    m->offset = end - _literals[pattern].size();
+    m->pattern = _literal_ids[pattern];
+    m->length = _literals[pattern].size();
+    return true;
+}
+
+// One record of the binary index. Records are fixed width, in host byte
+// order and without a file header, so runs can append to the same index.
+struct IndexRecord
+{
+    uint64_t offset;
+    uint64_t context_start;
+    uint64_t context_length;
+    uint64_t hash;           // FNV-1a of the context, if kIndexHashed
+    uint32_t pattern;
+    uint32_t length;         // of the match
+    uint32_t flags;
+    uint32_t source;         // input number in a multi-input scan
+
+    static const uint32_t kIndexHashed = 1;
+};
+
+// Writes one index record per reported hit instead of the context bytes.
+// Records are JSON Lines or IndexRecord; either way an extract pass can
+// fetch the windows later without scanning again.
+class IndexCollector : public Collector
+{
+public:
+    enum Format { FORMAT_JSON, FORMAT_BINARY };
+
+    IndexCollector(int fd, Format format);
+    virtual ~IndexCollector();
+    // Hash every context window, read back from source with pread.
+    void setSource(int source);
+    // Clip windows to an input of size bytes.
+    void setLimit(uint64_t size);
+    virtual void collect(const char *, size_t)
+    { }
+    virtual bool collectFrom(int, uint64_t, size_t)
+    { return true; }
+    virtual void matched(const Hit &hit, uint64_t context_start, uint64_t context_end);
+    // Records never point into the caller's memory, so windows ending
+    // do not force a write.
+    virtual void flush()
+    { }
+    // Writes out all buffered records.
+    void finish();
+    virtual bool failed() const
+    { return _error; }
+    virtual off_t sync()
+    { finish(); return syncOutput(_fd); }
+    virtual bool rewind(off_t position)
+    { return rewindOutput(_fd, position); }
+
+private:
+    static const size_t kFlushSize = 64 * 1024;
+
+    bool hashRange(uint64_t start, uint64_t *end, uint64_t *hash) const;
+
+    int _fd;
+    Format _format;
+    int _source;
+    uint64_t _limit;
+    bool _error;
+    std::string _pending;
+};
+
+IndexCollector::IndexCollector(int fd, Format format)
+        : Collector(),
+          _fd(fd),
+          _format(format),
+          _source(-1),
+          _limit(0),
+          _error(false)
+{ }
+
+IndexCollector::~IndexCollector()
+{
+    finish();
+}
+
+void IndexCollector::setSource(int source)
+{
+    _source = source;
+}
+
+void IndexCollector::setLimit(uint64_t size)
+{
+    _limit = size;
+}
+
+void IndexCollector::matched(const Hit &hit, uint64_t context_start, uint64_t context_end)
+{
+    if (_limit > 0)
+        context_end = std::min(context_end, _limit);
+    IndexRecord record;
+    memset(&record, 0, sizeof(record));
+    if (_source >= 0 && hashRange(context_start, &context_end, &record.hash))
+        record.flags |= IndexRecord::kIndexHashed;
+    record.offset = hit.offset;
+    record.context_start = context_start;
+    record.context_length = context_end > context_start ? context_end - context_start : 0;
+    record.pattern = hit.pattern;
+    record.length = hit.length;
+    record.source = _input_number;
+
+    if (_format == FORMAT_BINARY)
+    {
+        _pending.append((const char *)&record, sizeof(record));
+    }
+    else
+    {
+        char line[160];
+        int len = snprintf(line, sizeof(line),
+                           "{\"offset\":%llu,\"pattern\":%u,\"length\":%u,"
+                           "\"context_start\":%llu,\"context_length\":%llu",
+                           (unsigned long long)record.offset, record.pattern, record.length,
+                           (unsigned long long)record.context_start,
+                           (unsigned long long)record.context_length);
+        if (record.flags & IndexRecord::kIndexHashed)
+            len += snprintf(line + len, sizeof(line) - len, ",\"hash\":\"%016llx\"",
+                            (unsigned long long)record.hash);
+        _pending.append(line, len);
+        if (!_input.empty())
+        {
+            // Control bytes, quotes and backslashes escaped; others as is.
+            _pending += ",\"source\":\"";
+            for (size_t i = 0; i < _input.size(); ++i)
+            {
+                unsigned char c = _input[i];
+                if (c < 0x20)
+                {
+                    snprintf(line, sizeof(line), "\\u%04x", c);
+                    _pending += line;
+                    continue;
+                }
+                if (c == '"' || c == '\\')
+                    _pending += '\\';
+                _pending += c;
+            }
+            _pending += '"';
+        }
+        _pending += "}\n";
+    }
+    if (_pending.size() >= kFlushSize)
+        finish();
+}
+
+void IndexCollector::finish()
+{
+    size_t done = 0;
+    while (done < _pending.size() && !_error)
+    {
+        ssize_t ret = ::write(_fd, _pending.data() + done, _pending.size() - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            _error = true;
+        else
+            done += ret;
+    }
+    _pending.clear();
+}
+
+bool IndexCollector::hashRange(uint64_t start, uint64_t *end, uint64_t *hash) const
+{
+    // An input of unknown size ends where pread does.
+    char buffer[64 * 1024];
+    uint64_t h = kFnvBasis;
+    for (uint64_t pos = start; pos < *end; )
+    {
+        ssize_t ret = ::pread(_source, buffer, std::min((uint64_t)sizeof(buffer), *end - pos), pos);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return false;
+        if (ret == 0)
+        {
+            *end = pos;
+            break;
+        }
+        h = fnv1a(h, buffer, ret);
+        pos += ret;
+    }
+    *hash = h;
+    return true;
+}
+
+// Unsigned number following "key": in a JSON Lines index record.
+static bool jsonNumber(const char *line, const char *key, uint64_t *value)
+{
+    std::string field = std::string("\"") + key + "\":";
+    const char *p = strstr(line, field.c_str());
+    if (p == NULL)
+        return false;
+    p += field.size();
+    char *end = NULL;
+    *value = strtoull(p, &end, 10);
+    return end != p;
+}
+
+// String following "key": in a JSON Lines index record, unescaped the
+// way IndexCollector escapes it.
+static bool jsonString(const char *line, const char *key, std::string *value)
+{
+    std::string field = std::string("\"") + key + "\":\"";
+    const char *p = strstr(line, field.c_str());
+    if (p == NULL)
+        return false;
+    value->clear();
+    for (p += field.size(); *p != '\0' && *p != '"'; ++p)
+    {
+        if (*p != '\\')
+        {
+            *value += *p;
+            continue;
+        }
+        ++p;
+        if (*p == 'u')
+        {
+            unsigned code = 0;
+            if (sscanf(p + 1, "%4x", &code) != 1)
+                return false;
+            *value += (char)code;
+            p += 4;
+        }
+        else if (*p != '\0')
+        {
+            *value += *p;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return *p == '"';
+}
+
+// Reads the records of an index, and into sources the input each one
+// was found in: the path of JSON records, the input number of binary
+// ones, empty for JSON records of a single input scan.
+static bool readIndex(const char *path, IndexCollector::Format format,
+                      std::vector<IndexRecord> *records, std::vector<std::string> *sources)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    bool ok = true;
+    if (format == IndexCollector::FORMAT_BINARY)
+    {
+        IndexRecord record;
+        size_t n = 0;
+        while ((n = fread(&record, 1, sizeof(record), file)) == sizeof(record))
+        {
+            records->push_back(record);
+            char number[16];
+            snprintf(number, sizeof(number), "%u", record.source);
+            sources->push_back(number);
+        }
+        // A partial record means the index was cut short.
+        ok = n == 0;
+    }
+    else
+    {
+        // Lines are as long as the paths in them.
+        char *line = NULL;
+        size_t capacity = 0;
+        while (ok && ::getline(&line, &capacity, file) > 0)
+        {
+            if (line[0] != '{')
+                continue;
+            IndexRecord record;
+            memset(&record, 0, sizeof(record));
+            uint64_t pattern = 0;
+            uint64_t length = 0;
+            ok = jsonNumber(line, "offset", &record.offset)
+                 && jsonNumber(line, "context_start", &record.context_start)
+                 && jsonNumber(line, "context_length", &record.context_length);
+            jsonNumber(line, "pattern", &pattern);
+            jsonNumber(line, "length", &length);
+            record.pattern = pattern;
+            record.length = length;
+            std::string source;
+            if (strstr(line, "\"source\":") != NULL)
+                ok = ok && jsonString(line, "source", &source);
+            records->push_back(record);
+            sources->push_back(source);
+        }
+        free(line);
+    }
+    ok = ok && !ferror(file);
+    if (file != stdin)
+        fclose(file);
+    return ok;
+}
+
+// Keeps the records read by readIndex that were found in input dev.
+// JSON records of a multi-input scan name their input; once any record
+// does, only those naming dev are kept. Binary records only number it,
+// so a binary index has to come from a single input. False, with error
+// set, if nothing in the index can be told to belong to dev.
+static bool recordsFor(const char *dev, IndexCollector::Format format,
+                       const std::vector<std::string> &sources,
+                       std::vector<IndexRecord> *records, std::string *error)
+{
+    if (format == IndexCollector::FORMAT_BINARY)
+    {
+        for (size_t i = 1; i < sources.size(); ++i)
+        {
+            if (sources[i] != sources[0])
+            {
+                *error = "binary index covers several inputs, which it only numbers";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Inputs found below a directory are named as walked, so resolved
+    // paths are compared too, once per input.
+    char resolved[PATH_MAX];
+    std::string path = ::realpath(dev, resolved) != NULL ? resolved : dev;
+    std::map<std::string, bool> matches;
+    bool named = false;
+    std::vector<IndexRecord> kept;
+    for (size_t i = 0; i < records->size(); ++i)
+    {
+        if (sources[i].empty())
+            continue;
+        named = true;
+        std::map<std::string, bool>::iterator match = matches.find(sources[i]);
+        if (match == matches.end())
+        {
+            bool same = sources[i] == dev || (::realpath(sources[i].c_str(), resolved) != NULL
+                                              && path == resolved);
+            match = matches.insert(std::make_pair(sources[i], same)).first;
+        }
+        if (match->second)
+            kept.push_back((*records)[i]);
+    }
+    if (!named)
+        return true;
+    if (kept.empty())
+    {
+        *error = std::string("index has no records of ") + dev;
+        return false;
+    }
+    records->swap(kept);
+    return true;
+}
+
+// Joins pieces that follow each other both in the source and in memory,
+// so a window over the ring arena or a mapping reaches the collector as
+// one or two spans rather than one call per slot.
+class Span
+{
+public:
+    Span() : _offset(0), _data(NULL), _length(0)
+    { }
+    void add(uint64_t offset, const char *data, size_t length, Collector *collector)
+    {
+        if (_length > 0 && _data + _length == data && _offset + _length == offset)
+        {
+            _length += length;
+            return;
+        }
+        flush(collector);
+        _offset = offset;
+        _data = data;
+        _length = length;
+    }
+    void flush(Collector *collector)
+    {
+        if (_length > 0)
+            collector->collectAt(_offset, _data, _length);
+        _length = 0;
+    }
+
+private:
+    uint64_t _offset;
+    const char *_data;
+    size_t _length;
+};
+
+class RingBuffer
+{
+public:
+    // All slots live in one arena; huge_pages asks for MAP_HUGETLB and
+    // falls back to transparent huge pages. See failed.
+    RingBuffer(int buf_num, int buf_size, const Target *target, bool huge_pages = false);
+    ~RingBuffer();
+    // True when the arena could not be mapped; errno tells why. Nothing
+    // else may be called then.
+    bool failed() const { return _arena == NULL; }
+    char *getBuffer(int buffer_idx);
+    inline int getBufferSize() const;
+    // False once the reader is at its end or failed, see readFailed.
+    // Slots still being written by the collector are waited for before
+    // they are read into again.
+    bool readFrom(Reader *reader, Collector *collector);
+    bool readFailed() const { return _read_failed; }
+    void collectTo(int start, Collector *collector) const;
+    // Switches from whole-slot dumps to exactly before bytes ahead of
+    // each hit and after bytes past its end. The ring must hold both plus
+    // the hit and two slots.
+    void setContext(uint64_t before, uint64_t after);
+    // Reports every hit, also those inside an open window, and merges
+    // overlapping windows. Hits are appended to hits when it is set.
+    void setReportAll(std::vector<Hit> *hits);
+    // Slot contents and window state, for checkpoints. loadState needs a
+    // ring of the same geometry and mode as the one saved.
+    void saveState(std::string *out) const;
+    bool loadState(const std::string &in);
+    
+private:
+    void scanAll(int buffer_idx, const char *prev, int prev_length,
+                 Collector *collector);
+    void scanBytes(int buffer_idx, const char *prev, int prev_length,
+                   Collector *collector);
+    void collectRange(uint64_t start, uint64_t end, Collector *collector) const;
+
+private:
+    char *_arena;
+    size_t _arena_size;
+    char **_buffer;
+    const char **_data;   // where each slot's bytes live, see Reader::view
+    uint64_t *_offset;    // source offset of each slot
+    int *_length;         // bytes read into each slot
+    uint64_t *_pinned;    // collector window still writing each slot, 0: none
+    int _buffer_num;
+    int _buffer_size;
+    int _next_buffer_idx;
+    int _matched_buffer_idx;
+    int _last_length;     // bytes read into the previous slot
+    bool _read_failed;
+    const Target *_target;
+    char *_buffer_print_flag; // 0: not printed
+
+    // Byte-granular context, see setContext.
+    bool _byte_context;
+    uint64_t _before;
+    uint64_t _after;
+    bool _pending;
+    uint64_t _window_start;
+    uint64_t _window_end;
+    uint64_t _scan_from;  // hits starting before this are inside a window
+
+    bool _report_all;
+    std::vector<Hit> *_hits;
+    std::vector<Hit> _found;
+};
+
+RingBuffer::RingBuffer(int buffer_num, int buffer_size, const Target *target,
+                       bool huge_pages)
+        : _arena(NULL),
+          _arena_size(0),
+          _buffer_num(buffer_num),
+          _buffer_size(buffer_size),
+          _next_buffer_idx(0),
+          _matched_buffer_idx(-1),
+          _last_length(0),
+          _read_failed(false),
+          _target(target),
+          _byte_context(false),
+          _before(0),
+          _after(0),
+          _pending(false),
+          _window_start(0),
+          _window_end(0),
+          _scan_from(0),
+          _report_all(false),
+          _hits(NULL)
+{
+    assert(_buffer_num > 0);
+    assert(_buffer_size > 0);
+    static const size_t kHugePage = 2 * 1024 * 1024;
+    size_t size = (size_t)_buffer_num * _buffer_size;
+    _arena_size = (size + kHugePage - 1) / kHugePage * kHugePage;
+    _buffer = NULL;
+    _data = NULL;
+    _offset = NULL;
+    _length = NULL;
+    _pinned = NULL;
+    _buffer_print_flag = NULL;
+    void *arena = MAP_FAILED;
+    if (huge_pages)
+        arena = ::mmap(NULL, _arena_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena == MAP_FAILED)
+    {
+        // Over-allocate by one huge page so the arena can start on a
+        // huge page boundary.
+        size_t mapped = _arena_size + kHugePage;
+        char *base = (char *)::mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return;
+        char *aligned = (char *)(((uintptr_t)base + kHugePage - 1) & ~(uintptr_t)(kHugePage - 1));
+        if (aligned > base)
+            ::munmap(base, aligned - base);
+        size_t rest = mapped - (aligned - base) - _arena_size;
+        if (rest > 0)
+            ::munmap(aligned + _arena_size, rest);
+        ::madvise(aligned, _arena_size, MADV_HUGEPAGE);
+        arena = aligned;
+    }
+    _arena = (char *)arena;
+    _buffer = new char *[_buffer_num];
+    _data = new const char *[_buffer_num];
+    _offset = new uint64_t[_buffer_num];
+    _length = new int[_buffer_num];
+    _pinned = new uint64_t[_buffer_num];
+    _buffer_print_flag = new char[_buffer_num];
+    for (int i = 0; i < _buffer_num; ++i)
+    {
+        _buffer[i] = _arena + (size_t)i * _buffer_size;
+        _data[i] = _buffer[i];
+        _offset[i] = 0;
+        _length[i] = 0;
+        _pinned[i] = 0;
+        _buffer_print_flag[i] = 1;
+    }
+}
+
+RingBuffer::~RingBuffer()
+{
+    if (_arena != NULL)
+        ::munmap(_arena, _arena_size);
+    _arena = NULL;
+    delete[] _buffer;
+    _buffer = NULL;
+    delete[] _data;
+    delete[] _offset;
+    delete[] _length;
+    delete[] _pinned;
+    delete[] _buffer_print_flag;
+}
+
+bool RingBuffer::readFrom(Reader *reader, Collector *collector)
+{
+    int buffer_idx = _next_buffer_idx++;
+    _next_buffer_idx %= _buffer_num;
+    const char *buffer = _buffer[buffer_idx];
+    if (_pinned[buffer_idx] != 0)
+    {
+        StatsTimer timer(Stats::PHASE_OUTPUT);
+        collector->waitWritten(_pinned[buffer_idx]);
+        _pinned[buffer_idx] = 0;
+    }
+    
+    _offset[buffer_idx] = reader->tell();
+    uint64_t read_start = Stats::now();
+    int nread = reader->view(_buffer[buffer_idx], _buffer_size, &buffer);
+    Stats::addTime(Stats::PHASE_READ, read_start);
+    _data[buffer_idx] = buffer;
+    _length[buffer_idx] = nread > 0 ? nread : 0;
+    _buffer_print_flag[buffer_idx] = 0;
+    // The slot we are about to overwrite next is the oldest one kept.
+    reader->release(_offset[_next_buffer_idx]);
+    if (nread > 0)
+        Stats::addBytes(nread);
+
+    if (nread <= 0)
+    {
+        _read_failed = nread < 0;
+        if (_pending)
+        {
+            collectRange(_window_start, _window_end, collector);
+            _pending = false;
+        }
+        if (_matched_buffer_idx >= 0)
+        {
+            int start = _matched_buffer_idx + _buffer_num / 2;
+            start %= _buffer_num;
+            collectTo(start, collector);
+            _matched_buffer_idx = -1;
+        }
+        return false;
+    }
+
+    // The previous slot is still in the ring, so hits straddling the two
+    // are checked on the few bytes around the seam.
+    int prev_idx = (buffer_idx + _buffer_num - 1) % _buffer_num;
+    int prev_length = _buffer_num > 1 ? _last_length : 0;
+    _last_length = nread;
+    if (_report_all)
+    {
+        scanAll(buffer_idx, _data[prev_idx], prev_length, collector);
+        return true;
+    }
+    if (_byte_context)
+    {
+        scanBytes(buffer_idx, _data[prev_idx], prev_length, collector);
+        return true;
+    }
+
+    Hit hit;
+    uint64_t match_start = Stats::now();
+    bool found = _matched_buffer_idx < 0
+                 && _target->scan(_data[prev_idx], prev_length, buffer, nread,
+                                  _offset[buffer_idx], 0, &hit);
+    Stats::addTime(Stats::PHASE_MATCH, match_start);
+    if (found)
+    {
+        Stats::addHit();
+        uint64_t half = (uint64_t)(_buffer_num / 2) * _buffer_size;
+        uint64_t offset = _offset[buffer_idx];
+        collector->matched(hit, offset > half ? offset - half : 0, offset + half);
+        _matched_buffer_idx = buffer_idx;
+    }
+
+    if (_matched_buffer_idx >= 0)
+    {
+        int start = _matched_buffer_idx + _buffer_num / 2;
+        start %= _buffer_num;
+        if (_next_buffer_idx == start)
+        {
+            collectTo(start, collector);
+            _matched_buffer_idx = -1;
+        }
+    }
+
+    return true;
+}
+
+void RingBuffer::collectTo(int start, Collector *collector) const
+{
+    // From start up to the newest slot, which at end of input is not
+    // the one just before start. Only the bytes actually read are written.
+    StatsTimer timer(Stats::PHASE_OUTPUT);
+    int newest = (_next_buffer_idx + _buffer_num - 1) % _buffer_num;
+    uint64_t window = collector->window() + 1;
+    Span span;
+    for (int i = start; ; i = (i + 1) % _buffer_num)
+    {
+        if (_buffer_print_flag[i] == 0)
+        {
+            if (_length[i] > 0)
+            {
+                span.add(_offset[i], _data[i], _length[i], collector);
+                _pinned[i] = window;
+            }
             _buffer_print_flag[i] = 1;
         }
+        if (i == newest)
+            break;
+    }
+    span.flush(collector);
+    collector->flush();
+}
+
+void RingBuffer::setContext(uint64_t before, uint64_t after)
+{
+    _byte_context = true;
+    _before = before;
+    _after = after;
+}
+
+void RingBuffer::setReportAll(std::vector<Hit> *hits)
+{
+    _report_all = true;
+    _hits = hits;
+}
+
+void RingBuffer::saveState(std::string *out) const
+{
+    putU64(out, _buffer_num);
+    putU64(out, _buffer_size);
+    putU64(out, _next_buffer_idx);
+    putU64(out, (int64_t)_matched_buffer_idx);
+    putU64(out, _last_length);
+    putU64(out, _pending);
+    putU64(out, _window_start);
+    putU64(out, _window_end);
+    putU64(out, _scan_from);
+    for (int i = 0; i < _buffer_num; ++i)
+    {
+        putU64(out, _offset[i]);
+        putU64(out, _length[i]);
+        putU64(out, _buffer_print_flag[i]);
+        out->append(_data[i], _length[i]);
+    }
+}
+
+bool RingBuffer::loadState(const std::string &in)
+{
+    size_t pos = 0;
+    uint64_t num = 0;
+    uint64_t size = 0;
+    uint64_t next = 0;
+    uint64_t matched = 0;
+    uint64_t last = 0;
+    uint64_t pending = 0;
+    if (!getU64(in, &pos, &num) || !getU64(in, &pos, &size)
+        || num != (uint64_t)_buffer_num || size != (uint64_t)_buffer_size
+        || !getU64(in, &pos, &next) || !getU64(in, &pos, &matched)
+        || !getU64(in, &pos, &last) || !getU64(in, &pos, &pending)
+        || !getU64(in, &pos, &_window_start) || !getU64(in, &pos, &_window_end)
+        || !getU64(in, &pos, &_scan_from))
+        return false;
+    _next_buffer_idx = next;
+    _matched_buffer_idx = (int64_t)matched;
+    _last_length = last;
+    _pending = pending != 0;
+    for (int i = 0; i < _buffer_num; ++i)
+    {
+        uint64_t length = 0;
+        uint64_t flag = 0;
+        if (!getU64(in, &pos, &_offset[i]) || !getU64(in, &pos, &length)
+            || !getU64(in, &pos, &flag) || length > (uint64_t)_buffer_size
+            || in.size() - pos < length)
+            return false;
+        // Restored bytes live in the slot itself, whatever the reader
+        // pointed at when they were saved.
+        memcpy(_buffer[i], in.data() + pos, length);
+        pos += length;
+        _data[i] = _buffer[i];
+        _length[i] = length;
+        _buffer_print_flag[i] = flag;
+    }
+    return next < (uint64_t)_buffer_num && pos == in.size();
+}
+
+void RingBuffer::scanAll(int buffer_idx, const char *prev, int prev_length,
+                         Collector *collector)
+{
+    uint64_t offset = _offset[buffer_idx];
+    uint64_t end = offset + _length[buffer_idx];
+    uint64_t half = (uint64_t)(_buffer_num / 2) * _buffer_size;
+    _found.clear();
+    uint64_t match_start = Stats::now();
+    _target->scanAll(prev, prev_length, _data[buffer_idx], _length[buffer_idx],
+                     offset, &_found);
+    Stats::addTime(Stats::PHASE_MATCH, match_start);
+    for (size_t i = 0; i < _found.size(); ++i)
+    {
+        const Hit &hit = _found[i];
+        if (_hits != NULL)
+            _hits->push_back(hit);
+
+        uint64_t start = 0;
+        uint64_t stop = 0;
+        if (_byte_context)
+        {
+            start = hit.offset > _before ? hit.offset - _before : 0;
+            stop = hit.offset + hit.length + _after;
+        }
+        else
+        {
+            // Every hit ends in this slot; same window as a first hit.
+            start = offset > half ? offset - half : 0;
+            stop = offset + half;
+        }
+        Stats::addHit();
+        collector->matched(hit, start, stop);
+        if (_pending && start <= _window_end)
+        {
+            _window_end = std::max(_window_end, stop);
+            continue;
+        }
+        // Disjoint from the open window, which is therefore complete:
+        // it ends before this hit starts.
+        if (_pending)
+        {
+            collectRange(_window_start, _window_end, collector);
+            _scan_from = _window_end;
+        }
+        _window_start = std::max(start, _scan_from);
+        _window_end = stop;
+        _pending = true;
+    }
+
+    // Windows are written as the data arrives, so an open one only needs
+    // the ring to hold its not yet written part.
+    if (_pending)
+    {
+        uint64_t stop = std::min(_window_end, end);
+        collectRange(_window_start, stop, collector);
+        _window_start = _scan_from = std::max(_window_start, stop);
+        _pending = _window_start < _window_end;
+    }
+}
+
+void RingBuffer::scanBytes(int buffer_idx, const char *prev, int prev_length,
+                           Collector *collector)
+{
+    uint64_t offset = _offset[buffer_idx];
+    uint64_t end = offset + _length[buffer_idx];
+    for (;;)
+    {
+        if (_pending)
+        {
+            if (_window_end > end)
+                return;
+            collectRange(_window_start, _window_end, collector);
+            _pending = false;
+        }
+        Hit hit;
+        uint64_t match_start = Stats::now();
+        bool found = _target->scan(prev, prev_length, _data[buffer_idx], _length[buffer_idx],
+                                   offset, _scan_from, &hit);
+        Stats::addTime(Stats::PHASE_MATCH, match_start);
+        if (!found)
+            return;
+        Stats::addHit();
+        // Hits inside a window are not reported; a window starting inside
+        // the previous one only adds the bytes past it.
+        uint64_t start = hit.offset > _before ? hit.offset - _before : 0;
+        uint64_t stop = hit.offset + hit.length + _after;
+        collector->matched(hit, start, stop);
+        _window_start = std::max(start, _scan_from);
+        _window_end = stop;
+        _scan_from = _window_end;
+        _pending = true;
+    }
+}
+
+void RingBuffer::collectRange(uint64_t start, uint64_t end, Collector *collector) const
+{
+    // Oldest slot first; it is the one readFrom will overwrite next.
+    StatsTimer timer(Stats::PHASE_OUTPUT);
+    uint64_t window = collector->window() + 1;
+    Span span;
+    for (int n = 0; n < _buffer_num; ++n)
+    {
+        int i = (_next_buffer_idx + n) % _buffer_num;
+        uint64_t slot_start = std::max(start, _offset[i]);
+        uint64_t slot_end = std::min(end, _offset[i] + _length[i]);
+        if (slot_start < slot_end)
+        {
+            span.add(slot_start, _data[i] + (slot_start - _offset[i]),
+                     slot_end - slot_start, collector);
+            _pinned[i] = window;
+        }
+    }
+    span.flush(collector);
+    collector->flush();
+}
+
+// Records the hits of a bgrep::Scanner for test(), asking once for extra
+// context after each and stopping after stop_after of them.
+class TestHandler : public bgrep::HitHandler
+{
+public:
+    TestHandler(long more, size_t stop_after) : _more(more), _stop_after(stop_after)
+    { }
+    virtual long onHit(const bgrep::Hit &hit)
+    {
+        if (_more > 0 && (contexts.empty() || offsets.back() != hit.offset))
+        {
+            offsets.push_back(hit.offset);
+            contexts.push_back(std::string());
+            return _more;
+        }
+        if (contexts.empty() || offsets.back() != hit.offset)
+            offsets.push_back(hit.offset);
+        else
+            contexts.pop_back();
+        contexts.push_back(std::string(hit.context, hit.context_length));
+        return offsets.size() >= _stop_after ? kStop : kContinue;
+    }
+
+    std::vector<uint64_t> offsets;
+    std::vector<std::string> contexts;
+
+private:
+    long _more;
+    size_t _stop_after;
+};
+
+// FileReader over a string for test(), whose reads fail when they touch
+// a byte in bad.
+class TestRescueReader : public FileReader
+{
+public:
+    TestRescueReader(const std::string &data, const std::vector<uint64_t> &bad)
+            : reads(0), _data(data), _bad_bytes(bad)
+    { }
+    using FileReader::rescue;
+
+    size_t reads;
+
+protected:
+    virtual bool readAt(char *data, size_t length, uint64_t offset, size_t *done)
+    {
+        ++reads;
+        *done = 0;
+        for (size_t i = 0; i < _bad_bytes.size(); ++i)
+        {
+            if (_bad_bytes[i] >= offset && _bad_bytes[i] < offset + length)
+                return false;
+        }
+        *done = offset < _data.size() ? std::min((uint64_t)length, _data.size() - offset) : 0;
+        memcpy(data, _data.data() + offset, *done);
+        return true;
+    }
+
+private:
+    std::string _data;
+    std::vector<uint64_t> _bad_bytes;
+};
+
+int test()
+{
+#define TEST_ASSERT(x) \
+    if(!(x)) { fprintf(stderr, "assert failed %s:%d\n", __FILE__, __LINE__); return -1; } \
+    else { fprintf(stderr, "."); }
+    Target target;
+    target.addTarget("ab");
+    target.compile();
+    {
+        // An arena larger than any address space.
+        RingBuffer buffer(INT_MAX, INT_MAX, &target);
+        TEST_ASSERT(buffer.failed());
+    }
+    {
+        RingBuffer buffer(4, 4, &target);
+        TEST_ASSERT(!buffer.failed());
+        std::istringstream is("000011112222aaab3333bbbb4444cccc5555aaab666677778888");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "11112222aaab3333cccc5555aaab6666");
+    }
+    {
+        RingBuffer buffer(4, 4, &target);
+        std::istringstream is("000011112222aaab3333bbbbaaab666677778888");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "11112222aaab3333bbbbaaab6666");
+    }
+    {
+        RingBuffer buffer(4, 4, &target);
+        std::istringstream is("000011112222aaab3333bbbb4444cccc");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "11112222aaab3333");
+    }
+    {
+        RingBuffer buffer(4, 4, &target);
+        std::istringstream is("aaab0000111122223333bbbb4444cccc");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "aaab0000");
+    }
+    {
+        // Through the writer thread, with slots read into again copied or
+        // spilled while it may still be behind.
+        for (int policy = 0; policy < 2; ++policy)
+        {
+            RingBuffer buffer(4, 4, &target);
+            std::istringstream is("000011112222aaab3333bbbb4444cccc5555aaab666677778888");
+            std::ostringstream os;
+            StreamReader reader(&is);
+            StreamCollector out(&os);
+            AsyncCollector collector(&out, 4, policy == 0 ? AsyncCollector::POLICY_BLOCK
+                                                          : AsyncCollector::POLICY_SPILL);
+            while (buffer.readFrom(&reader, &collector))
+            { }
+            collector.drain();
+            TEST_ASSERT(!collector.failed());
+            TEST_ASSERT(os.str() == "11112222aaab3333cccc5555aaab6666");
+        }
+    }
+    {
+        RingBuffer buffer(4, 4, &target);
+        std::istringstream is("0000111122223333bbbb4444ccccaaab");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "4444ccccaaab");
+    }
+    {
+        RingBuffer buffer(4, 4, &target);
+        std::istringstream is("0000111122ab33");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "0000111122ab33");
+    }
+    {
+        RingBuffer buffer(4, 4, &target);
+        std::istringstream is("0000111ab22233334444555566667777");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "0000111ab2223333");
+    }
+    {
+        RingBuffer buffer(8, 4, &target);
+        buffer.setContext(3, 2);
+        std::istringstream is("000011112222aaab3333bbbbab44cccc5555");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "2aaab33bbbab44");
+    }
+    {
+        RingBuffer buffer(8, 4, &target);
+        std::vector<Hit> hits;
+        buffer.setContext(1, 1);
+        buffer.setReportAll(&hits);
+        std::istringstream is("0000abab1111ab2233334444");
+        std::ostringstream os;
+        StreamReader reader(&is);
+        StreamCollector collector(&os);
+        while (buffer.readFrom(&reader, &collector))
+        { }
+        TEST_ASSERT(os.str() == "0abab11ab2");
+        TEST_ASSERT(hits.size() == 3 && hits[1].offset == 6 && hits[2].offset == 12);
+    }
+    {
+        Target multi;
+        multi.addTarget("he");
+        multi.addTarget("she");
+        multi.addTarget("his");
+        multi.addTarget("hers");
+        multi.compile();
+        Match m;
+        TEST_ASSERT(multi.match("ushers", 6, &m) && m.offset == 1 && m.pattern == 1);
+        TEST_ASSERT(multi.match("xhisx", 5, &m) && m.offset == 1 && m.pattern == 2);
+        TEST_ASSERT(!multi.match("hxsxr", 5, &m));
+        TEST_ASSERT(multi.matchAcross("xxsh", 4, "ersx", 4, &m) && m.offset == 2 && m.pattern == 1);
+        TEST_ASSERT(!multi.matchAcross("xhis", 4, "xxxx", 4, &m));
+        std::vector<Hit> hits;
+        multi.scanAll("xxus", 4, "hers", 4, 100, &hits);
+        TEST_ASSERT(hits.size() == 3 && hits[0].offset == 99 && hits[0].pattern == 1
+                    && hits[1].offset == 100 && hits[2].offset == 100);
+
+        std::string saved;
+        multi.save(&saved);
+        Target loaded;
+        size_t pos = 0;
+        TEST_ASSERT(loaded.load(saved, &pos) && pos == saved.size() && loaded.size() == 4);
+        TEST_ASSERT(loaded.match("ushers", 6, &m) && m.offset == 1 && m.pattern == 1);
+        TEST_ASSERT(!loaded.load(saved.substr(0, saved.size() - 1), &(pos = 0)));
+    }
+    {
+        // A few literals, long and short, for the one-pass kernels.
+        Target few;
+        few.setFoldCase(true);
+        few.addTarget("Marker");
+        few.addTarget("arke");
+        few.addTarget("a-much-longer-marker");
+        few.compile();
+        std::string text(200, 'x');
+        text.replace(40, 20, "A-MUCH-LONGER-MARKER");
+        text.replace(150, 6, "mARKER");
+        Match m;
+        TEST_ASSERT(few.match(text.data(), text.size(), &m) && m.offset == 55 && m.pattern == 1);
+        TEST_ASSERT(few.match(text.data() + 60, 96, &m) && m.offset == 91 && m.pattern == 1);
+        std::vector<Hit> hits;
+        few.scanAll(NULL, 0, text.data(), text.size(), 0, &hits);
+        TEST_ASSERT(hits.size() == 5 && hits[0].offset == 40 && hits[0].pattern == 2
+                    && hits[1].offset == 54 && hits[4].offset == 151);
+    }
+    {
+        // The gram filter of large sets, on a few literals: the second
+        // "Seven" is a folded duplicate and never reported.
+        std::vector<std::string> literals;
+        literals.push_back("seven");
+        literals.push_back("eleven");
+        literals.push_back("Seven");
+        literals.push_back("even");
+        GramFilter filter;
+        TEST_ASSERT(filter.build(literals, true));
+        static const char text[] = "xx SEVEN eleven";
+        Match m;
+        TEST_ASSERT(filter.first(text, sizeof(text) - 1, &m) && m.offset == 3 && m.pattern == 0);
+        TEST_ASSERT(filter.first(text + 6, sizeof(text) - 7, &m) && m.offset == 3 && m.pattern == 1);
+        std::vector<Match> matches;
+        filter.all(text, sizeof(text) - 1, &matches);
+        TEST_ASSERT(matches.size() == 4 && matches[3].offset == 11 && matches[3].pattern == 3);
+        literals.push_back("x");
+        TEST_ASSERT(!filter.build(literals, true) && filter.size() == 0);
+    }
+    {
+        Target forms;
+        forms.setFoldCase(true);
+        forms.setEncodings(Target::ENCODING_RAW | Target::ENCODING_UTF16LE);
+        forms.addTarget("Key");
+        forms.compile();
+        Match m;
+        TEST_ASSERT(forms.match("a kEY", 5, &m) && m.offset == 2 && m.length == 3);
+        TEST_ASSERT(forms.match("xk\0e\0Y\0", 7, &m) && m.offset == 1 && m.length == 6);
+        TEST_ASSERT(!forms.match("k\0e\0x\0", 6, &m));
+    }
+    {
+        // Every byte value occurs, so none is left for a shared class.
+        Target bytes;
+        std::string all;
+        for (int c = 0; c < 256; ++c)
+            all += (char)c;
+        bytes.addTarget(all);
+        bytes.addTarget("\xff\xff");
+        // Enough patterns to be matched by the automaton.
+        for (char c = 'a'; c < 'a' + 8; ++c)
+            bytes.addTarget(std::string(2, c));
+        bytes.compile();
+        TEST_ASSERT(bytes.match("\xff\xff", 2) && !bytes.match("\0\0", 2));
+    }
+    {
+        Target regex;
+        std::string error;
+        TEST_ASSERT(regex.addRegex("a[0-9]+c", &error));
+        TEST_ASSERT(!regex.addRegex("x*", &error));
+        regex.compile();
+        Match m;
+        TEST_ASSERT(regex.match("xxa12cx", 7, &m) && m.offset == 2 && m.length == 4);
+        TEST_ASSERT(regex.matchAcross("xxa1", 4, "2cxx", 4, &m) && m.offset == 2 && m.length == 4);
+        TEST_ASSERT(!regex.match("xxacxx", 6, &m));
+    }
+    {
+        // Zero slots are skipped only when no pattern can match in them.
+        std::string zeros(4096 + 7, '\0');
+        TEST_ASSERT(LiteralScanner::isZero(zeros.data(), zeros.size()));
+        zeros[4096 + 3] = 1;
+        TEST_ASSERT(!LiteralScanner::isZero(zeros.data(), zeros.size()));
+        Target text, binary, regex;
+        std::string error;
+        text.addTarget("abc");
+        text.compile();
+        binary.addTarget(std::string("a\0", 2));
+        binary.compile();
+        TEST_ASSERT(regex.addRegex("ab.", &error));
+        regex.compile();
+        TEST_ASSERT(text.zeroFree() && !binary.zeroFree() && !regex.zeroFree());
+    }
+    {
+        int fds[2];
+        TEST_ASSERT(pipe(fds) == 0);
+        IndexCollector index(fds[1], IndexCollector::FORMAT_JSON);
+        index.setLimit(20);
+        Hit hit = { 12, 1, 3 };
+        index.matched(hit, 8, 24);
+        index.finish();
+        char line[128] = { 0 };
+        TEST_ASSERT(::read(fds[0], line, sizeof(line) - 1) > 0);
+        TEST_ASSERT(strcmp(line, "{\"offset\":12,\"pattern\":1,\"length\":3,\"context_start\":8,"
+                                 "\"context_length\":12}\n") == 0);
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+    {
+        // --extract keeps the records of the input it is given.
+        char path[] = "/tmp/bgrep-index-XXXXXX";
+        int fd = ::mkstemp(path);
+        TEST_ASSERT(fd >= 0);
+        static const char lines[] =
+            "{\"offset\":100,\"pattern\":0,\"length\":6,\"context_start\":96,"
+            "\"context_length\":14,\"source\":\"a\"}\n"
+            "{\"offset\":496,\"pattern\":0,\"length\":6,\"context_start\":492,"
+            "\"context_length\":14,\"source\":\"b\\\"\\u0001\"}\n";
+        TEST_ASSERT(::write(fd, lines, sizeof(lines) - 1) == (ssize_t)sizeof(lines) - 1);
+        ::close(fd);
+        std::vector<IndexRecord> records;
+        std::vector<std::string> sources;
+        TEST_ASSERT(readIndex(path, IndexCollector::FORMAT_JSON, &records, &sources));
+        ::unlink(path);
+        TEST_ASSERT(records.size() == 2 && sources[0] == "a" && sources[1] == "b\"\x01");
+        std::string error;
+        std::vector<IndexRecord> kept(records);
+        TEST_ASSERT(recordsFor("b\"\x01", IndexCollector::FORMAT_JSON, sources, &kept, &error));
+        TEST_ASSERT(kept.size() == 1 && kept[0].offset == 496);
+        kept = records;
+        TEST_ASSERT(!recordsFor("c", IndexCollector::FORMAT_JSON, sources, &kept, &error));
+
+        // Binary records only number their input.
+        sources[0] = "0";
+        sources[1] = "1";
+        TEST_ASSERT(!recordsFor("a", IndexCollector::FORMAT_BINARY, sources, &kept, &error));
+        sources[1] = "0";
+        TEST_ASSERT(recordsFor("a", IndexCollector::FORMAT_BINARY, sources, &kept, &error));
+    }
+    {
+        static const char text[] = "xxabcyyabczz";
+        bgrep::Scanner scanner;
+        scanner.addPattern("abc", 3);
+        scanner.compile();
+        scanner.setContext(1, 1);
+        TestHandler all(0, 10);
+        TEST_ASSERT(scanner.scan(text, sizeof(text) - 1, &all));
+        TEST_ASSERT(all.offsets.size() == 2 && all.offsets[1] == 7);
+        TEST_ASSERT(all.contexts[0] == "xabcy" && all.contexts[1] == "yabcz");
+        TestHandler first(0, 1);
+        TEST_ASSERT(!scanner.scan(text, sizeof(text) - 1, &first));
+        TEST_ASSERT(first.offsets.size() == 1);
+
+        // Fed a byte at a time, with more context asked for than is left
+        // for the second hit.
+        TestHandler more(4, 10);
+        scanner.reset(100);
+        for (size_t i = 0; i + 1 < sizeof(text); ++i)
+            TEST_ASSERT(scanner.feed(text + i, 1, &more));
+        TEST_ASSERT(scanner.finish(&more));
+        TEST_ASSERT(more.offsets.size() == 2 && more.offsets[0] == 102);
+        TEST_ASSERT(more.contexts[0] == "xabcyyab" && more.contexts[1] == "yabczz");
+    }
+    {
+        // Eight sectors, of which the third fails.
+        std::string data(4096, 'x');
+        std::vector<uint64_t> bad(1, 1100);
+        BadBlocks map;
+        TestRescueReader reader(data, bad);
+        reader.setRescue(&map, 2);
+        std::vector<char> out(4096, 'y');
+        TEST_ASSERT(reader.rescue(&out[0], 0, 4096) == 4096);
+        TEST_ASSERT(std::string(&out[0], 1024) == data.substr(0, 1024));
+        TEST_ASSERT(std::string(&out[1024], 512) == std::string(512, '\0'));
+        TEST_ASSERT(std::string(&out[1536], 2560) == data.substr(1536));
+        // Three failing reads pin down the sector, which is tried twice
+        // more; the three ranges around it are read whole.
+        TEST_ASSERT(reader.reads == 9);
+        uint64_t start = 0;
+        uint64_t end = 0;
+        TEST_ASSERT(map.next("", 0, &start, &end) && start == 1024 && end == 1536);
+        TEST_ASSERT(map.count() == 1 && map.bytes() == 512);
+
+        // Known bad sectors are not read again, and the end of input
+        // cuts the result short.
+        TestRescueReader again(data, bad);
+        again.setRescue(&map, 2);
+        TEST_ASSERT(again.rescue(&out[0], 1024, 512) == 512 && again.reads == 0);
+        TEST_ASSERT(again.rescue(&out[0], 3584, 1024) == 512);
+        map.add("", 1536, 2000);
+        map.add("", 100, 1024);
+        TEST_ASSERT(map.next("", 500, &start, &end) && start == 500 && end == 2000);
+        TEST_ASSERT(map.count() == 1 && !map.next("", 2000, &start, &end));
+    }
+    {
+        // A 100ms burst, then reads wait for the bytes of those before.
+        Throttle paced(10 * 1024 * 1024, 0, 0);
+        uint64_t start = Throttle::clock();
+        for (int i = 0; i < 4; ++i)
+            paced.acquire(1024 * 1024);
+        TEST_ASSERT(Throttle::clock() - start >= 150000000ULL);
+
+        // Slow reads halve the rate, fast ones raise it again.
+        Throttle adaptive(0, 0, 10000000);
+        for (int i = 0; i < 128; ++i)
+            adaptive.done(1024 * 1024, 1024 * 1024, 50000000);
+        uint64_t backed_off = adaptive.rate();
+        TEST_ASSERT(backed_off > 0);
+        for (int i = 0; i < 128; ++i)
+            adaptive.done(1024 * 1024, 1024 * 1024, 1000000);
+        TEST_ASSERT(adaptive.rate() > backed_off);
+    }
+    return 0;
+}
+
+// Throughput of the single-pass engine for every reader, pattern count,
+// slot size and collector over synthetic corpora of size bytes, both
+// reporting first hits (which skips scanning while a window is open) and
+// every hit. The corpora are kept in memory and written to tmpfs for the
+// file readers.
+class BenchCollector : public FdCollector
+{
+public:
+    BenchCollector(int fd)
+            : FdCollector(fd)
+    { }
+    virtual void matched(const Hit &, uint64_t, uint64_t)
+    { }
+};
+
+class NullCollector : public Collector
+{
+public:
+    virtual void collect(const char *, size_t)
+    { }
+    virtual void matched(const Hit &, uint64_t, uint64_t)
+    { }
+};
+
+static uint64_t benchRandom(uint64_t *state)
+{
+    // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void benchCorpus(const std::string &kind, size_t size, std::string *corpus)
+{
+    static const char *const words[] = {
+        "the", "of", "and", "disk", "sector", "block", "inode", "journal", "data",
+        "file", "partition", "record", "index", "header", "page", "offset"
+    };
+    const size_t word_num = sizeof(words) / sizeof(words[0]);
+    uint64_t state = 88172645463325252ULL;
+    corpus->clear();
+    corpus->reserve(size + 64);
+    if (kind == "random")
+    {
+        while (corpus->size() < size)
+        {
+            uint64_t value = benchRandom(&state);
+            corpus->append((const char *)&value, sizeof(value));
+        }
+    }
+    else if (kind == "low-entropy")
+    {
+        // Mostly zeroed blocks, the rest a handful of byte values.
+        while (corpus->size() < size)
+        {
+            uint64_t r = benchRandom(&state);
+            if (r % 10 < 7)
+            {
+                corpus->append(4096, '\0');
+                continue;
+            }
+            for (int i = 0; i < 4096; ++i)
+                corpus->push_back("\x00\x01\xff "[benchRandom(&state) % 4]);
+        }
+    }
+    else
+    {
+        // text, and hit-dense: text with the first pattern every ~512 bytes.
+        bool dense = kind == "hit-dense";
+        size_t next_hit = 512;
+        while (corpus->size() < size)
+        {
+            uint64_t r = benchRandom(&state);
+            corpus->append(words[r % word_num]);
+            corpus->push_back(r % 13 == 0 ? '\n' : ' ');
+            if (dense && corpus->size() >= next_hit)
+            {
+                corpus->append("needle ");
+                next_hit += 512;
+            }
+        }
+    }
+    corpus->resize(size);
+}
+
+static Reader *benchReader(const std::string &kind, const std::string &corpus,
+                           const std::string &path)
+{
+    if (kind == "memory")
+        return new MemoryReader(corpus.data(), corpus.size());
+    if (kind == "mmap")
+    {
+        MmapReader *mapped = new MmapReader();
+        if (mapped->open(path))
+            return mapped;
+        delete mapped;
+        return NULL;
+    }
+    if (kind == "uring")
+    {
+        UringReader *uring = new UringReader();
+        if (uring->open(path, false, FileReader::kDefaultIoSize, UringReader::kDefaultQueueDepth))
+            return uring;
+        delete uring;
+        return NULL;
+    }
+    FileReader *file = new FileReader();
+    if (file->open(path, kind == "direct", FileReader::kDefaultIoSize))
+        return file;
+    delete file;
+    return NULL;
+}
+
+int bench(uint64_t size)
+{
+    static const char *const corpora[] = { "random", "low-entropy", "text", "hit-dense" };
+    static const char *const readers[] = { "memory", "mmap", "buffered", "direct", "uring" };
+    static const size_t pattern_counts[] = { 1, 2, 16, 256, 16384 };
+    static const int slot_sizes[] = { 4096, 65536, 1024 * 1024 };
+    static const char *const collectors[] = { "null", "fd", "async", "index" };
+    static const char *const modes[] = { "first", "all" };
+    static const int kRuns = 2;
+
+    const char *dir = ::access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+    std::string path = std::string(dir) + "/bgrep-bench.XXXXXX";
+    int fd = ::mkstemp(&path[0]);
+    if (fd < 0)
+    {
+        perror("creating bench file failed");
+        return -1;
+    }
+    ::close(fd);
+    int null_fd = ::open("/dev/null", O_WRONLY);
+
+    printf("corpus\treader\tpatterns\tslot\tcollector\tmode\tGB/s\n");
+    std::string corpus;
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); ++c)
+    {
+        benchCorpus(corpora[c], size, &corpus);
+        std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+        file.write(corpus.data(), corpus.size());
+        file.close();
+
+        for (size_t n = 0; n < sizeof(pattern_counts) / sizeof(pattern_counts[0]); ++n)
+        {
+            // The first pattern is the one hit-dense plants; the others
+            // are random lowercase words that rarely occur.
+            Target target;
+            target.addTarget("needle");
+            uint64_t state = 2463534242ULL + n;
+            while (target.size() < pattern_counts[n])
+            {
+                std::string word;
+                size_t length = 6 + benchRandom(&state) % 5;
+                while (word.size() < length)
+                    word.push_back('a' + benchRandom(&state) % 26);
+                target.addTarget(word);
+            }
+            target.compile();
+
+            for (size_t r = 0; r < sizeof(readers) / sizeof(readers[0]); ++r)
+            for (size_t s = 0; s < sizeof(slot_sizes) / sizeof(slot_sizes[0]); ++s)
+            for (size_t k = 0; k < sizeof(collectors) / sizeof(collectors[0]); ++k)
+            for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+            {
+                double best = 0;
+                for (int run = 0; run < kRuns; ++run)
+                {
+                    Reader *reader = benchReader(readers[r], corpus, path);
+                    if (reader == NULL)
+                        break;
+                    Collector *collector = NULL;
+                    Collector *sink = NULL;
+                    if (strcmp(collectors[k], "fd") == 0)
+                        collector = new BenchCollector(null_fd);
+                    else if (strcmp(collectors[k], "async") == 0)
+                    {
+                        sink = new BenchCollector(null_fd);
+                        collector = new AsyncCollector(sink, 16 * 1024 * 1024,
+                                                       AsyncCollector::POLICY_BLOCK);
+                    }
+                    else if (strcmp(collectors[k], "index") == 0)
+                        collector = new IndexCollector(null_fd, IndexCollector::FORMAT_BINARY);
+                    else
+                        collector = new NullCollector();
+                    RingBuffer buffer(16, slot_sizes[s], &target);
+                    if (buffer.failed())
+                    {
+                        delete collector;
+                        delete sink;
+                        delete reader;
+                        break;
+                    }
+                    if (m == 1)
+                        buffer.setReportAll(NULL);
+                    struct timespec start, end;
+                    ::clock_gettime(CLOCK_MONOTONIC, &start);
+                    while (buffer.readFrom(reader, collector))
+                    { }
+                    delete collector;
+                    delete sink;
+                    ::clock_gettime(CLOCK_MONOTONIC, &end);
+                    delete reader;
+                    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+                    if (seconds > 0)
+                        best = std::max(best, size / seconds / 1e9);
+                }
+                // Direct I/O is not supported on tmpfs.
+                if (best == 0)
+                    printf("%s\t%s\t%zu\t%d\t%s\t%s\tn/a\n", corpora[c], readers[r],
+                           pattern_counts[n], slot_sizes[s], collectors[k], modes[m]);
+                else
+                    printf("%s\t%s\t%zu\t%d\t%s\t%s\t%.2f\n", corpora[c], readers[r],
+                           pattern_counts[n], slot_sizes[s], collectors[k], modes[m], best);
+                fflush(stdout);
+            }
+        }
+    }
+    ::close(null_fd);
+    ::unlink(path.c_str());
+    return 0;
+}
+
+// Command line settings for run().
+struct Options
+{
+    enum ReaderType { READER_AUTO, READER_MMAP, READER_DIRECT, READER_BUFFERED,
+                      READER_URING };
+    enum Blocks { BLOCKS_ALL, BLOCKS_USED, BLOCKS_FREE };
+
+    ReaderType reader;
+    size_t io_size;
+    unsigned queue_depth;
+    unsigned threads;
+    uint64_t shard_size;
+    int buffer_num;       // ring geometry
+    int buffer_size;
+    bool huge_pages;
+    bool all;             // report every hit
+    bool byte_context;    // -A/-B given
+    uint64_t before;
+    uint64_t after;
+    const char *index;    // write a match index here instead of context
+    IndexCollector::Format index_format;
+    bool index_hash;
+    const char *extract;  // index to fetch windows for, without scanning
+    uint64_t offset;      // scan [offset, offset + length) only
+    uint64_t length;      // 0: up to the end
+    const char *checkpoint;
+    uint64_t checkpoint_every;
+    unsigned progress;    // seconds between progress reports, 0: none
+    bool regex;           // marks are regular expressions
+    bool hex;             // marks are hex bytes, see parseHex
+    bool fold_case;       // ASCII letters match either case
+    unsigned encodings;   // Target::Encoding mask literals are searched in
+    std::vector<const char *> pattern_files; // more marks, one per line
+    const char *cache;    // compiled patterns are kept here between runs
+    std::vector<const char *> inputs; // --input paths, scanned instead of DEV
+    bool recursive;       // scan what is below directory inputs
+    bool decompress;      // -z: decompress gzip, BGZF, zstd and lz4 inputs
+    Blocks blocks;        // file system blocks to scan
+    HoleMap::Extents skipped; // left out by blocks, see loadBlockMap
+    size_t output_queue;  // context copied aside for the writer thread, 0: none
+    AsyncCollector::Policy output_full;
+    BadBlocks *bad_blocks; // --rescue: sectors that fail go here; NULL: errors end the input
+    unsigned retries;     // of a failing sector before it is recorded
+    Throttle *throttle;   // paces every read of the run; NULL: none
+    bool idle_io;         // --idle: read in the idle I/O scheduling class
+
+    Options()
+            : reader(READER_AUTO),
+              io_size(FileReader::kDefaultIoSize),
+              queue_depth(UringReader::kDefaultQueueDepth),
+              threads(1),
+              shard_size(256 * 1024 * 1024),
+              buffer_num(16),
+              buffer_size(4096),
+              huge_pages(false),
+              all(false),
+              byte_context(false),
+              before(0),
+              after(0),
+              index(NULL),
+              index_format(IndexCollector::FORMAT_JSON),
+              index_hash(false),
+              extract(NULL),
+              offset(0),
+              length(0),
+              checkpoint(NULL),
+              checkpoint_every(1024ULL * 1024 * 1024),
+              progress(0),
+              regex(false),
+              hex(false),
+              fold_case(false),
+              encodings(Target::ENCODING_RAW),
+              cache(NULL),
+              recursive(false),
+              decompress(false),
+              blocks(BLOCKS_ALL),
+              output_queue(16 * 1024 * 1024),
+              output_full(AsyncCollector::POLICY_BLOCK),
+              bad_blocks(NULL),
+              retries(1),
+              throttle(NULL),
+              idle_io(false)
+    { }
+};
+
+// Progress of a scan, written every checkpoint_every bytes so that the
+// same command started again continues where it stopped. It is only
+// replaced once the output before it is on disk.
+struct Checkpoint
+{
+    uint64_t fingerprint;       // of the options and patterns, see scanFingerprint
+    uint64_t offset;            // next byte to read, or next shard when sharded
+    int64_t output;             // output position matching this state, or -1
+    std::vector<uint64_t> counts; // --all hits per pattern before offset
+    std::string ring;           // RingBuffer::saveState of a single pass
+    // Merge state of a sharded scan, see runSharded.
+    uint64_t written;
+    uint64_t horizon;
+    bool open;
+    uint64_t open_start;
+    uint64_t open_end;
+
+    bool resumed;               // loaded from a previous run
+    uint64_t next_save;
+
+    Checkpoint()
+            : fingerprint(0), offset(0), output(-1), written(0), horizon(0),
+              open(false), open_start(0), open_end(0), resumed(false), next_save(0)
+    { }
+    bool save(const char *path) const;
+    bool load(const char *path);
+};
+
+static const char kCheckpointMagic[8] = { 'B', 'G', 'R', 'E', 'P', 'C', 'K', '1' };
+
+bool Checkpoint::save(const char *path) const
+{
+    std::string out(kCheckpointMagic, sizeof(kCheckpointMagic));
+    putU64(&out, fingerprint);
+    putU64(&out, offset);
+    putU64(&out, output);
+    putU64(&out, written);
+    putU64(&out, horizon);
+    putU64(&out, open);
+    putU64(&out, open_start);
+    putU64(&out, open_end);
+    putU64(&out, counts.size());
+    for (size_t i = 0; i < counts.size(); ++i)
+        putU64(&out, counts[i]);
+    putU64(&out, ring.size());
+    out += ring;
+    return replaceFile(path, out);
+}
+
+bool Checkpoint::load(const char *path)
+{
+    std::string in;
+    if (!readFile(path, &in) || in.size() < sizeof(kCheckpointMagic)
+        || memcmp(in.data(), kCheckpointMagic, sizeof(kCheckpointMagic)) != 0)
+        return false;
+    size_t pos = sizeof(kCheckpointMagic);
+    uint64_t value = 0;
+    uint64_t count = 0;
+    if (!getU64(in, &pos, &fingerprint) || !getU64(in, &pos, &offset)
+        || !getU64(in, &pos, &value))
+        return false;
+    output = value;
+    if (!getU64(in, &pos, &written) || !getU64(in, &pos, &horizon)
+        || !getU64(in, &pos, &value))
+        return false;
+    open = value != 0;
+    if (!getU64(in, &pos, &open_start) || !getU64(in, &pos, &open_end)
+        || !getU64(in, &pos, &count) || count > (in.size() - pos) / sizeof(uint64_t))
+        return false;
+    counts.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        getU64(in, &pos, &counts[i]);
+    if (!getU64(in, &pos, &count) || count != in.size() - pos)
+        return false;
+    ring.assign(in, pos, count);
+    resumed = true;
+    return true;
+}
+
+// Parses a byte count with an optional K/M/G suffix; counts that do not
+// fit in 64 bits are refused.
+static bool parseSize(const char *str, uint64_t *size)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0 || end == str)
+        return false;
+    int shift = 0;
+    switch (*end)
+    {
+    case 'G': case 'g': shift += 10;
+        // fall through
+    case 'M': case 'm': shift += 10;
+        // fall through
+    case 'K': case 'k': shift += 10; ++end;
+        break;
+    default: break;
+    }
+    if (*end != '\0' || value > UINT64_MAX >> shift)
+        return false;
+    *size = (uint64_t)value << shift;
+    return true;
+}
+
+// Parses a comma separated --encoding list into a Target::Encoding mask.
+static bool parseEncodings(const char *list, unsigned *encodings)
+{
+    std::stringstream stream(list);
+    std::string name;
+    *encodings = 0;
+    while (std::getline(stream, name, ','))
+    {
+        if (name == "raw")
+            *encodings |= Target::ENCODING_RAW;
+        else if (name == "utf16le")
+            *encodings |= Target::ENCODING_UTF16LE;
+        else if (name == "utf16be")
+            *encodings |= Target::ENCODING_UTF16BE;
+        else if (name == "utf16")
+            *encodings |= Target::ENCODING_UTF16LE | Target::ENCODING_UTF16BE;
+        else
+            return false;
+    }
+    return *encodings != 0;
+}
+
+// Decodes a hex mark such as "50 4b 03 04": pairs of hex digits, blanks
+// between bytes ignored, and "??" for any byte. A mark with wildcards
+// becomes a regular expression, one without the literal bytes.
+static bool parseHex(const std::string &mark, std::string *text, bool *regex,
+                     std::string *error)
+{
+    std::string bytes;
+    std::string expr;
+    *regex = false;
+    for (size_t i = 0; i < mark.size(); )
+    {
+        if (isspace((unsigned char)mark[i]))
+        {
+            ++i;
+            continue;
+        }
+        if (i + 1 >= mark.size())
+        {
+            *error = "odd number of hex digits";
+            return false;
+        }
+        if (mark[i] == '?' && mark[i + 1] == '?')
+        {
+            *regex = true;
+            expr += '.';
+            i += 2;
+            continue;
+        }
+        if (!isxdigit((unsigned char)mark[i]) || !isxdigit((unsigned char)mark[i + 1]))
+        {
+            *error = "expected hex digits or ??";
+            return false;
+        }
+        char digits[3] = { mark[i], mark[i + 1], 0 };
+        bytes += (char)strtoul(digits, NULL, 16);
+        expr += "\\x";
+        expr += digits;
+        i += 2;
+    }
+    if (expr.empty())
+    {
+        *error = "no bytes";
+        return false;
+    }
+    *text = *regex ? expr : bytes;
+    return true;
+}
+
+// Appends the marks in path, one per line. Blank lines and lines that
+// start with '#' are skipped; such marks can still be given in hex.
+static bool readPatterns(const char *path, std::vector<std::string> *marks)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if (!line.empty() && line[0] != '#')
+            marks->push_back(line);
+    }
+    return !file.bad();
+}
+
+static const char kCacheMagic[8] = { 'B', 'G', 'R', 'E', 'P', 'A', 'C', '2' };
+
+// Adds marks to target as options say and compiles it. With a pattern
+// cache holding exactly these patterns the compiled matchers are loaded
+// from it instead; otherwise they are built and the cache replaced.
+static bool buildTarget(const Options &options, const std::vector<std::string> &marks,
+                        Target *target)
+{
+    std::vector<std::string> texts;
+    std::vector<char> regexes;
+    for (size_t i = 0; i < marks.size(); ++i)
+    {
+        std::string text = marks[i];
+        bool regex = options.regex;
+        std::string error;
+        if (options.hex && !parseHex(marks[i], &text, &regex, &error))
+        {
+            fprintf(stderr, "bad pattern %s: %s\n", marks[i].c_str(), error.c_str());
+            return false;
+        }
+        if (text.empty())
+            continue;
+        texts.push_back(text);
+        regexes.push_back(regex);
+    }
+    std::string key;
+    putU64(&key, options.fold_case);
+    putU64(&key, options.encodings);
+    putU64(&key, texts.size());
+    for (size_t i = 0; i < texts.size(); ++i)
+    {
+        putU64(&key, regexes[i]);
+        putString(&key, texts[i]);
+    }
+    uint64_t fingerprint = fnv1a(kFnvBasis, key.data(), key.size());
+
+    if (options.cache != NULL)
+    {
+        std::string in;
+        size_t pos = sizeof(kCacheMagic);
+        uint64_t stored = 0;
+        uint64_t sum = 0;
+        bool ok = readFile(options.cache, &in) && in.size() >= pos
+                  && memcmp(in.data(), kCacheMagic, pos) == 0
+                  && getU64(in, &pos, &stored) && stored == fingerprint
+                  && getU64(in, &pos, &sum)
+                  && sum == checksum(in.data() + pos, in.size() - pos)
+                  && target->load(in, &pos) && pos == in.size()
+                  && target->size() == texts.size();
+        for (size_t i = 0; ok && i < texts.size(); ++i)
+            ok = target->getTarget(i) == texts[i] && target->isRegex(i) == (bool)regexes[i];
+        if (ok)
+            return true;
+        target->clear();
+    }
+
+    target->setFoldCase(options.fold_case);
+    target->setEncodings(options.encodings);
+    for (size_t i = 0; i < texts.size(); ++i)
+    {
+        std::string error;
+        if (!regexes[i])
+            target->addTarget(texts[i]);
+        else if (!target->addRegex(texts[i], &error))
+        {
+            fprintf(stderr, "bad pattern %s: %s\n", texts[i].c_str(), error.c_str());
+            return false;
+        }
+    }
+    target->compile();
+
+    if (options.cache != NULL)
+    {
+        std::string body;
+        target->save(&body);
+        std::string out(kCacheMagic, sizeof(kCacheMagic));
+        putU64(&out, fingerprint);
+        putU64(&out, checksum(body.data(), body.size()));
+        out += body;
+        if (!replaceFile(options.cache, out))
+            perror("writing pattern cache failed");
+    }
+    return true;
+}
+
+// Size of a regular file or block device, 0 for anything unseekable.
+static uint64_t inputSize(const char *path)
+{
+    struct stat st;
+    if (::stat(path, &st) != 0)
+        return 0;
+    if (S_ISREG(st.st_mode))
+        return st.st_size;
+    if (!S_ISBLK(st.st_mode))
+        return 0;
+    uint64_t size = 0;
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (::ioctl(fd, BLKGETSIZE64, &size) != 0)
+        size = 0;
+    ::close(fd);
+    return size;
+}
+
+static uint32_t le16(const unsigned char *p) { return p[0] | p[1] << 8; }
+static uint32_t le32(const unsigned char *p) { return le16(p) | (uint32_t)le16(p + 2) << 16; }
+static uint32_t be16(const unsigned char *p) { return p[0] << 8 | p[1]; }
+static uint32_t be32(const unsigned char *p) { return (uint32_t)be16(p) << 16 | be16(p + 2); }
+static uint64_t be64(const unsigned char *p) { return (uint64_t)be32(p) << 32 | be32(p + 4); }
+
+static bool preadAll(int fd, void *data, size_t length, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t ret = ::pread(fd, (char *)data + done, length - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        done += ret;
+    }
+    return true;
+}
+
+// The allocated blocks of an ext4 or XFS file system, from the block
+// bitmaps of ext4 or the free space B+trees of XFS, as byte ranges of
+// the device.
+class BlockMap
+{
+public:
+    BlockMap() : _fs_size(0), _type("unknown")
+    { }
+    bool read(const char *dev, std::string *error);
+    // What a scan of the allocated blocks, or with !used of the free
+    // ones, leaves out of [0, size). Space past the file system is free.
+    HoleMap::Extents skipped(bool used, uint64_t size) const;
+    const char *type() const { return _type; }
+    uint64_t usedBytes() const;
+
+private:
+    // Ext4 groups with more blocks than their bitmap holds are corrupt.
+    static const unsigned kExt4MaxLogBlock = 6;
+    static const unsigned kXfsMaxLevels = 8;
+
+    bool readExt4(int fd, const unsigned char *sb, std::string *error);
+    bool readXfs(int fd, const unsigned char *sb, std::string *error);
+    bool walkXfs(int fd, uint64_t ag_start, uint32_t agbno, unsigned level,
+                 std::vector<std::pair<uint32_t, uint32_t> > *free);
+    // Runs of set bits among the first count bits of bitmap, for blocks
+    // from first on.
+    void addBitmap(const unsigned char *bitmap, uint64_t count, uint64_t first);
+    void addUsed(uint64_t start, uint64_t end);
+
+    HoleMap::Extents _used;
+    uint64_t _fs_size;
+    uint64_t _block_size;
+    uint32_t _xfs_header;  // of B+tree blocks
+    uint64_t _xfs_visited;
+    const char *_type;
+};
+
+bool BlockMap::read(const char *dev, std::string *error)
+{
+    int fd = ::open(dev, O_RDONLY);
+    if (fd < 0)
+    {
+        *error = strerror(errno);
+        return false;
+    }
+    // The XFS superblock is at 0, the ext4 one at 1024.
+    unsigned char sb[2048];
+    bool ok = preadAll(fd, sb, sizeof(sb), 0);
+    if (!ok)
+        *error = "cannot read the superblock";
+    else if (memcmp(sb, "XFSB", 4) == 0)
+        ok = readXfs(fd, sb, error);
+    else if (le16(sb + 1024 + 56) == 0xef53)
+        ok = readExt4(fd, sb + 1024, error);
+    else
+    {
+        *error = "no ext4 or XFS file system found";
+        ok = false;
+    }
+    ::close(fd);
+    return ok;
+}
+
+void BlockMap::addUsed(uint64_t start, uint64_t end)
+{
+    if (!_used.empty() && _used.back().second == start)
+        _used.back().second = end;
+    else if (start < end)
+        _used.push_back(std::make_pair(start, end));
+}
+
+void BlockMap::addBitmap(const unsigned char *bitmap, uint64_t count, uint64_t first)
+{
+    bool in_run = false;
+    uint64_t run_start = 0;
+    for (uint64_t i = 0; i < count; )
+    {
+        unsigned char byte = bitmap[i >> 3];
+        bool set = (byte >> (i & 7)) & 1;
+        // Whole bytes of the same bit go at once.
+        uint64_t step = (i & 7) == 0 && i + 8 <= count && (byte == 0 || byte == 0xff) ? 8 : 1;
+        if (set != in_run)
+        {
+            if (in_run)
+                addUsed((first + run_start) * _block_size, (first + i) * _block_size);
+            run_start = i;
+            in_run = set;
+        }
+        i += step;
+    }
+    if (in_run)
+        addUsed((first + run_start) * _block_size, (first + count) * _block_size);
+}
+
+bool BlockMap::readExt4(int fd, const unsigned char *sb, std::string *error)
+{
+    static const uint32_t kIncompatMetaBg = 0x10;
+    static const uint32_t kIncompat64Bit = 0x80;
+    static const uint32_t kBlockUninit = 0x2;
+
+    _type = "ext4";
+    uint32_t log_block = le32(sb + 24);
+    uint32_t incompat = le32(sb + 96);
+    bool is64 = (incompat & kIncompat64Bit) != 0;
+    uint64_t first = le32(sb + 20);
+    uint64_t per_group = le32(sb + 32);
+    uint64_t blocks = le32(sb + 4) | (is64 ? (uint64_t)le32(sb + 0x150) << 32 : 0);
+    size_t desc_size = is64 ? std::max(32U, le16(sb + 254)) : 32;
+    if (log_block > kExt4MaxLogBlock)
+    {
+        *error = "bad ext4 block size";
+        return false;
+    }
+    _block_size = 1024 << log_block;
+    if (per_group == 0 || per_group > 8 * _block_size || blocks <= first)
+    {
+        *error = "bad ext4 superblock";
+        return false;
+    }
+    // With meta_bg the group descriptors are spread over the groups.
+    if ((incompat & kIncompatMetaBg) != 0)
+    {
+        *error = "ext4 with meta_bg is not supported";
+        return false;
+    }
+    _fs_size = blocks * _block_size;
+    uint64_t groups = (blocks - first + per_group - 1) / per_group;
+    std::vector<unsigned char> table(groups * desc_size);
+    std::vector<unsigned char> bitmap(_block_size);
+    if (!preadAll(fd, &table[0], table.size(), (first + 1) * _block_size))
+    {
+        *error = "cannot read the ext4 group descriptors";
+        return false;
+    }
+    // The boot block of file systems with 1K blocks.
+    addUsed(0, first * _block_size);
+    for (uint64_t group = 0; group < groups; ++group)
+    {
+        const unsigned char *desc = &table[group * desc_size];
+        uint64_t start = first + group * per_group;
+        uint64_t count = std::min(per_group, blocks - start);
+        // Groups whose bitmap was never written hold no data; only their
+        // metadata, which is not listed, is allocated.
+        if ((le16(desc + 0x12) & kBlockUninit) != 0)
+            continue;
+        uint64_t location = le32(desc) | (desc_size >= 64 ? (uint64_t)le32(desc + 0x20) << 32 : 0);
+        if (location >= blocks || !preadAll(fd, &bitmap[0], _block_size, location * _block_size))
+        {
+            *error = "cannot read the ext4 block bitmaps";
+            return false;
+        }
+        addBitmap(&bitmap[0], count, start);
+    }
+    return true;
+}
+
+bool BlockMap::walkXfs(int fd, uint64_t ag_start, uint32_t agbno, unsigned level,
+                       std::vector<std::pair<uint32_t, uint32_t> > *free)
+{
+    // Loops in a corrupt tree end once every block could have been seen.
+    if (_xfs_visited++ > _fs_size / _block_size)
+        return false;
+    std::vector<unsigned char> block(_block_size);
+    if (!preadAll(fd, &block[0], _block_size, (ag_start + agbno) * _block_size))
+        return false;
+    const unsigned char *magic = _xfs_header == 16 ? (const unsigned char *)"ABTB"
+                                                   : (const unsigned char *)"AB3B";
+    if (memcmp(&block[0], magic, 4) != 0 || be16(&block[4]) != level)
+        return false;
+    size_t records = be16(&block[6]);
+    const unsigned char *body = &block[_xfs_header];
+    if (level == 0)
+    {
+        if (records > (_block_size - _xfs_header) / 8)
+            return false;
+        for (size_t i = 0; i < records; ++i)
+            free->push_back(std::make_pair(be32(body + 8 * i), be32(body + 8 * i + 4)));
+        return true;
+    }
+    // Nodes hold all their keys first, and then the child pointers.
+    size_t max_records = (_block_size - _xfs_header) / 12;
+    if (records > max_records)
+        return false;
+    for (size_t i = 0; i < records; ++i)
+    {
+        if (!walkXfs(fd, ag_start, be32(body + 8 * max_records + 4 * i), level - 1, free))
+            return false;
+    }
+    return true;
+}
+
+bool BlockMap::readXfs(int fd, const unsigned char *sb, std::string *error)
+{
+    _type = "xfs";
+    _block_size = be32(sb + 4);
+    uint64_t blocks = be64(sb + 8);
+    uint64_t ag_blocks = be32(sb + 84);
+    uint32_t ag_count = be32(sb + 88);
+    uint32_t version = be16(sb + 100) & 0xf;
+    uint32_t sector = be16(sb + 102);
+    if (_block_size < 512 || _block_size > 65536 || (_block_size & (_block_size - 1)) != 0
+        || ag_blocks == 0 || ag_count == 0 || sector < 512 || sector > _block_size)
+    {
+        *error = "bad XFS superblock";
+        return false;
+    }
+    _fs_size = blocks * _block_size;
+    // Version 5 B+tree blocks carry a checksummed header.
+    _xfs_header = version == 5 ? 56 : 16;
+    _xfs_visited = 0;
+    std::vector<unsigned char> agf(sector);
+    for (uint32_t ag = 0; ag < ag_count; ++ag)
+    {
+        uint64_t ag_start = ag * ag_blocks;
+        if (!preadAll(fd, &agf[0], sector, ag_start * _block_size + sector)
+            || memcmp(&agf[0], "XAGF", 4) != 0)
+        {
+            *error = "cannot read an XFS AG header";
+            return false;
+        }
+        uint64_t length = be32(&agf[12]);
+        uint32_t root = be32(&agf[16]);     // of the by-block-number tree
+        uint32_t levels = be32(&agf[28]);
+        std::vector<std::pair<uint32_t, uint32_t> > free;
+        if (levels == 0 || levels > kXfsMaxLevels || length > ag_blocks
+            || !walkXfs(fd, ag_start, root, levels - 1, &free))
+        {
+            *error = "cannot read the XFS free space tree";
+            return false;
+        }
+        std::sort(free.begin(), free.end());
+        uint64_t used = 0;
+        for (size_t i = 0; i < free.size(); ++i)
+        {
+            uint64_t start = std::min((uint64_t)free[i].first, length);
+            addUsed((ag_start + used) * _block_size, (ag_start + std::max(used, start)) * _block_size);
+            used = std::max(used, std::min(length, start + free[i].second));
+        }
+        addUsed((ag_start + used) * _block_size, (ag_start + length) * _block_size);
+    }
+    return true;
+}
+
+HoleMap::Extents BlockMap::skipped(bool used, uint64_t size) const
+{
+    HoleMap::Extents skipped;
+    uint64_t pos = 0;
+    for (size_t i = 0; i < _used.size() && pos < size; ++i)
+    {
+        uint64_t start = std::min(_used[i].first, size);
+        uint64_t end = std::min(_used[i].second, size);
+        if (used && pos < start)
+            skipped.push_back(std::make_pair(pos, start));
+        else if (!used && start < end)
+            skipped.push_back(std::make_pair(start, end));
+        pos = end;
+    }
+    if (used && pos < size)
+        skipped.push_back(std::make_pair(pos, size));
+    return skipped;
+}
+
+uint64_t BlockMap::usedBytes() const
+{
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < _used.size(); ++i)
+        bytes += _used[i].second - _used[i].first;
+    return bytes;
+}
+
+// Fills options->skipped from the block map of the file system on its
+// input, for --blocks.
+static bool loadBlockMap(Options *options)
+{
+    const char *dev = options->inputs[0];
+    struct stat st;
+    if (options->inputs.size() != 1 || options->decompress || ::stat(dev, &st) != 0
+        || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+    {
+        fprintf(stderr, "--blocks takes a single device or image, without -z\n");
+        return false;
+    }
+    BlockMap map;
+    std::string error;
+    if (!map.read(dev, &error))
+    {
+        fprintf(stderr, "%s: %s\n", dev, error.c_str());
+        return false;
+    }
+    uint64_t size = inputSize(dev);
+    options->skipped = map.skipped(options->blocks == Options::BLOCKS_USED, size);
+    uint64_t skipped = 0;
+    for (size_t i = 0; i < options->skipped.size(); ++i)
+        skipped += options->skipped[i].second - options->skipped[i].first;
+    fprintf(stderr, "%s: %s, scanning %llu of %llu bytes\n", dev, map.type(),
+            (unsigned long long)(size - skipped), (unsigned long long)size);
+    return true;
+}
+
+// Whether dev is read through a DecompressReader with -z: compressed
+// files, and pipes and the like, which are sniffed as they are read.
+static bool isCompressed(const Options &options, const char *dev)
+{
+    if (!options.decompress)
+        return false;
+    struct stat st;
+    if (::stat(dev, &st) != 0)
+        return false;
+    if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode))
+        return true;
+    unsigned char header[16];
+    int fd = ::open(dev, O_RDONLY);
+    if (fd < 0)
+        return false;
+    ssize_t length = ::pread(fd, header, sizeof(header), 0);
+    ::close(fd);
+    return length > 0
+           && DecompressReader::detect(header, length) != DecompressReader::FORMAT_NONE;
+}
+
+static Reader *openInput(const Options &options, const char *dev)
+{
+    if (isCompressed(options, dev))
+    {
+        DecompressReader *decompress = new DecompressReader();
+        if (decompress->open(dev, options.threads))
+            return decompress;
+        delete decompress;
+        return NULL;
+    }
+
+    struct stat st;
+    bool is_blk = ::stat(dev, &st) == 0 && S_ISBLK(st.st_mode);
+    Options::ReaderType type = options.reader;
+    if (type == Options::READER_AUTO)
+    {
+        // Regular files are scanned through a mapping; block devices are
+        // read around the page cache and anything else, such as pipes,
+        // through it. A mapping cannot skip what fails to read, which
+        // raises SIGBUS, and its page faults cannot be paced.
+        if (::stat(dev, &st) == 0 && S_ISREG(st.st_mode) && options.bad_blocks == NULL
+            && options.throttle == NULL)
+            type = Options::READER_MMAP;
+        else if (is_blk)
+            type = Options::READER_DIRECT;
+        else
+            type = Options::READER_BUFFERED;
+    }
+
+    if (type == Options::READER_MMAP)
+    {
+        MmapReader *mapped = new MmapReader();
+        if (mapped->open(dev))
+            return mapped;
+        delete mapped;
+    }
+    else if (type == Options::READER_URING)
+    {
+        // Direct I/O keeps the queued reads off the page cache too.
+        UringReader *uring = new UringReader();
+        if (uring->open(dev, is_blk, options.io_size, options.queue_depth))
+        {
+            if (options.bad_blocks != NULL)
+                uring->setRescue(options.bad_blocks, options.retries);
+            return uring;
+        }
+        delete uring;
+        return NULL;
+    }
+    FileReader *file = new FileReader();
+    if (file->open(dev, type == Options::READER_DIRECT, options.io_size))
+    {
+        if (options.bad_blocks != NULL)
+            file->setRescue(options.bad_blocks, options.retries);
+        return file;
+    }
+    delete file;
+    return NULL;
+}
+
+// Puts the calling thread, and those it starts later, in the idle I/O
+// class: the device serves its reads only when nothing else wants it, as
+// far as the I/O scheduler (BFQ, or CFQ) goes. glibc has no wrapper.
+static bool setIdleIoPriority()
+{
+    static const int kWhoProcess = 1;     // IOPRIO_WHO_PROCESS
+    static const int kClassIdle = 3;      // IOPRIO_CLASS_IDLE
+    static const int kClassShift = 13;
+    return ::syscall(SYS_ioprio_set, kWhoProcess, 0, kClassIdle << kClassShift) == 0;
+}
+
+// Opens dev with the reader options asks for; NULL on failure.
+static Reader *openReader(const Options &options, const char *dev)
+{
+    Reader *reader = openInput(options, dev);
+    if (reader != NULL && ((!options.skipped.empty() && !reader->setSkipped(options.skipped))
+                           || (options.throttle != NULL && !reader->setThrottle(options.throttle))))
+    {
+        delete reader;
+        reader = NULL;
+    }
+    return reader;
+}
+
+// Identifies the scan a checkpoint belongs to: everything that changes
+// what is written, or the state the checkpoint holds.
+static uint64_t scanFingerprint(const Options &options, const Target *target, bool sharded)
+{
+    std::string key;
+    putU64(&key, target->size());
+    for (size_t i = 0; i < target->size(); ++i)
+    {
+        putU64(&key, target->getTarget(i).size());
+        key += target->getTarget(i);
+        putU64(&key, target->isRegex(i));
+    }
+    putU64(&key, options.buffer_num);
+    putU64(&key, options.buffer_size);
+    putU64(&key, options.byte_context);
+    putU64(&key, options.before);
+    putU64(&key, options.after);
+    putU64(&key, options.all);
+    putU64(&key, options.regex);
+    putU64(&key, options.fold_case);
+    putU64(&key, options.encodings);
+    putU64(&key, options.index != NULL);
+    putU64(&key, options.offset);
+    putU64(&key, options.length);
+    putU64(&key, sharded ? options.shard_size : 0);
+    return fnv1a(kFnvBasis, key.data(), key.size());
+}
+
+// Writes checkpoint once the collector's output up to it is durable.
+// Its counts stay those from before this run; hits add the rest.
+static void writeCheckpoint(const Options &options, Checkpoint *checkpoint,
+                            Collector *collector, const std::vector<Hit> *hits)
+{
+    checkpoint->output = collector->sync();
+    std::vector<uint64_t> before(checkpoint->counts);
+    for (size_t i = 0; i < hits->size(); ++i)
+        ++checkpoint->counts[(*hits)[i].pattern];
+    if (!checkpoint->save(options.checkpoint))
+        perror("writing checkpoint failed");
+    checkpoint->counts.swap(before);
+    checkpoint->next_save += options.checkpoint_every;
+}
+
+// Appends the hits of input dev in [start, end) to hits. Scanning
+// starts one buffer early unless start is begin, the start of the
+// range the input is scanned from, for hits that start in the buffer
+// before start and end in the first one. buffers holds two buffers.
+// If the input ends first and eof is given, it is set to its size.
+static bool scanRange(const Options &options, const char *dev, const Target *target,
+                      uint64_t begin, uint64_t start, uint64_t end,
+                      std::vector<char> *buffers, std::vector<Hit> *hits,
+                      uint64_t *eof = NULL)
+{
+    // Views may land in the buffer passed in, and the previous one is
+    // needed for hits across buffers, so alternate between two.
+    const int buffer_size = options.buffer_size;
+    buffers->resize(2 * buffer_size);
+    Reader *reader = openReader(options, dev);
+    uint64_t lead = start > begin ? buffer_size : 0;
+    // Pipes can only be read from the start.
+    bool ok = reader != NULL
+              && ((start == 0 && end == UINT64_MAX) || reader->setRange(start - lead, end));
+    const char *prev = NULL;
+    int prev_len = 0;
+    uint64_t prev_offset = start - lead;
+    uint64_t from = 0;
+    for (int turn = 0; ok; turn ^= 1)
+    {
+        uint64_t offset = reader->tell();
+        const char *data = NULL;
+        uint64_t read_start = Stats::now();
+        int nread = reader->view(&(*buffers)[turn * buffer_size], buffer_size, &data);
+        Stats::addTime(Stats::PHASE_READ, read_start);
+        if (nread <= 0)
+        {
+            ok = nread == 0;
+            if (ok && eof != NULL)
+                *eof = offset;
+            break;
+        }
+        reader->release(prev_offset);
+        if (offset >= start)
+            Stats::addBytes(nread);
+        StatsTimer timer(Stats::PHASE_MATCH);
+        Hit hit;
+        if (options.all)
+        {
+            if (offset >= start)
+                target->scanAll(prev, prev_len, data, nread, offset, hits);
+        }
+        else while (offset >= start
+               && target->scan(prev, prev_len, data, nread, offset, from, &hit))
+        {
+            hits->push_back(hit);
+            if (!options.byte_context)
+                break;
+            from = hit.offset + 1;
+        }
+        prev = data;
+        prev_len = nread;
+        prev_offset = offset;
+    }
+    delete reader;
+    return ok;
+}
+
+// Work shared by the threads of a sharded scan. Workers claim shards in
+// order and record the hits RingBuffer could act on (all of them with
+// --all); run() replays those in source order through the same
+// windowing RingBuffer applies, so the output is what a single pass
+// would write.
+//
+// With whole-slot context that is the first hit of every matching
+// buffer. With byte context it is the chain where each hit is the first
+// one starting after the previous hit's start: wherever a window ends,
+// the next hit RingBuffer would find is the first of the chain past it.
+struct ShardScan
+{
+    const Options *options;
+    const char *dev;
+    const Target *target;
+    uint64_t begin;                     // range scanned, see --offset
+    uint64_t size;
+    uint64_t shard_size;
+    size_t shard_num;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next_shard;                  // next shard to claim
+    size_t merged;                      // shards written so far
+    std::vector<std::vector<Hit> > hits;
+    std::vector<char> done;
+    bool failed;
+};
+
+static void *scanShards(void *arg)
+{
+    ShardScan *scan = (ShardScan *)arg;
+    std::vector<char> buffers;
+    for (;;)
+    {
+        pthread_mutex_lock(&scan->lock);
+        // Do not run too far ahead of the writer.
+        while (scan->next_shard < scan->shard_num
+               && scan->next_shard >= scan->merged + 2 * scan->options->threads)
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        size_t shard = scan->next_shard;
+        if (shard < scan->shard_num)
+            ++scan->next_shard;
+        pthread_mutex_unlock(&scan->lock);
+        if (shard >= scan->shard_num)
+            break;
+
+        uint64_t start = scan->begin + shard * scan->shard_size;
+        uint64_t end = std::min(scan->size, start + scan->shard_size);
+        std::vector<Hit> hits;
+        bool ok = scanRange(*scan->options, scan->dev, scan->target, scan->begin, start, end,
+                            &buffers, &hits);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->failed = scan->failed || !ok;
+        scan->hits[shard].swap(hits);
+        scan->done[shard] = 1;
+        pthread_cond_broadcast(&scan->cond);
+        pthread_mutex_unlock(&scan->lock);
+    }
+    return NULL;
+}
+
+// Writes source bytes [start, end) of fd to collector.
+static bool copyRange(int fd, uint64_t start, uint64_t end, Collector *collector)
+{
+    static const size_t kCopySize = 1024 * 1024;
+    StatsTimer timer(Stats::PHASE_OUTPUT);
+    if (end > start && collector->collectFrom(fd, start, end - start))
+        return true;
+    std::vector<char> buffer(std::min((uint64_t)kCopySize, end > start ? end - start : 0));
+    for (uint64_t pos = start; pos < end; pos += kCopySize)
+    {
+        size_t len = std::min((uint64_t)kCopySize, end - pos);
+        if (::pread(fd, &buffer[0], len, pos) != (ssize_t)len)
+            return false;
+        collector->collectAt(pos, &buffer[0], len);
+        collector->flush();
+        collector->waitWritten(collector->window());
+    }
+    return true;
+}
+
+// Writes the context windows of hits found out of band, in offset
+// order, reading them back from fd so windows straddling shards come
+// out whole. The windows, and the hits skipped inside them, are those
+// RingBuffer would have produced on a single pass.
+class WindowWriter
+{
+public:
+    // Windows are clipped to [begin, size) of the input.
+    WindowWriter(const Options &options, int fd, uint64_t begin, uint64_t size,
+                 Collector *collector, std::vector<Hit> *all_hits);
+
+    bool add(const Hit &hit);
+    // Writes the window still open with --all.
+    bool finish();
+    // Merge state, see Checkpoint.
+    void save(Checkpoint *checkpoint) const;
+    void load(const Checkpoint &checkpoint);
+
+private:
+    const Options &_options;
+    int _fd;
+    uint64_t _size;
+    Collector *_collector;
+    std::vector<Hit> *_all_hits;
+    // RingBuffer emits half a ring before and after the matching buffer,
+    // or the requested bytes around the hit, and ignores matches until
+    // that window is written.
+    uint64_t _half;
+    uint64_t _horizon;
+    uint64_t _written;
+    // With --all, windows are merged like RingBuffer::scanAll does.
+    bool _open;
+    uint64_t _open_start;
+    uint64_t _open_end;
+};
+
+WindowWriter::WindowWriter(const Options &options, int fd, uint64_t begin, uint64_t size,
+                           Collector *collector, std::vector<Hit> *all_hits)
+        : _options(options),
+          _fd(fd),
+          _size(size),
+          _collector(collector),
+          _all_hits(all_hits),
+          _half((uint64_t)(options.buffer_num / 2) * options.buffer_size),
+          _horizon(0),
+          _written(begin),
+          _open(false),
+          _open_start(0),
+          _open_end(0)
+{ }
+
+bool WindowWriter::add(const Hit &hit)
+{
+    const uint64_t buffer_size = _options.buffer_size;
+    uint64_t hit_end = hit.offset + hit.length;
+    uint64_t slot = (hit_end - 1) - (hit_end - 1) % buffer_size;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    if (_options.all)
+    {
+        _all_hits->push_back(hit);
+        start = _options.byte_context ? (hit.offset > _options.before ? hit.offset - _options.before : 0)
+                                      : (slot > _half ? slot - _half : 0);
+        end = _options.byte_context ? hit_end + _options.after : slot + _half;
+        Stats::addHit();
+        _collector->matched(hit, start, end);
+        if (_open && start <= _open_end)
+        {
+            _open_end = std::max(_open_end, end);
+            return true;
+        }
+        bool ok = finish();
+        _open = true;
+        _open_start = start;
+        _open_end = end;
+        return ok;
+    }
+    if (_options.byte_context)
+    {
+        if (hit.offset < _horizon)
+            return true;
+        start = hit.offset > _options.before ? hit.offset - _options.before : 0;
+        end = hit_end + _options.after;
+    }
+    else
+    {
+        if (slot < _horizon)
+            return true;
+        start = slot > _half ? slot - _half : 0;
+        end = slot + _half;
+    }
+    _horizon = end;
+    Stats::addHit();
+    _collector->matched(hit, start, end);
+    start = std::max(start, _written);
+    end = std::min(end, _size);
+    _written = std::max(_written, end);
+    return copyRange(_fd, start, end, _collector);
+}
+
+bool WindowWriter::finish()
+{
+    if (!_open)
+        return true;
+    _open = false;
+    uint64_t end = std::min(_open_end, _size);
+    bool ok = copyRange(_fd, std::max(_open_start, _written), end, _collector);
+    _written = std::max(_written, end);
+    return ok;
+}
+
+void WindowWriter::save(Checkpoint *checkpoint) const
+{
+    checkpoint->written = _written;
+    checkpoint->horizon = _horizon;
+    checkpoint->open = _open;
+    checkpoint->open_start = _open_start;
+    checkpoint->open_end = _open_end;
+}
+
+void WindowWriter::load(const Checkpoint &checkpoint)
+{
+    _written = checkpoint.written;
+    _horizon = checkpoint.horizon;
+    _open = checkpoint.open;
+    _open_start = checkpoint.open_start;
+    _open_end = checkpoint.open_end;
+}
+
+// Splits [0, size) into shards scanned by options.threads workers and
+// writes their windows in order.
+static int runSharded(const Options &options, const char *dev, uint64_t size,
+                      const Target *target, Collector *collector,
+                      std::vector<Hit> *all_hits, Checkpoint *checkpoint)
+{
+    int fd = ::open(dev, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("open file failed");
+        return -1;
+    }
+
+    ShardScan scan;
+    scan.options = &options;
+    scan.dev = dev;
+    scan.target = target;
+    scan.begin = std::min(options.offset, size);
+    scan.size = options.length > 0 ? std::min(size, scan.begin + options.length) : size;
+    size = scan.size;
+    // Shards start on a buffer boundary so buffers line up with the ones
+    // a single pass would read.
+    const uint64_t buffer_size = options.buffer_size;
+    scan.shard_size = std::max(buffer_size, options.shard_size - options.shard_size % buffer_size);
+    scan.shard_num = (size - scan.begin + scan.shard_size - 1) / scan.shard_size;
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+    // A checkpoint is taken between shards.
+    size_t first = 0;
+    if (checkpoint != NULL && checkpoint->resumed)
+        first = std::min(scan.shard_num, (checkpoint->offset - scan.begin) / scan.shard_size);
+    scan.next_shard = first;
+    scan.merged = first;
+    scan.hits.resize(scan.shard_num);
+    scan.done.assign(scan.shard_num, 0);
+    scan.failed = false;
+
+    std::vector<pthread_t> threads(std::min((size_t)options.threads, scan.shard_num));
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_create(&threads[i], NULL, scanShards, &scan);
+
+    WindowWriter writer(options, fd, scan.begin, size, collector, all_hits);
+    if (checkpoint != NULL && checkpoint->resumed)
+        writer.load(*checkpoint);
+    bool ok = true;
+    for (size_t shard = first; shard < scan.shard_num; ++shard)
+    {
+        std::vector<Hit> hits;
+        pthread_mutex_lock(&scan.lock);
+        while (!scan.done[shard])
+            pthread_cond_wait(&scan.cond, &scan.lock);
+        hits.swap(scan.hits[shard]);
+        pthread_mutex_unlock(&scan.lock);
+
+        for (size_t i = 0; i < hits.size() && ok; ++i)
+            ok = writer.add(hits[i]);
+        if (ok && shard + 1 == scan.shard_num)
+            ok = writer.finish();
+
+        uint64_t shard_end = scan.begin + (shard + 1) * scan.shard_size;
+        if (checkpoint != NULL && ok && shard + 1 < scan.shard_num
+            && shard_end >= checkpoint->next_save)
+        {
+            checkpoint->offset = shard_end;
+            writer.save(checkpoint);
+            writeCheckpoint(options, checkpoint, collector, all_hits);
+        }
+
+        pthread_mutex_lock(&scan.lock);
+        ++scan.merged;
+        pthread_cond_broadcast(&scan.cond);
+        pthread_mutex_unlock(&scan.lock);
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&scan.cond);
+    pthread_mutex_destroy(&scan.lock);
+    ::close(fd);
+    if (scan.failed || !ok)
+    {
+        fprintf(stderr, "reading %s failed\n", dev);
+        return -1;
+    }
+    return 0;
+}
+
+// One input of a multi-input scan.
+struct ScanInput
+{
+    static const uint64_t kUnknownSize = UINT64_MAX;
+
+    std::string path;
+    uint64_t size;              // kUnknownSize: read up to the end
+};
+
+// Adds path to inputs, and with recursive what is below it if it is a
+// directory. Entries are visited in name order and symbolic links below
+// the top are not followed, so each file is seen once.
+static bool listInputs(const std::string &path, bool top, bool recursive,
+                       std::vector<ScanInput> *inputs)
+{
+    struct stat st;
+    if ((top ? ::stat(path.c_str(), &st) : ::lstat(path.c_str(), &st)) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        if (!recursive)
+        {
+            fprintf(stderr, "%s is a directory, use -r to scan what is below it\n",
+                    path.c_str());
+            return false;
+        }
+        DIR *dir = ::opendir(path.c_str());
+        if (dir == NULL)
+        {
+            fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        std::vector<std::string> names;
+        for (struct dirent *entry = ::readdir(dir); entry != NULL; entry = ::readdir(dir))
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                names.push_back(entry->d_name);
+        ::closedir(dir);
+        std::sort(names.begin(), names.end());
+        // Unreadable entries are reported and skipped.
+        std::string prefix = path[path.size() - 1] == '/' ? path : path + "/";
+        for (size_t i = 0; i < names.size(); ++i)
+            listInputs(prefix + names[i], false, recursive, inputs);
+        return true;
+    }
+    ScanInput input;
+    input.path = path;
+    if (S_ISREG(st.st_mode))
+        input.size = st.st_size;
+    else if (S_ISBLK(st.st_mode))
+        input.size = inputSize(path.c_str());
+    else if (top && S_ISCHR(st.st_mode))
+        input.size = ScanInput::kUnknownSize;
+    else if (top)
+    {
+        // Windows are read back with pread after the scan.
+        fprintf(stderr, "%s cannot be scanned along with other inputs\n", path.c_str());
+        return false;
+    }
+    else
+        return true;
+    if (input.size > 0)
+        inputs->push_back(input);
+    return true;
+}
+
+// A range of one input, scanned by a worker in one go.
+struct ScanPiece
+{
+    size_t input;
+    uint64_t start;
+    uint64_t end;
+    const std::string *path;
+};
+
+// Scan of several inputs on options.threads workers. Large inputs are
+// split into shards and small ones batched, one task each; tasks are
+// dealt out to per-worker deques, taking turns between inputs so every
+// device has reads in flight, and a worker out of work steals from the
+// back of the others'. Pieces are numbered in input and offset order,
+// which is the order the main thread writes them in.
+struct PoolScan
+{
+    // At most this many small inputs go into one task.
+    static const size_t kBatchInputs = 64;
+
+    const Options *options;
+    const Target *target;
+    std::vector<ScanInput> *inputs;
+    std::vector<ScanPiece> pieces;
+    std::vector<std::vector<size_t> > tasks;    // piece numbers
+    std::vector<std::deque<size_t> > queues;    // task numbers, per worker
+    std::vector<pthread_mutex_t> queue_locks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::vector<std::vector<Hit> > hits;
+    std::vector<char> done;
+    std::vector<char> failed;
+};
+
+struct PoolWorker
+{
+    PoolScan *scan;
+    size_t index;
+};
+
+// Splits the inputs into pieces and tasks and deals the tasks out.
+static void planPool(PoolScan *scan, size_t workers)
+{
+    const Options &options = *scan->options;
+    const std::vector<ScanInput> &inputs = *scan->inputs;
+    const uint64_t buffer_size = options.buffer_size;
+    const uint64_t shard_size = std::max(buffer_size,
+                                         options.shard_size - options.shard_size % buffer_size);
+    // Tasks of each large input, and the batches of small ones.
+    std::vector<std::vector<size_t> > per_input;
+    std::vector<size_t> batches;
+    uint64_t batch_bytes = 0;
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        ScanPiece piece;
+        piece.input = i;
+        piece.path = &inputs[i].path;
+        if (inputs[i].size != ScanInput::kUnknownSize && inputs[i].size < shard_size)
+        {
+            if (batches.empty() || batch_bytes >= shard_size
+                || scan->tasks[batches.back()].size() >= PoolScan::kBatchInputs)
+            {
+                batches.push_back(scan->tasks.size());
+                scan->tasks.push_back(std::vector<size_t>());
+                batch_bytes = 0;
+            }
+            piece.start = 0;
+            piece.end = inputs[i].size;
+            batch_bytes += inputs[i].size;
+            scan->tasks[batches.back()].push_back(scan->pieces.size());
+            scan->pieces.push_back(piece);
+            continue;
+        }
+        // Devices of unknown size are scanned in one piece.
+        per_input.push_back(std::vector<size_t>());
+        uint64_t size = inputs[i].size;
+        uint64_t step = size == ScanInput::kUnknownSize ? size : shard_size;
+        for (uint64_t start = 0; start < size; start += std::min(step, size - start))
+        {
+            piece.start = start;
+            piece.end = step == size ? size : std::min(size, start + step);
+            per_input.back().push_back(scan->tasks.size());
+            scan->tasks.push_back(std::vector<size_t>(1, scan->pieces.size()));
+            scan->pieces.push_back(piece);
+        }
+    }
+    per_input.push_back(batches);
+
+    scan->queues.resize(workers);
+    size_t dealt = 0;
+    for (size_t round = 0; dealt < scan->tasks.size(); ++round)
+    {
+        for (size_t i = 0; i < per_input.size(); ++i)
+        {
+            if (round < per_input[i].size())
+                scan->queues[dealt++ % workers].push_back(per_input[i][round]);
+        }
+    }
+}
+
+// Takes a task from the worker's own deque, or steals one.
+static bool takeTask(PoolScan *scan, size_t worker, size_t *task)
+{
+    size_t workers = scan->queues.size();
+    for (size_t i = 0; i < workers; ++i)
+    {
+        size_t victim = (worker + i) % workers;
+        pthread_mutex_lock(&scan->queue_locks[victim]);
+        std::deque<size_t> &queue = scan->queues[victim];
+        bool found = !queue.empty();
+        if (found && i == 0)
+        {
+            *task = queue.front();
+            queue.pop_front();
+        }
+        else if (found)
+        {
+            *task = queue.back();
+            queue.pop_back();
+        }
+        pthread_mutex_unlock(&scan->queue_locks[victim]);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+static void *scanPool(void *arg)
+{
+    PoolWorker *worker = (PoolWorker *)arg;
+    PoolScan *scan = worker->scan;
+    std::vector<char> buffers;
+    size_t task = 0;
+    while (takeTask(scan, worker->index, &task))
+    {
+        for (size_t i = 0; i < scan->tasks[task].size(); ++i)
+        {
+            size_t number = scan->tasks[task][i];
+            ScanPiece &piece = scan->pieces[number];
+            ScanInput &input = (*scan->inputs)[piece.input];
+            std::vector<Hit> hits;
+            uint64_t eof = ScanInput::kUnknownSize;
+            bool ok = scanRange(*scan->options, piece.path->c_str(), scan->target, 0,
+                                piece.start, piece.end, &buffers, &hits, &eof);
+
+            pthread_mutex_lock(&scan->lock);
+            // Only a piece read to the end tells the size of the input.
+            if (input.size == ScanInput::kUnknownSize)
+                input.size = eof;
+            scan->failed[number] = !ok;
+            scan->hits[number].swap(hits);
+            scan->done[number] = 1;
+            pthread_cond_broadcast(&scan->cond);
+            pthread_mutex_unlock(&scan->lock);
+        }
+    }
+    return NULL;
+}
+
+// Scans inputs on a pool of workers and writes each one's windows, in
+// input order, tagging hits with the input they are in.
+static int runPool(const Options &options, std::vector<ScanInput> *inputs,
+                   const Target *target, Collector *collector, IndexCollector *index,
+                   std::vector<Hit> *all_hits)
+{
+    PoolScan scan;
+    scan.options = &options;
+    scan.target = target;
+    scan.inputs = inputs;
+    size_t workers = std::max((size_t)1, (size_t)options.threads);
+    planPool(&scan, workers);
+    scan.queue_locks.resize(workers);
+    for (size_t i = 0; i < workers; ++i)
+        pthread_mutex_init(&scan.queue_locks[i], NULL);
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+    scan.hits.resize(scan.pieces.size());
+    scan.done.assign(scan.pieces.size(), 0);
+    scan.failed.assign(scan.pieces.size(), 0);
+
+    std::vector<PoolWorker> pool(std::min(workers, scan.tasks.size()));
+    std::vector<pthread_t> threads(pool.size());
+    for (size_t i = 0; i < pool.size(); ++i)
+    {
+        pool[i].scan = &scan;
+        pool[i].index = i;
+        pthread_create(&threads[i], NULL, scanPool, &pool[i]);
+    }
+
+    int ret = 0;
+    int fd = -1;
+    bool ok = true;
+    WindowWriter *writer = NULL;
+    for (size_t number = 0; number < scan.pieces.size(); ++number)
+    {
+        const ScanPiece &piece = scan.pieces[number];
+        std::vector<Hit> hits;
+        bool failed = false;
+        uint64_t size = 0;
+        pthread_mutex_lock(&scan.lock);
+        while (!scan.done[number])
+            pthread_cond_wait(&scan.cond, &scan.lock);
+        hits.swap(scan.hits[number]);
+        failed = scan.failed[number];
+        size = (*inputs)[piece.input].size;
+        pthread_mutex_unlock(&scan.lock);
+
+        const char *path = piece.path->c_str();
+        if (piece.start == 0)
+        {
+            ok = true;
+            fd = ::open(path, O_RDONLY);
+            if (fd < 0)
+                ok = false;
+            collector->setInput(*piece.path, piece.input);
+            if (index != NULL)
+            {
+                index->setLimit(size);
+                if (options.index_hash)
+                    index->setSource(fd);
+            }
+            writer = new WindowWriter(options, fd, 0, size, collector, all_hits);
+        }
+        ok = ok && !failed;
+        for (size_t i = 0; i < hits.size() && ok; ++i)
+            ok = writer->add(hits[i]);
+        bool last = number + 1 == scan.pieces.size() || scan.pieces[number + 1].start == 0;
+        if (last)
+        {
+            ok = ok && writer->finish();
+            if (!ok)
+            {
+                fprintf(stderr, "reading %s failed\n", path);
+                ret = -1;
+            }
+            delete writer;
+            writer = NULL;
+            if (index != NULL)
+                index->setSource(-1);
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&scan.cond);
+    pthread_mutex_destroy(&scan.lock);
+    for (size_t i = 0; i < workers; ++i)
+        pthread_mutex_destroy(&scan.queue_locks[i]);
+    return ret;
+}
+
+static int scan(const Options &options, const char *dev, const Target *target,
+                Collector *collector, std::vector<Hit> *hits, Checkpoint *checkpoint);
+
+// Opens the --index output, NULL if it cannot be opened.
+static IndexCollector *openIndex(const Options &options, int *index_fd)
+{
+    *index_fd = strcmp(options.index, "-") == 0
+                ? STDOUT_FILENO
+                : ::open(options.index, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (*index_fd < 0)
+    {
+        perror("open index failed");
+        return NULL;
+    }
+    return new IndexCollector(*index_fd, options.index_format);
+}
+
+// The --all summary of hits per mark.
+static void printCounts(const Target &target, const std::vector<uint64_t> &saved,
+                        const std::vector<Hit> &hits)
+{
+    std::vector<uint64_t> counts(target.size(), 0);
+    if (!saved.empty())
+        counts = saved;
+    for (size_t i = 0; i < hits.size(); ++i)
+        ++counts[hits[i].pattern];
+    for (size_t i = 0; i < counts.size(); ++i)
+        fprintf(stderr, "mark %zu: %llu hits\n", i, (unsigned long long)counts[i]);
+}
+
+// Scans several inputs, or the files below directories, on a pool.
+static int runInputs(const Options &options, const Target &target)
+{
+    if (options.checkpoint != NULL || options.offset > 0 || options.length > 0
+        || options.decompress)
+    {
+        fprintf(stderr, "--checkpoint, --offset, --length and -z take a single input\n");
+        return -1;
+    }
+    int ret = 0;
+    std::vector<ScanInput> inputs;
+    for (size_t i = 0; i < options.inputs.size(); ++i)
+    {
+        if (!listInputs(options.inputs[i], true, options.recursive, &inputs))
+            ret = -1;
+    }
+    if (ret != 0)
+        return ret;
+
+    FdCollector output(STDOUT_FILENO);
+    Collector *collector = &output;
+    AsyncCollector *async = NULL;
+    IndexCollector *index = NULL;
+    int index_fd = -1;
+    if (options.index != NULL)
+    {
+        index = openIndex(options, &index_fd);
+        if (index == NULL)
+            return -1;
+        collector = index;
+    }
+    else if (options.output_queue > 0)
+    {
+        async = new AsyncCollector(&output, options.output_queue, options.output_full);
+        collector = async;
+    }
+    if (options.progress > 0)
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < inputs.size(); ++i)
+        {
+            if (inputs[i].size != ScanInput::kUnknownSize)
+                total += inputs[i].size;
+        }
+        Stats::enable();
+        Stats::start(total, options.progress);
+    }
+    std::vector<Hit> hits;
+    ret = runPool(options, &inputs, &target, collector, index, &hits);
+    if (async != NULL)
+        async->drain();
+    output.flush();
+    if (options.progress > 0)
+        Stats::stop();
+    if (index != NULL)
+        index->finish();
+    if (collector->failed())
+    {
+        fprintf(stderr, "writing output failed\n");
+        ret = -1;
+    }
+    delete async;
+    delete index;
+    if (index_fd >= 0 && index_fd != STDOUT_FILENO)
+        ::close(index_fd);
+    if (options.all)
+        printCounts(target, std::vector<uint64_t>(), hits);
+    return ret;
+}
+
+int run(const Options &options, const std::vector<std::string> &marks)
+{
+    Target target;
+    if (!buildTarget(options, marks, &target))
+        return -1;
+    if (options.bad_blocks != NULL && !target.zeroFree())
+        fprintf(stderr, "bad sectors read as zeros, which these marks can match\n");
+    // Threads started from here on inherit the class.
+    if (options.idle_io && !setIdleIoPriority())
+        perror("setting the idle I/O class failed");
+
+    const char *dev = options.inputs[0];
+    struct stat st;
+    if (options.inputs.size() > 1 || (::stat(dev, &st) == 0 && S_ISDIR(st.st_mode)))
+        return runInputs(options, target);
+
+    // Decompressed data is read once, in order: its size is not known up
+    // front and it cannot be sharded or read back for --index-hash.
+    bool compressed = isCompressed(options, dev);
+    if (compressed && options.index_hash)
+    {
+        fprintf(stderr, "--index-hash cannot read windows back from compressed input\n");
+        return -1;
+    }
+    // Left out blocks read as zeros, which must not match.
+    if (!options.skipped.empty() && !target.zeroFree())
+    {
+        fprintf(stderr, "--blocks cannot be used with marks that match zero bytes\n");
+        return -1;
+    }
+    uint64_t size = compressed ? 0 : inputSize(dev);
+    FdCollector output(STDOUT_FILENO);
+    Collector *collector = &output;
+    AsyncCollector *async = NULL;
+    IndexCollector *index = NULL;
+    int index_fd = -1;
+    int source_fd = -1;
+    if (options.index != NULL)
+    {
+        index = openIndex(options, &index_fd);
+        if (index == NULL)
+            return -1;
+        uint64_t limit = size;
+        if (options.length > 0)
+            limit = std::min(size > 0 ? size : UINT64_MAX, options.offset + options.length);
+        index->setLimit(limit);
+        if (options.index_hash)
+        {
+            source_fd = ::open(dev, O_RDONLY);
+            if (source_fd >= 0)
+                index->setSource(source_fd);
+        }
+        collector = index;
+    }
+    else if (options.output_queue > 0)
+    {
+        async = new AsyncCollector(&output, options.output_queue, options.output_full);
+        collector = async;
+    }
+    std::vector<Hit> hits;
+
+    int ret = 0;
+    bool sharded = options.threads > 1 && size > 0;
+    Checkpoint checkpoint;
+    Checkpoint *progress = NULL;
+    if (options.checkpoint != NULL)
+    {
+        progress = &checkpoint;
+        checkpoint.fingerprint = scanFingerprint(options, &target, sharded);
+        checkpoint.counts.assign(target.size(), 0);
+        if (::access(options.checkpoint, F_OK) == 0)
+        {
+            Checkpoint saved;
+            if (!saved.load(options.checkpoint) || saved.fingerprint != checkpoint.fingerprint
+                || saved.counts.size() != target.size())
+            {
+                fprintf(stderr, "checkpoint %s does not match this scan\n", options.checkpoint);
+                ret = -1;
+            }
+            else
+            {
+                checkpoint = saved;
+                // Output past the checkpoint is written again, so drop it
+                // where the output allows.
+                if (checkpoint.output < 0 || !collector->rewind(checkpoint.output))
+                    fprintf(stderr, "output cannot be rewound, it may repeat what "
+                            "followed the checkpoint\n");
+                fprintf(stderr, "resuming at %llu\n", (unsigned long long)checkpoint.offset);
+            }
+        }
+        checkpoint.next_save = (checkpoint.resumed ? checkpoint.offset : options.offset)
+                               + options.checkpoint_every;
+    }
+
+    if (options.progress > 0)
+    {
+        // The device size comes from BLKGETSIZE64 for block devices.
+        uint64_t begin = checkpoint.resumed ? checkpoint.offset : options.offset;
+        uint64_t end = size;
+        if (options.length > 0)
+            end = std::min(size > 0 ? size : UINT64_MAX, options.offset + options.length);
+        Stats::enable();
+        Stats::start(end > begin ? end - begin : 0, options.progress);
+    }
+    if (ret == 0 && sharded)
+        ret = runSharded(options, dev, size, &target, collector, &hits, progress);
+    else if (ret == 0)
+        ret = scan(options, dev, &target, collector, &hits, progress);
+    if (async != NULL)
+        async->drain();
+    output.flush();
+    if (options.progress > 0)
+        Stats::stop();
+    if (index != NULL)
+        index->finish();
+    if (collector->failed())
+    {
+        fprintf(stderr, "writing output failed\n");
+        ret = -1;
+    }
+    delete async;
+    delete index;
+    if (source_fd >= 0)
+        ::close(source_fd);
+    if (index_fd >= 0 && index_fd != STDOUT_FILENO)
+        ::close(index_fd);
+
+    // A finished scan has nothing to resume.
+    if (ret == 0 && progress != NULL)
+        ::unlink(options.checkpoint);
+
+    if (options.all)
+        printCounts(target, progress != NULL ? checkpoint.counts : std::vector<uint64_t>(),
+                    hits);
+    return ret;
+}
+
+// Single-threaded scan of dev.
+static int scan(const Options &options, const char *dev, const Target *target,
+                Collector *collector, std::vector<Hit> *hits, Checkpoint *checkpoint)
+{
+    Reader *reader = openReader(options, dev);
+    if (reader == NULL)
+    {
+        perror("open file failed");
+        return -1;
+    }
+
+    int buffer_num = options.buffer_num;
+    if (options.byte_context)
+    {
+        uint64_t span = options.before + target->maxLength() + options.after;
+        uint64_t needed = (span + options.buffer_size - 1) / options.buffer_size + 3;
+        // The same bound as --slots; span itself may have wrapped too.
+        if (needed > 65536 || span < options.before || span < options.after)
+        {
+            fprintf(stderr, "context does not fit in 65536 slots of %d bytes\n",
+                    options.buffer_size);
+            delete reader;
+            return -1;
+        }
+        buffer_num = std::max((uint64_t)buffer_num, needed);
+    }
+    RingBuffer buffer(buffer_num, options.buffer_size, target, options.huge_pages);
+    if (buffer.failed())
+    {
+        fprintf(stderr, "cannot map a ring of %d slots of %d bytes: %s\n", buffer_num,
+                options.buffer_size, strerror(errno));
+        delete reader;
+        return -1;
+    }
+    if (options.byte_context)
+        buffer.setContext(options.before, options.after);
+    if (options.all)
+        buffer.setReportAll(hits);
+
+    uint64_t start = options.offset;
+    uint64_t end = options.length > 0 ? options.offset + options.length : UINT64_MAX;
+    if (checkpoint != NULL && checkpoint->resumed)
+    {
+        if (!buffer.loadState(checkpoint->ring))
+        {
+            fprintf(stderr, "checkpoint %s does not match this scan\n", options.checkpoint);
+            delete reader;
+            return -1;
+        }
+        start = checkpoint->offset;
+    }
+    // Pipes can only be read from the start.
+    if ((start > 0 || end < UINT64_MAX) && !reader->setRange(start, end))
+    {
+        fprintf(stderr, "cannot seek in %s\n", dev);
+        delete reader;
+        return -1;
+    }
+    while (buffer.readFrom(reader, collector))
+    {
+        if (checkpoint != NULL && reader->tell() >= checkpoint->next_save)
+        {
+            checkpoint->offset = reader->tell();
+            checkpoint->ring.clear();
+            buffer.saveState(&checkpoint->ring);
+            writeCheckpoint(options, checkpoint, collector, hits);
+        }
+    }
+    // The last windows may still point into the ring and the reader.
+    collector->waitWritten(collector->window());
+    delete reader;
+    if (buffer.readFailed())
+    {
+        fprintf(stderr, "reading %s failed\n", dev);
+        return -1;
+    }
+    return 0;
+}
+
+// Writes the context windows of an index without scanning dev. Windows
+// are sorted and merged like a scan would write them, and windows close
+// to each other are fetched with one pread.
+static int extract(const Options &options, const char *dev)
+{
+    static const uint64_t kBatchGap = 64 * 1024;
+    static const uint64_t kBatchSize = 4 * 1024 * 1024;
+
+    std::vector<IndexRecord> records;
+    std::vector<std::string> sources;
+    if (!readIndex(options.extract, options.index_format, &records, &sources))
+    {
+        fprintf(stderr, "reading index %s failed\n", options.extract);
+        return -1;
+    }
+    std::string error;
+    if (!recordsFor(dev, options.index_format, sources, &records, &error))
+    {
+        fprintf(stderr, "%s: %s\n", options.extract, error.c_str());
+        return -1;
+    }
+
+    // -A/-B replace the windows the index was written with.
+    uint64_t size = inputSize(dev);
+    std::vector<std::pair<uint64_t, uint64_t> > windows;
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        const IndexRecord &record = records[i];
+        uint64_t start = record.context_start;
+        uint64_t end = record.context_start + record.context_length;
+        if (options.byte_context)
+        {
+            start = record.offset > options.before ? record.offset - options.before : 0;
+            end = record.offset + record.length + options.after;
+        }
+        if (size > 0)
+            end = std::min(end, size);
+        if (start < end)
+            windows.push_back(std::make_pair(start, end));
     }
-    for (int i = 0; i < start; ++i)
+    std::sort(windows.begin(), windows.end());
+    std::vector<std::pair<uint64_t, uint64_t> > merged;
+    for (size_t i = 0; i < windows.size(); ++i)
     {
-        if (_buffer_print_flag[i] == 0)
+        if (!merged.empty() && windows[i].first <= merged.back().second)
+            merged.back().second = std::max(merged.back().second, windows[i].second);
+        else
+            merged.push_back(windows[i]);
+    }
+
+    int fd = ::open(dev, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("open file failed");
+        return -1;
+    }
+    FdCollector output(STDOUT_FILENO);
+    std::vector<char> buffer;
+    bool ok = true;
+    for (size_t i = 0; i < merged.size() && ok; )
+    {
+        uint64_t start = merged[i].first;
+        // Large windows are copied in pieces; a pipe takes them by splice.
+        if (merged[i].second - start > kBatchSize)
         {
-            collector->collect(_buffer[i], _buffer_size);
-            _buffer_print_flag[i] = 1;
+            ok = copyRange(fd, start, merged[i].second, &output);
+            ++i;
+            continue;
+        }
+        if (output.collectFrom(fd, start, merged[i].second - start))
+        {
+            ++i;
+            continue;
         }
+        size_t j = i + 1;
+        while (j < merged.size() && merged[j].first - merged[j - 1].second <= kBatchGap
+               && merged[j].second - start <= kBatchSize)
+            ++j;
+        uint64_t end = merged[j - 1].second;
+        buffer.resize(end - start);
+        uint64_t got = 0;
+        while (got < end - start)
+        {
+            ssize_t ret = ::pread(fd, &buffer[got], end - start - got, start + got);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                break;
+            got += ret;
+        }
+        ok = got == end - start || size == 0;
+        for (; i < j && ok; ++i)
+        {
+            uint64_t stop = std::min(merged[i].second, start + got);
+            if (merged[i].first < stop)
+                output.collectAt(merged[i].first, &buffer[merged[i].first - start],
+                                 stop - merged[i].first);
+        }
+        // The whole batch goes out with one writev.
+        output.flush();
+    }
+    output.flush();
+    ::close(fd);
+    if (!ok)
+    {
+        fprintf(stderr, "reading %s failed\n", dev);
+        return -1;
+    }
+    if (output.failed())
+    {
+        fprintf(stderr, "writing output failed\n");
+        return -1;
     }
+    return 0;
 }
 
-int test()
+// The embedding interface of bgrep.h.
+namespace bgrep
 {
-#define TEST_ASSERT(x) \
-    if(!(x)) { fprintf(stderr, "assert failed %s:%d\n", __FILE__, __LINE__); return -1; } \
-    else { fprintf(stderr, "."); }
-    Target target;
-    target.addTarget("ab");
+
+struct Scanner::Impl
+{
+    // Input is matched in blocks of at most this size.
+    static const size_t kBlockSize = 256 * 1024;
+
+    // A hit waiting for the context after it.
+    struct Pending
     {
-        RingBuffer buffer(4, 4, &target);
-        std::istringstream is("000011112222aaab3333bbbb4444cccc5555aaab666677778888");
-        std::ostringstream os;
-        StreamReader reader(&is);
-        StreamCollector collector(&os);
-        while (buffer.readFrom(&reader, &collector))
-        { }
-        TEST_ASSERT(os.str() == "11112222aaab3333cccc5555aaab6666");
-    }
+        ::Hit hit;
+        uint64_t want_end;
+    };
+
+    Impl() : compiled(false), before(0), after(0), base(0), pending_head(0)
+    { }
+    void prepare();
+    // Scans block, the input at offset following prev, for new pending hits.
+    void find(const char *prev, size_t prev_len, const char *block, size_t length,
+              uint64_t offset);
+    // Reports the pending hits whose context is in data, the input from
+    // data_offset on, or all of them if final. False if stopped.
+    bool deliver(HitHandler *handler, const char *data, uint64_t data_offset, size_t length,
+                 bool final);
+
+    Target target;
+    bool compiled;
+    std::string error;
+    size_t before;
+    size_t after;
+
+    // Stream state: history holds input from base on.
+    std::vector<char> history;
+    uint64_t base;
+    std::vector< ::Hit> hits;
+    std::vector<Pending> pending;
+    size_t pending_head;
+};
+
+// std::min takes them by reference.
+const size_t Scanner::kMaxContext;
+const size_t Scanner::Impl::kBlockSize;
+
+void Scanner::Impl::prepare()
+{
+    if (!compiled)
+        target.compile();
+    compiled = true;
+}
+
+void Scanner::Impl::find(const char *prev, size_t prev_len, const char *block, size_t length,
+                         uint64_t offset)
+{
+    hits.clear();
+    target.scanAll(prev, prev_len, block, length, offset, &hits);
+    for (size_t i = 0; i < hits.size(); ++i)
     {
-        RingBuffer buffer(4, 4, &target);
-        std::istringstream is("000011112222aaab3333bbbbaaab666677778888");
-        std::ostringstream os;
-        StreamReader reader(&is);
-        StreamCollector collector(&os);
-        while (buffer.readFrom(&reader, &collector))
-        { }
-        TEST_ASSERT(os.str() == "11112222aaab3333bbbbaaab6666");
+        Pending waiting;
+        waiting.hit = hits[i];
+        waiting.want_end = hits[i].offset + hits[i].length + after;
+        pending.push_back(waiting);
     }
+}
+
+bool Scanner::Impl::deliver(HitHandler *handler, const char *data, uint64_t data_offset,
+                            size_t length, bool final)
+{
+    uint64_t data_end = data_offset + length;
+    while (pending_head < pending.size())
     {
-        RingBuffer buffer(4, 4, &target);
-        std::istringstream is("000011112222aaab3333bbbb4444cccc");
-        std::ostringstream os;
-        StreamReader reader(&is);
-        StreamCollector collector(&os);
-        while (buffer.readFrom(&reader, &collector))
-        { }
-        TEST_ASSERT(os.str() == "11112222aaab3333");
+        Pending &waiting = pending[pending_head];
+        if (!final && waiting.want_end > data_end)
+            return true;
+        const ::Hit &found = waiting.hit;
+        uint64_t start = found.offset > before ? found.offset - before : 0;
+        start = std::max(start, data_offset);
+        uint64_t end = std::min(waiting.want_end, data_end);
+        Hit hit;
+        hit.offset = found.offset;
+        hit.pattern = found.pattern;
+        hit.length = found.length;
+        hit.context_offset = start;
+        hit.context = data + (start - data_offset);
+        hit.context_length = end - start;
+        long more = handler->onHit(hit);
+        if (more < 0)
+        {
+            pending.clear();
+            pending_head = 0;
+            return false;
+        }
+        uint64_t want_end = std::min(found.offset + found.length + more, start + kMaxContext);
+        if (more > 0 && want_end > end && (!final || end < data_end))
+        {
+            // Called again once the context is there, or at the end of
+            // the input if it comes first.
+            waiting.want_end = want_end;
+            continue;
+        }
+        ++pending_head;
     }
+    pending.clear();
+    pending_head = 0;
+    return true;
+}
+
+Scanner::Scanner()
+        : _impl(new Impl)
+{ }
+
+Scanner::~Scanner()
+{
+    delete _impl;
+}
+
+void Scanner::setFoldCase(bool fold_case)
+{
+    _impl->target.setFoldCase(fold_case);
+}
+
+void Scanner::addPattern(const char *data, size_t length)
+{
+    _impl->target.addTarget(std::string(data, length));
+    _impl->compiled = false;
+}
+
+bool Scanner::addRegex(const char *expr)
+{
+    _impl->compiled = false;
+    return _impl->target.addRegex(expr, &_impl->error);
+}
+
+void Scanner::compile()
+{
+    _impl->compiled = false;
+    _impl->prepare();
+}
+
+void Scanner::setContext(size_t before, size_t after)
+{
+    _impl->before = std::min(before, kMaxContext);
+    _impl->after = std::min(after, kMaxContext);
+}
+
+const char *Scanner::error() const
+{
+    return _impl->error.c_str();
+}
+
+bool Scanner::scan(const char *data, size_t length, HitHandler *handler)
+{
+    _impl->prepare();
+    _impl->pending.clear();
+    _impl->pending_head = 0;
+    for (size_t pos = 0; pos < length; pos += Impl::kBlockSize)
     {
-        RingBuffer buffer(4, 4, &target);
-        std::istringstream is("aaab0000111122223333bbbb4444cccc");
-        std::ostringstream os;
-        StreamReader reader(&is);
-        StreamCollector collector(&os);
-        while (buffer.readFrom(&reader, &collector))
-        { }
-        TEST_ASSERT(os.str() == "aaab0000");
+        size_t block = std::min(Impl::kBlockSize, length - pos);
+        _impl->find(data, pos, data + pos, block, pos);
+        // The whole input is at hand, so every hit goes out right away.
+        if (!_impl->deliver(handler, data, 0, length, true))
+            return false;
     }
+    return true;
+}
+
+void Scanner::reset(uint64_t offset)
+{
+    _impl->history.clear();
+    _impl->base = offset;
+    _impl->pending.clear();
+    _impl->pending_head = 0;
+}
+
+bool Scanner::feed(const char *data, size_t length, HitHandler *handler)
+{
+    Impl &impl = *_impl;
+    impl.prepare();
+    std::vector<char> &history = impl.history;
+    for (size_t pos = 0; pos < length; )
     {
-        RingBuffer buffer(4, 4, &target);
-        std::istringstream is("0000111122223333bbbb4444ccccaaab");
-        std::ostringstream os;
-        StreamReader reader(&is);
-        StreamCollector collector(&os);
-        while (buffer.readFrom(&reader, &collector))
-        { }
-        fprintf(stdout, "%s\n", os.str().c_str());
-        TEST_ASSERT(os.str() == "aaab0000");
+        size_t block = std::min(Impl::kBlockSize, length - pos);
+        uint64_t offset = impl.base + history.size();
+        impl.find(history.empty() ? NULL : &history[0], history.size(), data + pos, block,
+                  offset);
+        history.insert(history.end(), data + pos, data + pos + block);
+        pos += block;
+        if (!impl.deliver(handler, &history[0], impl.base, history.size(), false))
+            return false;
+
+        // Keep what later hits may start in or show before them, and the
+        // context of those still waiting.
+        uint64_t end = impl.base + history.size();
+        uint64_t keep = impl.before + impl.target.maxLength();
+        uint64_t keep_from = end > keep ? end - keep : 0;
+        if (impl.pending_head < impl.pending.size())
+        {
+            const ::Hit &first = impl.pending[impl.pending_head].hit;
+            keep_from = std::min(keep_from, first.offset > impl.before ? first.offset - impl.before : 0);
+        }
+        // Trimmed a block at a time, as the bytes are moved down.
+        if (keep_from > impl.base && keep_from - impl.base >= Impl::kBlockSize)
+        {
+            history.erase(history.begin(), history.begin() + (keep_from - impl.base));
+            impl.base = keep_from;
+        }
     }
-    return 0;
+    return true;
 }
 
-int run(const char *dev, int argc, const char *argv[])
+bool Scanner::finish(HitHandler *handler)
 {
-    std::ifstream is(dev);
-    if (!is.is_open())
-    {
-        perror("open file failed");
+    Impl &impl = *_impl;
+    bool ok = impl.deliver(handler, impl.history.empty() ? NULL : &impl.history[0], impl.base,
+                           impl.history.size(), true);
+    reset(impl.base + impl.history.size());
+    return ok;
+}
+
+int Scanner::scanFile(const char *path, HitHandler *handler)
+{
+    static const size_t kViewSize = 1024 * 1024;
+    Options options;
+    Reader *reader = openReader(options, path);
+    if (reader == NULL)
         return -1;
+    reset(0);
+    std::vector<char> buffer(kViewSize);
+    int ret = 0;
+    for (;;)
+    {
+        const char *data = NULL;
+        int nread = reader->view(&buffer[0], buffer.size(), &data);
+        if (nread < 0)
+            ret = -1;
+        if (nread <= 0)
+            break;
+        bool more = feed(data, nread, handler);
+        // The bytes were copied, so the view can go.
+        reader->release(reader->tell());
+        if (!more)
+        {
+            ret = 1;
+            break;
+        }
     }
-    Target target;
-    for (int i = 0; i < argc; ++i)
-        target.addTarget(argv[i]);
-    
-    RingBuffer buffer(16, 4096, &target);
+    delete reader;
+    if (ret == 0 && !finish(handler))
+        ret = 1;
+    return ret;
+}
 
-    StreamReader reader(&is);
-    StreamCollector collector(&std::cout);
-    while (buffer.readFrom(&reader, &collector))
-    { }
-    return 0;
 }
 
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options] /dev/sda mark...\n"
+           "       %s [options] --input=PATH... mark...\n"
+           "  -E, --regex     marks are regular expressions: \\xHH escapes, '.', [...],\n"
+           "                  (...), '|', ?, *, +, {m,n}; each start reports its\n"
+           "                  shortest match, at most 1K long\n"
+           "  -x, --hex       marks are hex bytes, blanks ignored, ?? for any byte\n"
+           "  -i, --ignore-case  ASCII letters match either case\n"
+           "  --encoding=LIST search literal marks, read as UTF-8, in each of the\n"
+           "                  comma separated raw, utf16le, utf16be or utf16 (both)\n"
+           "                  encodings in one pass (default raw)\n"
+           "  -f, --file=FILE read more marks from FILE, one per line; blank lines\n"
+           "                  and lines starting with '#' are skipped\n"
+           "  --cache=FILE    keep the compiled patterns in FILE and reuse them while\n"
+           "                  the marks stay the same\n"
+           "  -B BYTES        write BYTES before each hit instead of whole buffers\n"
+           "  -A BYTES        write BYTES after each hit instead of whole buffers\n"
+           "  --all           report every hit, also inside context windows\n"
+           "  --slots=N       ring buffer slots (default 16)\n"
+           "  --slot-size=SIZE  bytes per ring slot (default 4K)\n"
+           "  --huge-pages    back the ring with MAP_HUGETLB pages\n"
+           "  --index=FILE    append a match index to FILE ('-' for stdout) instead\n"
+           "                  of writing context\n"
+           "  --index-format=FMT  json (JSON Lines, default) or binary records\n"
+           "  --index-hash    store an FNV-1a hash of each context window\n"
+           "  --extract=FILE  write the windows listed in index FILE without scanning;\n"
+           "                  -A/-B override the recorded windows\n"
+           "  --offset=SIZE   start scanning at SIZE, a multiple of the slot size\n"
+           "  --length=SIZE   scan at most SIZE bytes\n"
+           "  --checkpoint=FILE  save progress to FILE and resume from it if it exists\n"
+           "  --checkpoint-every=SIZE  bytes scanned between checkpoints (default 1G)\n"
+           "  --progress[=SECS]  report throughput, ETA and where time goes every SECS\n"
+           "                  seconds (default 2) on stderr\n"
+           "  --bench[=SIZE]  benchmark readers, pattern counts, slot sizes and\n"
+           "                  collectors on SIZE byte corpora (default 16M) and exit\n"
+           "  --reader=TYPE   auto, mmap, direct, buffered or uring (default auto)\n"
+           "  --io-size=SIZE  read size for direct/buffered/uring readers, 1M-16M\n"
+           "  --queue-depth=N reads kept in flight by the uring reader (default 8)\n"
+           "  --threads=N     scan seekable inputs with N threads (default 1)\n"
+           "  --shard-size=SIZE  bytes per thread work item (default 256M)\n"
+           "  --input=PATH    scan PATH, a file, device or directory; may be given\n"
+           "                  more than once, output is tagged with the input\n"
+           "  -r, --recursive scan the files and devices below directory inputs\n"
+           "  -z, --decompress  scan gzip, BGZF, zstd or lz4 input decompressed;\n"
+           "                  offsets are in the decompressed data, and --threads\n"
+           "                  decompresses BGZF blocks in parallel\n"
+           "  --blocks=WHICH  scan only the used or the free blocks of the ext4 or XFS\n"
+           "                  file system on the input; the rest reads as zeros\n"
+           "  --output-queue=SIZE  context a writer thread may lag behind the scan by,\n"
+           "                  copied out of the ring (default 16M, 0: write from the\n"
+           "                  scan loop)\n"
+           "  --output-full=POLICY  block (default) waits for the writer once the\n"
+           "                  queue is full, spill moves the rest to a temp file\n"
+           "  --rescue[=MAP]  read past sectors that fail: they read as zeros and are\n"
+           "                  appended to the MAP file, whose ranges are not read again\n"
+           "  --retries=N     reads of a failing sector before it is given up (default 1)\n"
+           "  --max-rate=SIZE read at most SIZE bytes per second\n"
+           "  --max-iops=N    issue at most N reads per second\n"
+           "  --max-latency=MS  halve the read rate while the p99 latency of reads\n"
+           "                  goes over MS milliseconds, and raise it back when it\n"
+           "                  stays under half of that\n"
+           "  --idle          read in the idle I/O class (BFQ and CFQ schedulers)\n",
+           prog, prog);
+}
+
+#ifndef BGREP_LIBRARY
 int main(int argc, const char *argv[])
 {
     // return test();
-    if (argc < 3 ) {
-        printf("Usage: %s /dev/sda mark\n", argv[0]);
+    enum { OPT_READER = 256, OPT_IO_SIZE, OPT_QUEUE_DEPTH, OPT_THREADS, OPT_SHARD_SIZE,
+           OPT_ALL, OPT_SLOTS, OPT_SLOT_SIZE, OPT_HUGE_PAGES, OPT_INDEX, OPT_INDEX_FORMAT,
+           OPT_INDEX_HASH, OPT_EXTRACT, OPT_OFFSET, OPT_LENGTH, OPT_CHECKPOINT,
+           OPT_CHECKPOINT_EVERY, OPT_PROGRESS, OPT_BENCH, OPT_CACHE,
+           OPT_ENCODING, OPT_INPUT, OPT_BLOCKS, OPT_OUTPUT_QUEUE, OPT_OUTPUT_FULL,
+           OPT_RESCUE, OPT_RETRIES, OPT_MAX_RATE, OPT_MAX_IOPS, OPT_MAX_LATENCY, OPT_IDLE };
+    static const struct option long_options[] = {
+        { "all", no_argument, NULL, OPT_ALL },
+        { "regex", no_argument, NULL, 'E' },
+        { "hex", no_argument, NULL, 'x' },
+        { "ignore-case", no_argument, NULL, 'i' },
+        { "encoding", required_argument, NULL, OPT_ENCODING },
+        { "file", required_argument, NULL, 'f' },
+        { "input", required_argument, NULL, OPT_INPUT },
+        { "recursive", no_argument, NULL, 'r' },
+        { "decompress", no_argument, NULL, 'z' },
+        { "blocks", required_argument, NULL, OPT_BLOCKS },
+        { "output-queue", required_argument, NULL, OPT_OUTPUT_QUEUE },
+        { "output-full", required_argument, NULL, OPT_OUTPUT_FULL },
+        { "rescue", optional_argument, NULL, OPT_RESCUE },
+        { "retries", required_argument, NULL, OPT_RETRIES },
+        { "max-rate", required_argument, NULL, OPT_MAX_RATE },
+        { "max-iops", required_argument, NULL, OPT_MAX_IOPS },
+        { "max-latency", required_argument, NULL, OPT_MAX_LATENCY },
+        { "idle", no_argument, NULL, OPT_IDLE },
+        { "cache", required_argument, NULL, OPT_CACHE },
+        { "slots", required_argument, NULL, OPT_SLOTS },
+        { "slot-size", required_argument, NULL, OPT_SLOT_SIZE },
+        { "huge-pages", no_argument, NULL, OPT_HUGE_PAGES },
+        { "index", required_argument, NULL, OPT_INDEX },
+        { "index-format", required_argument, NULL, OPT_INDEX_FORMAT },
+        { "index-hash", no_argument, NULL, OPT_INDEX_HASH },
+        { "extract", required_argument, NULL, OPT_EXTRACT },
+        { "offset", required_argument, NULL, OPT_OFFSET },
+        { "length", required_argument, NULL, OPT_LENGTH },
+        { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+        { "checkpoint-every", required_argument, NULL, OPT_CHECKPOINT_EVERY },
+        { "progress", optional_argument, NULL, OPT_PROGRESS },
+        { "bench", optional_argument, NULL, OPT_BENCH },
+        { "reader", required_argument, NULL, OPT_READER },
+        { "io-size", required_argument, NULL, OPT_IO_SIZE },
+        { "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+        { "threads", required_argument, NULL, OPT_THREADS },
+        { "shard-size", required_argument, NULL, OPT_SHARD_SIZE },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Options options;
+    uint64_t max_rate = 0;
+    uint64_t max_iops = 0;
+    uint64_t max_latency = 0;
+    int opt;
+    while ((opt = getopt_long(argc, (char *const *)argv, "+hExirzf:A:B:", long_options, NULL)) != -1)
+    {
+        uint64_t size = 0;
+        switch (opt)
+        {
+        case 'A':
+        case 'B':
+            if (!parseSize(optarg, &size))
+            {
+                fprintf(stderr, "invalid context size: %s\n", optarg);
+                return 1;
+            }
+            options.byte_context = true;
+            (opt == 'A' ? options.after : options.before) = size;
+            break;
+        case OPT_ALL:
+            options.all = true;
+            break;
+        case 'E':
+            options.regex = true;
+            break;
+        case 'x':
+            options.hex = true;
+            break;
+        case 'i':
+            options.fold_case = true;
+            break;
+        case OPT_ENCODING:
+            if (!parseEncodings(optarg, &options.encodings))
+            {
+                fprintf(stderr, "unknown encoding in: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            options.pattern_files.push_back(optarg);
+            break;
+        case OPT_INPUT:
+            options.inputs.push_back(optarg);
+            break;
+        case 'r':
+            options.recursive = true;
+            break;
+        case 'z':
+            options.decompress = true;
+            break;
+        case OPT_BLOCKS:
+            if (strcmp(optarg, "used") == 0)
+                options.blocks = Options::BLOCKS_USED;
+            else if (strcmp(optarg, "free") == 0)
+                options.blocks = Options::BLOCKS_FREE;
+            else
+            {
+                fprintf(stderr, "--blocks takes used or free: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_OUTPUT_QUEUE:
+            if (!parseSize(optarg, &size) || size > (uint64_t)SIZE_MAX / 2)
+            {
+                fprintf(stderr, "invalid output queue size: %s\n", optarg);
+                return 1;
+            }
+            options.output_queue = size;
+            break;
+        case OPT_OUTPUT_FULL:
+            if (strcmp(optarg, "block") == 0)
+                options.output_full = AsyncCollector::POLICY_BLOCK;
+            else if (strcmp(optarg, "spill") == 0)
+                options.output_full = AsyncCollector::POLICY_SPILL;
+            else
+            {
+                fprintf(stderr, "--output-full takes block or spill: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_RESCUE:
+            if (options.bad_blocks == NULL)
+                options.bad_blocks = new BadBlocks();
+            if (optarg != NULL && !options.bad_blocks->open(optarg))
+            {
+                fprintf(stderr, "opening %s failed: %s\n", optarg, strerror(errno));
+                return 1;
+            }
+            break;
+        case OPT_RETRIES:
+            options.retries = atoi(optarg);
+            if (options.retries > 100)
+            {
+                fprintf(stderr, "retries must be between 0 and 100\n");
+                return 1;
+            }
+            break;
+        case OPT_MAX_RATE:
+            if (!parseSize(optarg, &max_rate) || max_rate < 4096)
+            {
+                fprintf(stderr, "max rate must be at least 4K\n");
+                return 1;
+            }
+            break;
+        case OPT_MAX_IOPS:
+            max_iops = atoi(optarg);
+            if (max_iops < 1 || max_iops > 1000000)
+            {
+                fprintf(stderr, "max iops must be between 1 and 1000000\n");
+                return 1;
+            }
+            break;
+        case OPT_MAX_LATENCY:
+            max_latency = atoi(optarg);
+            if (max_latency < 1 || max_latency > 60000)
+            {
+                fprintf(stderr, "max latency must be between 1 and 60000 ms\n");
+                return 1;
+            }
+            break;
+        case OPT_IDLE:
+            options.idle_io = true;
+            break;
+        case OPT_CACHE:
+            options.cache = optarg;
+            break;
+        case OPT_SLOTS:
+            options.buffer_num = atoi(optarg);
+            if (options.buffer_num < 2 || options.buffer_num > 65536)
+            {
+                fprintf(stderr, "slots must be between 2 and 65536\n");
+                return 1;
+            }
+            break;
+        case OPT_SLOT_SIZE:
+            if (!parseSize(optarg, &size) || size < 16 || size > 256 * 1024 * 1024)
+            {
+                fprintf(stderr, "slot size must be between 16 and 256M\n");
+                return 1;
+            }
+            options.buffer_size = size;
+            break;
+        case OPT_HUGE_PAGES:
+            options.huge_pages = true;
+            break;
+        case OPT_INDEX:
+            options.index = optarg;
+            break;
+        case OPT_INDEX_FORMAT:
+            if (strcmp(optarg, "json") == 0)
+                options.index_format = IndexCollector::FORMAT_JSON;
+            else if (strcmp(optarg, "binary") == 0)
+                options.index_format = IndexCollector::FORMAT_BINARY;
+            else
+            {
+                fprintf(stderr, "unknown index format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_INDEX_HASH:
+            options.index_hash = true;
+            break;
+        case OPT_EXTRACT:
+            options.extract = optarg;
+            break;
+        case OPT_OFFSET:
+            if (!parseSize(optarg, &options.offset))
+            {
+                fprintf(stderr, "invalid offset: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_LENGTH:
+            if (!parseSize(optarg, &options.length) || options.length == 0)
+            {
+                fprintf(stderr, "invalid length: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_CHECKPOINT:
+            options.checkpoint = optarg;
+            break;
+        case OPT_BENCH:
+            size = 16 * 1024 * 1024;
+            if (optarg != NULL && (!parseSize(optarg, &size) || size < 1024 * 1024))
+            {
+                fprintf(stderr, "bench size must be at least 1M\n");
+                return 1;
+            }
+            return bench(size);
+        case OPT_PROGRESS:
+            options.progress = optarg != NULL ? atoi(optarg) : 2;
+            if (options.progress < 1 || options.progress > 86400)
+            {
+                fprintf(stderr, "progress interval must be between 1 and 86400 seconds\n");
+                return 1;
+            }
+            break;
+        case OPT_CHECKPOINT_EVERY:
+            if (!parseSize(optarg, &options.checkpoint_every) || options.checkpoint_every == 0)
+            {
+                fprintf(stderr, "invalid checkpoint interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_READER:
+            if (strcmp(optarg, "auto") == 0)
+                options.reader = Options::READER_AUTO;
+            else if (strcmp(optarg, "mmap") == 0)
+                options.reader = Options::READER_MMAP;
+            else if (strcmp(optarg, "direct") == 0)
+                options.reader = Options::READER_DIRECT;
+            else if (strcmp(optarg, "buffered") == 0)
+                options.reader = Options::READER_BUFFERED;
+            else if (strcmp(optarg, "uring") == 0)
+                options.reader = Options::READER_URING;
+            else
+            {
+                fprintf(stderr, "unknown reader: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_IO_SIZE:
+            if (!parseSize(optarg, &size) || size < 1024 * 1024
+                || size > 16 * 1024 * 1024 || size % FileReader::kAlignment != 0)
+            {
+                fprintf(stderr, "io size must be a multiple of 4K between 1M and 16M\n");
+                return 1;
+            }
+            options.io_size = size;
+            break;
+        case OPT_QUEUE_DEPTH:
+            options.queue_depth = atoi(optarg);
+            if (options.queue_depth < 1 || options.queue_depth > 256)
+            {
+                fprintf(stderr, "queue depth must be between 1 and 256\n");
+                return 1;
+            }
+            break;
+        case OPT_THREADS:
+            options.threads = atoi(optarg);
+            if (options.threads < 1 || options.threads > 1024)
+            {
+                fprintf(stderr, "threads must be between 1 and 1024\n");
+                return 1;
+            }
+            break;
+        case OPT_SHARD_SIZE:
+            if (!parseSize(optarg, &size) || size < 1024 * 1024)
+            {
+                fprintf(stderr, "shard size must be at least 1M\n");
+                return 1;
+            }
+            options.shard_size = size;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Slots, and shards, then line up with those of a scan from the start.
+    if (options.offset % options.buffer_size != 0)
+    {
+        fprintf(stderr, "offset must be a multiple of the slot size\n");
+        return 1;
+    }
+    if (options.extract != NULL && options.decompress)
+    {
+        fprintf(stderr, "--extract reads windows back by offset, which -z inputs cannot\n");
+        return 1;
+    }
+    // The index says what to write: the device is the only operand.
+    if (options.extract != NULL)
+    {
+        if (argc - optind != 1 || !options.inputs.empty())
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        return extract(options, argv[optind]);
+    }
+    // With --input every operand is a mark.
+    int first_mark = options.inputs.empty() ? optind + 1 : optind;
+    if (argc - first_mark < (options.pattern_files.empty() ? 1 : 0) || first_mark > argc) {
+        usage(argv[0]);
         return 1;
     }
-    return run(argv[1], argc - 2, argv + 2);
+    if (options.hex && options.regex)
+    {
+        fprintf(stderr, "-x and -E cannot be combined\n");
+        return 1;
+    }
+    if (options.bad_blocks != NULL && (options.decompress || options.reader == Options::READER_MMAP))
+    {
+        fprintf(stderr, "--rescue reads around bad sectors, which -z and --reader=mmap cannot\n");
+        return 1;
+    }
+    if ((max_rate > 0 || max_iops > 0 || max_latency > 0) && options.reader == Options::READER_MMAP)
+    {
+        fprintf(stderr, "--max-rate, --max-iops and --max-latency cannot pace --reader=mmap\n");
+        return 1;
+    }
+    if (max_rate > 0 || max_iops > 0 || max_latency > 0)
+        options.throttle = new Throttle(max_rate, max_iops, max_latency * 1000000);
+    if (options.inputs.empty())
+        options.inputs.push_back(argv[optind]);
+    if (options.blocks != Options::BLOCKS_ALL && !loadBlockMap(&options))
+        return 1;
+    std::vector<std::string> marks(argv + first_mark, argv + argc);
+    for (size_t i = 0; i < options.pattern_files.size(); ++i)
+    {
+        if (!readPatterns(options.pattern_files[i], &marks))
+        {
+            fprintf(stderr, "reading patterns from %s failed: %s\n",
+                    options.pattern_files[i], strerror(errno));
+            return 1;
+        }
+    }
+    int ret = run(options, marks);
+    if (options.bad_blocks != NULL)
+    {
+        if (options.bad_blocks->count() > 0)
+            fprintf(stderr, "%s in %zu bad ranges read as zeros\n",
+                    formatSize(options.bad_blocks->bytes()).c_str(),
+                    options.bad_blocks->count());
+        delete options.bad_blocks;
+    }
+    delete options.throttle;
+    return ret;
 }
+#endif
 
 
 
@@ -0,0 +1,100 @@
+// Embedding interface of bgrep: the matchers and readers of the command
+// line tool, driven in-process. Build the library by compiling bgrep.cpp
+// with -DBGREP_LIBRARY, which leaves out main(), and link it with
+// -lpthread (and -lz, -lzstd, -llz4 for the HAVE_ options it was built
+// with).
+//
+// Hits are handed to a HitHandler with spans pointing into memory the
+// scanner owns, or into the caller's buffer for scan(). Nothing is
+// allocated per hit.
+#ifndef BGREP_H
+#define BGREP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace bgrep
+{
+
+// A hit and the bytes around it. The pointers are only valid during the
+// HitHandler call.
+struct Hit
+{
+    uint64_t offset;          // of the first byte of the hit in the input
+    uint32_t pattern;         // in the order patterns were added
+    uint32_t length;
+    uint64_t context_offset;  // input offset of context[0]
+    const char *context;      // the hit and up to the context asked for
+    size_t context_length;
+};
+
+class HitHandler
+{
+public:
+    // Return values of onHit besides a context length.
+    static const long kContinue = 0;
+    static const long kStop = -1;
+
+    virtual ~HitHandler()
+    { }
+    // Called for each hit. Return kContinue for the next one, kStop to
+    // end the scan, or a byte count to be called again for the same hit
+    // once that many bytes after its end are in context, or the input has
+    // ended.
+    virtual long onHit(const Hit &hit) = 0;
+};
+
+// Scans memory, a stream of buffers or a file for a set of patterns.
+// Every hit is reported, overlapping ones included. Hits are reported
+// once the bytes they end in are fed; those ending in the same block are
+// ordered by start offset.
+class Scanner
+{
+public:
+    // More context than this is not kept for a hit.
+    static const size_t kMaxContext = 64 * 1024 * 1024;
+
+    Scanner();
+    ~Scanner();
+
+    // Patterns added after it: ASCII letters match either case.
+    void setFoldCase(bool fold_case);
+    void addPattern(const char *data, size_t length);
+    // A regular expression as taken by bgrep -E; false on a syntax
+    // error, see error().
+    bool addRegex(const char *expr);
+    // Must be called after the last pattern is added.
+    void compile();
+    // Bytes of context before a hit's start and after its end.
+    void setContext(size_t before, size_t after);
+    const char *error() const;
+
+    // Scans data[0, length) in place, with context spans pointing into
+    // it. False if the handler stopped the scan.
+    bool scan(const char *data, size_t length, HitHandler *handler);
+
+    // Streams: feed the input in pieces of any size, starting at input
+    // offset offset, then call finish for the hits still waiting for
+    // context. The bytes are copied into the scanner's history, which
+    // context spans point into. False once the handler stopped the scan.
+    void reset(uint64_t offset = 0);
+    bool feed(const char *data, size_t length, HitHandler *handler);
+    bool finish(HitHandler *handler);
+
+    // Streams the file or device at path through the reader bgrep would
+    // pick. Returns 0 when done, 1 if the handler stopped and -1 if the
+    // input could not be read.
+    int scanFile(const char *path, HitHandler *handler);
+
+private:
+    struct Impl;
+
+    Scanner(const Scanner &);
+    Scanner &operator=(const Scanner &);
+
+    Impl *_impl;
+};
+
+}
+
+#endif